@@ -0,0 +1,148 @@
+/*
+C++20 coroutine client API for coap-simple.
+
+A request is awaited instead of being answered through a callback:
+
+  CoapTask readAndForward(Coap &coap)
+  {
+      CoapPacket *temp = co_await coapGet(coap, sensor, 5683, "sensor/temp");
+      if (temp == NULL)
+          co_return; // timed out or reset
+      co_await coapPut(coap, controller, 5683, "setpoint", (const char *)temp->payload, temp->payloadlen);
+  }
+
+The coroutine is resumed from Coap::loop() when the response arrives, on
+the same thread and without extra threads. The awaiter lives in the
+coroutine frame and the request uses a slot of the transaction table, so
+awaiting allocates nothing; only the frame of a CoapTask is allocated,
+once, when it starts. The number of requests in flight is bounded by
+Traits::MAX_TRANSACTIONS.
+
+The response points into the receive buffer. It is valid until the
+coroutine suspends again; copy what is needed before the next co_await.
+
+A group request with MULTICAST is answered by every member, and a
+coroutine can only be resumed once, so awaiting one yields NULL at once
+without sending it. Send those with a callback.
+*/
+#ifndef __SIMPLE_COAP_CORO_H__
+#define __SIMPLE_COAP_CORO_H__
+
+#include "coap-simple.h"
+
+#if !defined(__cpp_impl_coroutine)
+#error "coap-simple-coro.h needs C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+
+/**
+ * @brief Fire-and-forget coroutine type.
+ *
+ * It starts running when called and frees its frame when it finishes.
+ */
+struct CoapTask
+{
+    struct promise_type
+    {
+        CoapTask get_return_object() { return CoapTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/**
+ * @brief Awaiter of one request, see coapGet(), coapPut() and coapSend().
+ *
+ * co_await yields the response, or NULL if the request timed out, was reset
+ * or cancelled, or could not be sent because the transaction table was full
+ * or it went to a multicast group.
+ */
+template <class Traits>
+class CoapRequest
+{
+public:
+    CoapRequest(BasicCoap<Traits> &coap, IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method,
+                const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type)
+        : coap(coap), ip(ip), port(port), url(url), type(type), method(method),
+          payload(payload), payloadlen(payloadlen), content_type(content_type)
+    {
+    }
+
+    // not copyable, the transaction refers to it until it completes
+    CoapRequest(const CoapRequest &) = delete;
+    CoapRequest &operator=(const CoapRequest &) = delete;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        // the callback of a group request runs for every answer and once
+        // more at expiry, which would resume a finished frame
+        if (Traits::MULTICAST && coapIsMulticast(ip))
+            return false;
+        waiter = h;
+        handle = coap.send(ip, port, url, type, method, payload, payloadlen, content_type, completed, this);
+        // not sent, carry on at once with a NULL response
+        return handle != 0;
+    }
+
+    CoapPacket *await_resume() const noexcept { return response; }
+
+    /**
+     * @brief The transaction handle, for Coap::cancel() from elsewhere.
+     */
+    uint16_t transaction() const { return handle; }
+
+private:
+    BasicCoap<Traits> &coap;
+    IPAddress ip;
+    int port;
+    const char *url;
+    COAP_TYPE type;
+    COAP_METHOD method;
+    const uint8_t *payload;
+    size_t payloadlen;
+    COAP_CONTENT_TYPE content_type;
+
+    std::coroutine_handle<> waiter;
+    uint16_t handle = 0;
+    CoapPacket *response = NULL;
+
+    static void completed(CoapPacket *response, IPAddress ip, int port, void *context)
+    {
+        CoapRequest *self = (CoapRequest *)context;
+        self->response = response;
+        self->waiter.resume();
+    }
+};
+
+template <class Traits>
+CoapRequest<Traits> coapSend(BasicCoap<Traits> &coap, IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method,
+                             const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type = COAP_NONE)
+{
+    return CoapRequest<Traits>(coap, ip, port, url, type, method, payload, payloadlen, content_type);
+}
+
+template <class Traits>
+CoapRequest<Traits> coapGet(BasicCoap<Traits> &coap, IPAddress ip, int port, const char *url)
+{
+    return CoapRequest<Traits>(coap, ip, port, url, COAP_CON, COAP_GET, NULL, 0, COAP_NONE);
+}
+
+template <class Traits>
+CoapRequest<Traits> coapPut(BasicCoap<Traits> &coap, IPAddress ip, int port, const char *url, const char *payload, size_t payloadlen)
+{
+    return CoapRequest<Traits>(coap, ip, port, url, COAP_CON, COAP_PUT, (const uint8_t *)payload, payloadlen, COAP_NONE);
+}
+
+template <class Traits>
+CoapRequest<Traits> coapPost(BasicCoap<Traits> &coap, IPAddress ip, int port, const char *url, const char *payload, size_t payloadlen)
+{
+    return CoapRequest<Traits>(coap, ip, port, url, COAP_CON, COAP_POST, (const uint8_t *)payload, payloadlen, COAP_NONE);
+}
+
+#endif
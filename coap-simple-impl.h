@@ -0,0 +1,3227 @@
+/*
+Template definitions of BasicCoap and BasicCoapUri, included at the end of
+coap-simple.h. The parts that do not depend on the configuration live in
+coap-simple.cpp.
+*/
+#ifndef __SIMPLE_COAP_IMPL_H__
+#define __SIMPLE_COAP_IMPL_H__
+
+#include "Arduino.h"
+
+template <uint8_t Capacity>
+BasicCoapUri<Capacity>::~BasicCoapUri()
+{
+    if (arena != NULL)
+        return;
+    for (int i = 0; i < Capacity; i++)
+        delete[] u[i];
+}
+
+template <uint8_t Capacity>
+void BasicCoapUri<Capacity>::add(CoapCallback call, const char *url)
+{
+    size_t len = strlen(url);
+    uint32_t hash = coapHash(COAP_HASH_SEED, (const uint8_t *)url, len);
+    uint16_t slot = hash & (INDEX_SIZE - 1);
+
+    while (index[slot] != 0)
+    {
+        uint8_t route = index[slot] - 1;
+        if (h[route] == hash && l[route] == len && memcmp(u[route], url, len) == 0)
+        {
+            c[route] = call;
+            return;
+        }
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+    }
+
+    if (count >= Capacity)
+        return;
+
+    char *copy = arena != NULL ? (char *)arena->allocate(len + 1) : new char[len + 1];
+    if (copy == NULL)
+        return;
+    memcpy(copy, url, len + 1);
+
+    u[count] = copy;
+    l[count] = len;
+    c[count] = call;
+    h[count] = hash;
+    index[slot] = ++count;
+}
+
+template <uint8_t Capacity>
+bool BasicCoapUri<Capacity>::matches(uint8_t route, const CoapPacket &packet) const
+{
+    const char *url = u[route];
+    size_t pos = 0;
+    bool first = true;
+
+    for (const CoapOption *option = packet.getOption(COAP_URI_PATH); option != NULL; option = packet.nextOption(option))
+    {
+        if (option->length == 0)
+            continue;
+        if (!first)
+        {
+            if (url[pos] != '/')
+                return false;
+            pos++;
+        }
+        if (pos + option->length > l[route] || memcmp(url + pos, option->buffer, option->length) != 0)
+            return false;
+        pos += option->length;
+        first = false;
+    }
+    return pos == l[route];
+}
+
+template <uint8_t Capacity>
+CoapCallback BasicCoapUri<Capacity>::find(const CoapPacket &packet) const
+{
+    uint32_t hash = packet.uriPathHash();
+    uint16_t slot = hash & (INDEX_SIZE - 1);
+
+    while (index[slot] != 0)
+    {
+        uint8_t route = index[slot] - 1;
+        if (h[route] == hash && matches(route, packet))
+            return c[route];
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+    }
+    return NULL;
+}
+
+template <class Traits>
+BasicCoap<Traits>::BasicCoap(
+    UDP &udp,
+    int coap_buf_size /* default value is Traits::BUF_MAX_SIZE */
+)
+{
+    this->_udp = &udp;
+    this->coap_buf_size = coap_buf_size;
+    this->tx_buffer = new uint8_t[this->coap_buf_size];
+    this->rx_buffer = new uint8_t[this->coap_buf_size];
+    this->init();
+}
+
+template <class Traits>
+BasicCoap<Traits>::BasicCoap(
+    UDP &udp,
+    CoapArena &arena,
+    int coap_buf_size /* default value is Traits::BUF_MAX_SIZE */
+)
+{
+    this->_udp = &udp;
+    this->arena = &arena;
+    this->uri.setArena(&arena);
+    this->tx_buffer = (uint8_t *)arena.allocate(coap_buf_size);
+    this->rx_buffer = (uint8_t *)arena.allocate(coap_buf_size);
+    // without both buffers the instance stays unusable and start() fails
+    this->coap_buf_size = (this->tx_buffer != NULL && this->rx_buffer != NULL) ? coap_buf_size : 0;
+    this->init();
+}
+
+template <class Traits>
+void BasicCoap<Traits>::init()
+{
+
+    for (uint8_t i = 0; i < Traits::MAX_TRANSACTIONS; i++)
+        this->transactions[i].newer = i + 1 < Traits::MAX_TRANSACTIONS ? i + 1 : NO_TRANSACTION;
+
+    if (Traits::PROXY)
+    {
+        for (uint8_t i = 0; i < Traits::PROXY_CACHE_ENTRIES; i++)
+        {
+            this->proxy->entries[i].newer = i + 1 < Traits::PROXY_CACHE_ENTRIES ? i + 1 : NO_PROXY_ENTRY;
+            this->proxy->entries[i].owner = this;
+        }
+        for (uint8_t i = 0; i < Traits::PROXY_WAITERS; i++)
+            this->proxy->waiters[i].next = i + 1 < Traits::PROXY_WAITERS ? i + 1 : NO_PROXY_ENTRY;
+    }
+
+    if (!Traits::OBSERVE)
+        return;
+    for (uint16_t i = 0; i < Traits::MAX_OBSERVERS; i++)
+        this->observe->entries[i].next = i + 1 < Traits::MAX_OBSERVERS ? i + 1 : NO_OBSERVER;
+}
+
+template <class Traits>
+BasicCoap<Traits>::~BasicCoap()
+{
+    if (this->arena != NULL)
+        return;
+
+    if (this->tx_buffer != NULL)
+        delete[] this->tx_buffer;
+
+    if (this->rx_buffer != NULL)
+        delete[] this->rx_buffer;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::start()
+{
+    return this->start(COAP_DEFAULT_PORT);
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::start(int port)
+{
+    if (this->coap_buf_size < COAP_HEADER_SIZE)
+        return false;
+    this->_udp->begin(port);
+    this->messageid = coapRandom();
+    if (Traits::TRACE)
+        trace->local_port = port;
+    return true;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::handOff(CoapHandOff hook, void *context, uint8_t *buffer)
+{
+    this->handoff = buffer != NULL ? hook : NULL;
+    this->handoff_context = context;
+    this->rx_lent = this->handoff != NULL ? buffer : NULL;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendReply(IPAddress ip, int port, uint16_t request_messageid, uint8_t *buffer, uint16_t len)
+{
+    if (len < COAP_HEADER_SIZE || ((buffer[0] & 0xC0) >> 6) != 1)
+        return 0;
+    if (((buffer[0] & 0x30) >> 4) == COAP_NONCON)
+    {
+        uint16_t id = nextMessageId();
+        buffer[2] = (uint8_t)(id >> 8);
+        buffer[3] = (uint8_t)(id & 0xFF);
+    }
+    uint16_t messageid = buffer[2] << 8 | buffer[3];
+
+    TransmitAction action = TRANSMIT_NOW;
+    if (((buffer[0] & 0x30) >> 4) == COAP_CON)
+        action = scheduleTransmission(ip, port, messageid, buffer, len);
+    if (action == TRANSMIT_DROPPED)
+    {
+        count(COAP_STAT_TX_FAILED);
+        return 0;
+    }
+
+    // the request is still in the dedup ring unless it expired meanwhile
+    if (Traits::DEDUP)
+    {
+        int16_t n = dedupFind(ip, port, request_messageid);
+        if (n >= 0 && dedup->entries[n].len == 0)
+        {
+            dedup->current = n;
+            dedupCapture(ip, port, buffer, len);
+        }
+    }
+    if (action == TRANSMIT_QUEUED)
+        return messageid;
+
+    traceRecord(COAP_TRACE_TX, ip, port, buffer, len);
+    unsigned long started = timingStart();
+    _udp->beginPacket(ip, port);
+    _udp->write(buffer, len);
+    _udp->endPacket();
+    timingEnd(COAP_TIMING_SEND, started);
+    count(COAP_STAT_TX);
+    return messageid;
+}
+
+template <class Traits>
+unsigned long BasicCoap<Traits>::timingStart() const
+{
+    return Traits::STATS ? micros() : 0;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::timingEnd(COAP_TIMING timing, unsigned long start)
+{
+    if (Traits::STATS)
+        stats->timings[timing].record(micros() - start);
+}
+
+template <class Traits>
+void BasicCoap<Traits>::traceRecord(COAP_TRACE_DIRECTION direction, IPAddress ip, int port, const uint8_t *message, size_t len,
+                                    const uint8_t *tail, size_t taillen)
+{
+    if (Traits::TRACE)
+        trace->record(direction, ip, port, micros(), message, len, tail, taillen);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendPacket(CoapPacket &packet, IPAddress ip)
+{
+    return this->sendPacket(packet, ip, COAP_DEFAULT_PORT);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendPacket(CoapPacket &packet, IPAddress ip, int port)
+{
+    uint16_t packetSize = encodePacket(packet);
+    if (packetSize == 0)
+    {
+        count(COAP_STAT_TX_FAILED);
+        return 0;
+    }
+
+    // make payload
+    if (packet.payloadlen > 0)
+    {
+        if ((packetSize + 1 + packet.payloadlen) >= (size_t)coap_buf_size)
+        {
+            count(COAP_STAT_TX_FAILED);
+            return 0;
+        }
+        this->tx_buffer[packetSize] = 0xFF;
+        memcpy(this->tx_buffer + packetSize + 1, packet.payload, packet.payloadlen);
+        packetSize += 1 + packet.payloadlen;
+    }
+
+    return transmitPacket(packet, ip, port, packetSize);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::transmitPacket(IPAddress ip, int port, uint8_t type, uint16_t messageid, uint16_t packetSize)
+{
+    // a stream needs no retransmission or replay
+    uint8_t c = tcpFind(ip, port);
+    if (c != NO_CONNECTION)
+        return tcpWrite(c, this->tx_buffer, packetSize) ? messageid : 0;
+
+    // the response to a group request waits for its Leisure
+    if (Traits::MULTICAST && multicast->dispatching && (this->tx_buffer[1] >> 5) >= 2 &&
+        multicast->port == (uint16_t)port && multicast->ip == ip)
+        return multicastDelay(ip, port, packetSize) ? messageid : 0;
+
+    TransmitAction action = TRANSMIT_NOW;
+    if (type == COAP_CON)
+        action = scheduleTransmission(ip, port, messageid, this->tx_buffer, packetSize);
+    if (action == TRANSMIT_DROPPED)
+    {
+        count(COAP_STAT_TX_FAILED);
+        return 0;
+    }
+
+    dedupCapture(ip, port, this->tx_buffer, packetSize);
+    if (action == TRANSMIT_QUEUED)
+        return messageid;
+
+    traceRecord(COAP_TRACE_TX, ip, port, this->tx_buffer, packetSize);
+    unsigned long started = timingStart();
+    _udp->beginPacket(ip, port);
+    _udp->write(this->tx_buffer, packetSize);
+    _udp->endPacket();
+    timingEnd(COAP_TIMING_SEND, started);
+    count(COAP_STAT_TX);
+
+    return messageid;
+}
+
+template <class Traits>
+CoapResponseWriter BasicCoap<Traits>::reply(const CoapPacket &request, IPAddress ip, int port, COAP_RESPONSE_CODE code)
+{
+    // piggybacked on the ACK of a CON request, a NON request gets a NON response
+    bool con = request.type == COAP_CON;
+    return CoapResponseWriter(this->tx_buffer, coap_buf_size, con ? COAP_ACK : COAP_NONCON, code,
+                              con ? request.messageid : nextMessageId(), request.token, request.tokenlen,
+                              ip, port, sendWritten, this);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendWritten(void *owner, CoapResponseWriter &writer)
+{
+    BasicCoap *coap = (BasicCoap *)owner;
+    const uint8_t *buffer = writer.data();
+    return coap->transmitPacket(writer.remoteIP(), writer.remotePort(), (buffer[0] >> 4) & 0x03,
+                                buffer[2] << 8 | buffer[3], writer.length());
+}
+
+template <class Traits>
+int16_t BasicCoap<Traits>::dedupFind(IPAddress ip, int port, uint16_t messageid) const
+{
+    if (!Traits::DEDUP)
+        return -1;
+    uint16_t slot = coapMessageIdHash(ip, port, messageid) & (DedupState::INDEX_SIZE - 1);
+    while (dedup->index[slot] != 0)
+    {
+        const DedupEntry &entry = dedup->entries[dedup->index[slot] - 1];
+        if (entry.messageid == messageid && entry.port == (uint16_t)port && entry.ip == ip)
+            return dedup->index[slot] - 1;
+        slot = (slot + 1) & (DedupState::INDEX_SIZE - 1);
+    }
+    return -1;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::dedupEvictOldest()
+{
+    DedupEntry &entry = dedup->entries[dedup->head];
+    uint16_t mask = DedupState::INDEX_SIZE - 1;
+    uint16_t slot = coapMessageIdHash(entry.ip, entry.port, entry.messageid) & mask;
+    while (dedup->index[slot] != dedup->head + 1)
+        slot = (slot + 1) & mask;
+
+    // backward-shift deletion keeps probe sequences intact without tombstones
+    uint16_t hole = slot;
+    for (uint16_t next = (hole + 1) & mask; dedup->index[next] != 0; next = (next + 1) & mask)
+    {
+        const DedupEntry &moved = dedup->entries[dedup->index[next] - 1];
+        uint16_t home = coapMessageIdHash(moved.ip, moved.port, moved.messageid) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            dedup->index[hole] = dedup->index[next];
+            hole = next;
+        }
+    }
+    dedup->index[hole] = 0;
+
+    dedup->head = (dedup->head + 1) % Traits::MAX_DEDUP;
+    dedup->count--;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::dedupExpire(unsigned long now)
+{
+    if (!Traits::DEDUP)
+        return;
+    while (dedup->count > 0 && (long)(now - dedup->entries[dedup->head].expires_ms) >= 0)
+        dedupEvictOldest();
+}
+
+template <class Traits>
+int16_t BasicCoap<Traits>::dedupInsert(IPAddress ip, int port, uint16_t messageid, unsigned long now)
+{
+    if (!Traits::DEDUP)
+        return -1;
+    if (dedup->count >= Traits::MAX_DEDUP)
+        dedupEvictOldest();
+
+    uint8_t n = (dedup->head + dedup->count) % Traits::MAX_DEDUP;
+    DedupEntry &entry = dedup->entries[n];
+    entry.ip = ip;
+    entry.port = (uint16_t)port;
+    entry.messageid = messageid;
+    entry.expires_ms = now + COAP_EXCHANGE_LIFETIME_MS;
+    entry.overflow = false;
+    entry.len = 0;
+    dedup->count++;
+
+    uint16_t slot = coapMessageIdHash(ip, port, messageid) & (DedupState::INDEX_SIZE - 1);
+    while (dedup->index[slot] != 0)
+        slot = (slot + 1) & (DedupState::INDEX_SIZE - 1);
+    dedup->index[slot] = n + 1;
+    return n;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::dedupCapture(IPAddress ip, int port, const uint8_t *buffer, uint16_t len)
+{
+    if (!Traits::DEDUP || dedup->current < 0)
+        return;
+    DedupEntry &entry = dedup->entries[dedup->current];
+    if (entry.port != (uint16_t)port || !(entry.ip == ip))
+        return;
+
+    if (len <= DEDUP_CACHE_SIZE)
+    {
+        memcpy(entry.buffer, buffer, len);
+        entry.len = len;
+    }
+    else
+        entry.overflow = true;
+    dedup->current = -1;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::transmitBefore(uint8_t a, uint8_t b) const
+{
+    // signed difference keeps the ordering correct across millis() wraparound
+    return (long)(transmissions[transmit_heap[a]].due_ms - transmissions[transmit_heap[b]].due_ms) < 0;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transmitHeapSwap(uint8_t i, uint8_t j)
+{
+    uint8_t t = transmit_heap[i];
+    transmit_heap[i] = transmit_heap[j];
+    transmit_heap[j] = t;
+    transmissions[transmit_heap[i]].heap_pos = i;
+    transmissions[transmit_heap[j]].heap_pos = j;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transmitHeapUp(uint8_t pos)
+{
+    if (Traits::MAX_TRANSMISSIONS == 1)
+        return; // one entry is always in order
+    while (pos > 0)
+    {
+        uint8_t parent = (pos - 1) / 2;
+        if (!transmitBefore(pos, parent))
+            break;
+        transmitHeapSwap(pos, parent);
+        pos = parent;
+    }
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transmitHeapDown(uint8_t pos)
+{
+    if (Traits::MAX_TRANSMISSIONS == 1)
+        return;
+    for (;;)
+    {
+        uint8_t smallest = pos;
+        uint8_t left = 2 * pos + 1;
+        uint8_t right = left + 1;
+        if (left < transmit_heap_len && transmitBefore(left, smallest))
+            smallest = left;
+        if (right < transmit_heap_len && transmitBefore(right, smallest))
+            smallest = right;
+        if (smallest == pos)
+            break;
+        transmitHeapSwap(pos, smallest);
+        pos = smallest;
+    }
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transmitHeapRemove(uint8_t pos)
+{
+    transmissions[transmit_heap[pos]].in_use = false;
+    transmit_heap_len--;
+    if (pos == transmit_heap_len)
+        return;
+    transmit_heap[pos] = transmit_heap[transmit_heap_len];
+    transmissions[transmit_heap[pos]].heap_pos = pos;
+    transmitHeapUp(pos);
+    transmitHeapDown(transmissions[transmit_heap[pos]].heap_pos);
+}
+
+// Stores a CON message for retransmission. With congestion control it is
+// queued instead of sent when its peer already has NSTART outstanding.
+template <class Traits>
+typename BasicCoap<Traits>::TransmitAction BasicCoap<Traits>::scheduleTransmission(IPAddress ip, int port, uint16_t messageid,
+                                                                                   const uint8_t *buffer, uint16_t len,
+                                                                                   const uint8_t *tail, uint16_t taillen)
+{
+    unsigned long now = millis();
+    uint8_t peer = NO_TRANSMISSION;
+    bool wait = false;
+    if (Traits::CONGESTION)
+    {
+        peer = congestionPeer(ip, port, now);
+        wait = congestion->peers[peer].outstanding >= Traits::NSTART;
+    }
+
+    // Messages that do not fit are sent once without retransmission, or not
+    // at all if they would have to wait. There is a free slot whenever the
+    // limit of their kind is not reached.
+    bool full = transmit_heap_len >= Traits::MAX_TRANSMISSIONS;
+    if (Traits::CONGESTION && wait)
+        full = congestion->queued >= Traits::CONGESTION_QUEUE;
+    if (len + taillen > Traits::BUF_MAX_SIZE || full)
+    {
+        if (wait)
+            return TRANSMIT_DROPPED;
+        count(COAP_STAT_TX_UNRELIABLE);
+        return TRANSMIT_NOW;
+    }
+    uint8_t slot = 0;
+    while (transmissions[slot].in_use)
+        slot++;
+
+    TransmissionEntry &entry = transmissions[slot];
+    entry.in_use = true;
+    entry.ip = ip;
+    entry.port = (uint16_t)port;
+    entry.messageid = messageid;
+    entry.retransmit_count = 0;
+    entry.peer = peer;
+    entry.len = len + taillen;
+    memcpy(entry.buffer, buffer, len);
+    if (taillen > 0)
+        memcpy(entry.buffer + len, tail, taillen);
+
+    if (wait)
+    {
+        CongestionPeer &p = congestion->peers[peer];
+        entry.queued = true;
+        entry.queue_next = NO_TRANSMISSION;
+        if (p.queue_tail != NO_TRANSMISSION)
+            transmissions[p.queue_tail].queue_next = slot;
+        else
+            p.queue_head = slot;
+        p.queue_tail = slot;
+        congestion->queued++;
+        count(COAP_STAT_TX_QUEUED);
+        return TRANSMIT_QUEUED;
+    }
+
+    uint32_t rto_ms = COAP_ACK_TIMEOUT_MS;
+    if (Traits::CONGESTION)
+    {
+        congestion->peers[peer].outstanding++;
+        rto_ms = congestionRto(congestion->peers[peer], now);
+    }
+    transmissionStart(entry, rto_ms, now);
+    return TRANSMIT_NOW;
+}
+
+// Arms the retransmission timer of an entry that is sent now.
+template <class Traits>
+void BasicCoap<Traits>::transmissionStart(TransmissionEntry &entry, uint32_t rto_ms, unsigned long now)
+{
+    entry.queued = false;
+    entry.sent_ms = now;
+    // initial timeout is random between RTO and RTO * ACK_RANDOM_FACTOR
+    unsigned long spread = (unsigned long)rto_ms * (COAP_ACK_RANDOM_FACTOR_PERCENT - 100) / 100;
+    entry.timeout_ms = rto_ms + (spread > 0 ? coapRandom() % (spread + 1) : 0);
+    entry.due_ms = now + entry.timeout_ms;
+    // CoCoA variable backoff: short RTOs grow faster, long ones slower
+    if (!Traits::CONGESTION)
+        entry.backoff = 4;
+    else
+        entry.backoff = rto_ms < 1000 ? 6 : rto_ms <= 3000 ? 4 : 3;
+
+    entry.heap_pos = transmit_heap_len;
+    transmit_heap[transmit_heap_len++] = (uint8_t)(&entry - transmissions);
+    transmitHeapUp(entry.heap_pos);
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transmissionRemove(uint8_t slot)
+{
+    TransmissionEntry &entry = transmissions[slot];
+    if (Traits::CONGESTION && entry.queued)
+    {
+        // never sent, it only leaves the queue of its peer
+        CongestionPeer &p = congestion->peers[entry.peer];
+        uint8_t prev = NO_TRANSMISSION;
+        uint8_t *link = &p.queue_head;
+        while (*link != slot)
+        {
+            prev = *link;
+            link = &transmissions[prev].queue_next;
+        }
+        *link = entry.queue_next;
+        if (p.queue_tail == slot)
+            p.queue_tail = prev;
+        congestion->queued--;
+        entry.queued = false;
+        entry.in_use = false;
+        return;
+    }
+
+    uint8_t peer = entry.peer;
+    transmitHeapRemove(entry.heap_pos);
+    if (Traits::CONGESTION && peer != NO_TRANSMISSION)
+        congestionRelease(peer, millis());
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::cancelTransmission(IPAddress ip, int port, uint16_t messageid, bool answered)
+{
+    for (int i = 0; i < TRANSMISSION_SLOTS; i++)
+    {
+        TransmissionEntry &entry = transmissions[i];
+        if (entry.in_use && entry.messageid == messageid && entry.port == (uint16_t)port && entry.ip == ip)
+        {
+            if (Traits::CONGESTION && answered && !entry.queued && entry.peer != NO_TRANSMISSION)
+                congestionSample(congestion->peers[entry.peer], entry, millis());
+            transmissionRemove(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::processTransmissions(unsigned long now)
+{
+    while (transmit_heap_len > 0)
+    {
+        TransmissionEntry &entry = transmissions[transmit_heap[0]];
+        if ((long)(now - entry.due_ms) < 0)
+            return;
+
+        if (entry.retransmit_count >= COAP_MAX_RETRANSMIT)
+        {
+            IPAddress ip = entry.ip;
+            uint16_t port = entry.port;
+            uint16_t messageid = entry.messageid;
+            transmissionRemove(transmit_heap[0]);
+            count(COAP_STAT_TX_TIMEOUTS);
+            // a request that was never acknowledged fails now
+            uint8_t n = transactionByMessageId(ip, port, messageid);
+            if (n != NO_TRANSACTION)
+                transactionComplete(n, NULL, ip, port);
+            // and an observer that does not confirm a notification is gone
+            observerRejected(ip, port, messageid);
+            continue;
+        }
+
+        traceRecord(COAP_TRACE_TX, entry.ip, entry.port, entry.buffer, entry.len);
+        _udp->beginPacket(entry.ip, entry.port);
+        _udp->write(entry.buffer, entry.len);
+        _udp->endPacket();
+
+        count(COAP_STAT_RETRANSMITS);
+        entry.retransmit_count++;
+        entry.timeout_ms = entry.timeout_ms * entry.backoff / 2;
+        entry.due_ms = now + entry.timeout_ms;
+        transmitHeapDown(0);
+    }
+}
+
+// The congestion state of ip:port. A new peer takes a free entry or the
+// least recently used one without outstanding messages; there is always
+// one because CONGESTION_PEERS exceeds MAX_TRANSMISSIONS.
+template <class Traits>
+uint8_t BasicCoap<Traits>::congestionPeer(IPAddress ip, int port, unsigned long now)
+{
+    uint8_t victim = NO_TRANSMISSION;
+    for (uint8_t i = 0; i < Traits::CONGESTION_PEERS; i++)
+    {
+        CongestionPeer &p = congestion->peers[i];
+        if (p.in_use && p.port == (uint16_t)port && p.ip == ip)
+        {
+            p.last_used_ms = now;
+            return i;
+        }
+        if (p.in_use && p.outstanding > 0)
+            continue;
+        if (victim == NO_TRANSMISSION || !p.in_use ||
+            (congestion->peers[victim].in_use && (long)(p.last_used_ms - congestion->peers[victim].last_used_ms) < 0))
+            victim = i;
+    }
+
+    CongestionPeer &p = congestion->peers[victim];
+    p = CongestionPeer();
+    p.in_use = true;
+    p.ip = ip;
+    p.port = (uint16_t)port;
+    p.rto_updated_ms = now;
+    p.last_used_ms = now;
+    return victim;
+}
+
+// CoCoA aging: an estimate that is not refreshed drifts back towards the
+// default, small ones after 16 RTOs and large ones after 4.
+template <class Traits>
+uint32_t BasicCoap<Traits>::congestionRto(CongestionPeer &peer, unsigned long now)
+{
+    for (;;)
+    {
+        unsigned long idle = now - peer.rto_updated_ms;
+        if (peer.rto_ms < 1000 && idle >= 16UL * peer.rto_ms)
+        {
+            peer.rto_updated_ms += 16UL * peer.rto_ms;
+            peer.rto_ms *= 2;
+        }
+        else if (peer.rto_ms > 3000 && idle >= 4UL * peer.rto_ms)
+        {
+            peer.rto_updated_ms += 4UL * peer.rto_ms;
+            peer.rto_ms = 1000 + peer.rto_ms / 2;
+        }
+        else
+            return peer.rto_ms;
+    }
+}
+
+// RFC 6298 smoothing, returns the RTO of this estimator with variance
+// factor k and a clock granularity of 1 ms.
+template <class Traits>
+uint32_t BasicCoap<Traits>::congestionEstimate(uint32_t &srtt, uint32_t &rttvar, bool &valid, uint32_t rtt, uint8_t k)
+{
+    if (!valid)
+    {
+        srtt = rtt;
+        rttvar = rtt / 2;
+        valid = true;
+    }
+    else
+    {
+        uint32_t diff = srtt > rtt ? srtt - rtt : rtt - srtt;
+        rttvar = (3 * rttvar + diff) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
+    uint32_t variance = k * rttvar;
+    return srtt + (variance > 1 ? variance : 1);
+}
+
+// An ACK or Reset answered entry: its RTT counts towards the strong
+// estimator if it was not retransmitted, towards the weak one after one or
+// two retransmissions, and not at all after more.
+template <class Traits>
+void BasicCoap<Traits>::congestionSample(CongestionPeer &peer, const TransmissionEntry &entry, unsigned long now)
+{
+    uint32_t rtt = now - entry.sent_ms;
+    uint32_t rto;
+    if (entry.retransmit_count == 0)
+    {
+        rto = congestionEstimate(peer.strong_srtt_ms, peer.strong_rttvar_ms, peer.strong_valid, rtt, 4);
+        rto = (rto + peer.rto_ms) / 2;
+    }
+    else if (entry.retransmit_count <= 2)
+    {
+        rto = congestionEstimate(peer.weak_srtt_ms, peer.weak_rttvar_ms, peer.weak_valid, rtt, 1);
+        rto = (rto + 3 * peer.rto_ms) / 4;
+    }
+    else
+        return;
+
+    if (rto < COCOA_MIN_RTO_MS)
+        rto = COCOA_MIN_RTO_MS;
+    if (rto > COCOA_MAX_RTO_MS)
+        rto = COCOA_MAX_RTO_MS;
+    peer.rto_ms = rto;
+    peer.rto_updated_ms = now;
+}
+
+// One outstanding message of peer is done; queued ones go out in order
+// while it is below NSTART.
+template <class Traits>
+void BasicCoap<Traits>::congestionRelease(uint8_t peer, unsigned long now)
+{
+    CongestionPeer &p = congestion->peers[peer];
+    p.outstanding--;
+    // the entry that left made room in flight for at least one
+    while (p.outstanding < Traits::NSTART && p.queue_head != NO_TRANSMISSION && transmit_heap_len < Traits::MAX_TRANSMISSIONS)
+    {
+        TransmissionEntry &entry = transmissions[p.queue_head];
+        p.queue_head = entry.queue_next;
+        if (p.queue_head == NO_TRANSMISSION)
+            p.queue_tail = NO_TRANSMISSION;
+        congestion->queued--;
+
+        traceRecord(COAP_TRACE_TX, entry.ip, entry.port, entry.buffer, entry.len);
+        unsigned long started = timingStart();
+        _udp->beginPacket(entry.ip, entry.port);
+        _udp->write(entry.buffer, entry.len);
+        _udp->endPacket();
+        timingEnd(COAP_TIMING_SEND, started);
+        count(COAP_STAT_TX);
+
+        p.outstanding++;
+        transmissionStart(entry, congestionRto(p, now), now);
+    }
+}
+
+template <class Traits>
+uint32_t BasicCoap<Traits>::retransmitTimeout(IPAddress ip, int port) const
+{
+    if (!Traits::CONGESTION)
+        return COAP_ACK_TIMEOUT_MS;
+    for (uint8_t i = 0; i < Traits::CONGESTION_PEERS; i++)
+    {
+        const CongestionPeer &p = congestion->peers[i];
+        if (p.in_use && p.port == (uint16_t)port && p.ip == ip)
+        {
+            // aged on a copy, the estimate itself changes on the next send
+            CongestionPeer aged = p;
+            return congestionRto(aged, millis());
+        }
+    }
+    return COAP_ACK_TIMEOUT_MS;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::sendEmpty(COAP_TYPE type, IPAddress ip, int port, uint16_t messageid)
+{
+    CoapPacket packet;
+    packet.type = type;
+    packet.code = 0;
+    packet.messageid = messageid;
+    this->sendPacket(packet, ip, port);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::transactionMidHome(const Transaction &t)
+{
+    return coapMessageIdHash(t.ip, t.port, t.messageid) & (TRANSACTION_INDEX_SIZE - 1);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::transactionTokenHome(const Transaction &t)
+{
+    return coapTokenHash(t.ip, t.port, t.token, sizeof(t.token)) & (TRANSACTION_INDEX_SIZE - 1);
+}
+
+template <class Traits>
+uint8_t BasicCoap<Traits>::transactionByMessageId(IPAddress ip, int port, uint16_t messageid) const
+{
+    uint16_t slot = coapMessageIdHash(ip, port, messageid) & (TRANSACTION_INDEX_SIZE - 1);
+    while (transaction_mid_index[slot] != 0)
+    {
+        uint8_t n = transaction_mid_index[slot] - 1;
+        const Transaction &t = transactions[n];
+        if (t.messageid == messageid && t.port == (uint16_t)port && t.ip == ip)
+            return n;
+        slot = (slot + 1) & (TRANSACTION_INDEX_SIZE - 1);
+    }
+    return NO_TRANSACTION;
+}
+
+template <class Traits>
+uint8_t BasicCoap<Traits>::transactionByToken(IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen) const
+{
+    if (token == NULL || tokenlen != sizeof(transactions[0].token))
+        return NO_TRANSACTION;
+    uint16_t slot = coapTokenHash(ip, port, token, tokenlen) & (TRANSACTION_INDEX_SIZE - 1);
+    while (transaction_token_index[slot] != 0)
+    {
+        uint8_t n = transaction_token_index[slot] - 1;
+        const Transaction &t = transactions[n];
+        if (t.port == (uint16_t)port && t.ip == ip && memcmp(t.token, token, tokenlen) == 0)
+            return n;
+        slot = (slot + 1) & (TRANSACTION_INDEX_SIZE - 1);
+    }
+    return NO_TRANSACTION;
+}
+
+// Responses to a group request come from its members, so only the token
+// identifies it. Group requests are few, they are not indexed.
+template <class Traits>
+uint8_t BasicCoap<Traits>::transactionByGroupToken(const uint8_t *token, uint8_t tokenlen) const
+{
+    for (uint8_t n = 0; n < Traits::MAX_TRANSACTIONS; n++)
+    {
+        const Transaction &t = transactions[n];
+        if (t.in_use && t.multicast && coapTokenEquals(t.token, sizeof(t.token), token, tokenlen))
+            return n;
+    }
+    return NO_TRANSACTION;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transactionUnindex(uint8_t *index, uint8_t n, uint16_t (*home)(const Transaction &))
+{
+    // backward-shift deletion, as for the dedup and observer indexes
+    uint16_t mask = TRANSACTION_INDEX_SIZE - 1;
+    uint16_t slot = home(transactions[n]);
+    while (index[slot] != n + 1)
+        slot = (slot + 1) & mask;
+    uint16_t hole = slot;
+    for (uint16_t next = (hole + 1) & mask; index[next] != 0; next = (next + 1) & mask)
+    {
+        uint16_t h = home(transactions[index[next] - 1]);
+        if (((next - h) & mask) >= ((next - hole) & mask))
+        {
+            index[hole] = index[next];
+            hole = next;
+        }
+    }
+    index[hole] = 0;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transactionComplete(uint8_t n, CoapPacket *response, IPAddress ip, int port)
+{
+    Transaction &t = transactions[n];
+    transactionUnindex(transaction_mid_index, n, transactionMidHome);
+    transactionUnindex(transaction_token_index, n, transactionTokenHome);
+
+    if (t.older != NO_TRANSACTION)
+        transactions[t.older].newer = t.newer;
+    else
+        transaction_oldest = t.newer;
+    if (t.newer != NO_TRANSACTION)
+        transactions[t.newer].older = t.older;
+    else
+        transaction_newest = t.older;
+
+    // the slot is free before the callback runs, so it can send again
+    CoapResponseCallback callback = t.callback;
+    void *context = t.context;
+    if (t.multicast)
+        transaction_multicast--;
+    t.in_use = false;
+    t.multicast = false;
+    t.callback = NULL;
+    t.older = NO_TRANSACTION;
+    t.newer = transaction_free;
+    transaction_free = n;
+
+    if (callback)
+        callback(response, ip, port, context);
+}
+
+template <class Traits>
+void BasicCoap<Traits>::transactionExpire(unsigned long now)
+{
+    while (transaction_oldest != NO_TRANSACTION && (long)(now - transactions[transaction_oldest].expires_ms) >= 0)
+    {
+        Transaction &t = transactions[transaction_oldest];
+        // a group request simply ends
+        if (!t.multicast)
+            count(COAP_STAT_REQUEST_TIMEOUTS);
+        cancelTransmission(t.ip, t.port, t.messageid);
+        transactionComplete(transaction_oldest, NULL, t.ip, t.port);
+    }
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::handleResponse(CoapPacket &packet, IPAddress ip, int port)
+{
+    uint8_t n;
+    if (packet.type == COAP_ACK || packet.type == COAP_RESET)
+    {
+        n = transactionByMessageId(ip, port, packet.messageid);
+        if (n == NO_TRANSACTION)
+            return false;
+        if (packet.type == COAP_RESET)
+        {
+            transactionComplete(n, NULL, ip, port);
+            return true;
+        }
+        if (packet.code == 0)
+        {
+            transactions[n].acked = true;
+            return true;
+        }
+        // a piggybacked response echoes the request token
+        if (!coapTokenEquals(transactions[n].token, sizeof(transactions[n].token), packet.token, packet.tokenlen))
+            return false;
+    }
+    else
+    {
+        n = transactionByToken(ip, port, packet.token, packet.tokenlen);
+        if (n == NO_TRANSACTION && transaction_multicast > 0)
+            n = transactionByGroupToken(packet.token, packet.tokenlen);
+        if (n == NO_TRANSACTION)
+            return false;
+        if (transactions[n].multicast)
+        {
+            // every member answers, the request stays until it expires
+            if (transactions[n].callback)
+                transactions[n].callback(&packet, ip, port, transactions[n].context);
+            return true;
+        }
+        // a separate response also acknowledges the request
+        cancelTransmission(ip, port, transactions[n].messageid);
+    }
+    transactionComplete(n, &packet, ip, port);
+    return true;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::get(IPAddress ip, int port, const char *url)
+{
+    return this->send(ip, port, url, COAP_CON, COAP_GET, NULL, 0, NULL, 0);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::put(IPAddress ip, int port, const char *url, const char *payload)
+{
+    return this->send(ip, port, url, COAP_CON, COAP_PUT, NULL, 0, (uint8_t *)payload, strlen(payload));
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::put(IPAddress ip, int port, const char *url, const char *payload, size_t payloadlen)
+{
+    return this->send(ip, port, url, COAP_CON, COAP_PUT, NULL, 0, (uint8_t *)payload, payloadlen);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen)
+{
+    return this->send(ip, port, url, type, method, token, tokenlen, payload, payloadlen, COAP_NONE);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type)
+{
+    return this->send(ip, port, url, type, method, token, tokenlen, payload, payloadlen, content_type, nextMessageId());
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type, uint16_t messageid)
+{
+
+    // make packet
+    CoapPacket packet;
+
+    // group requests are never confirmable (RFC 7252 section 8.1)
+    packet.type = coapIsMulticast(ip) ? COAP_NONCON : type;
+    packet.code = method;
+    packet.token = token;
+    packet.tokenlen = tokenlen;
+    packet.payload = payload;
+    packet.payloadlen = payloadlen;
+    packet.optionnum = 0;
+    packet.messageid = messageid;
+
+    // use URI_HOST UIR_PATH
+    char ipaddress[16] = "";
+    sprintf(ipaddress, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+    packet.addOption(COAP_URI_HOST, strlen(ipaddress), (uint8_t *)ipaddress);
+
+    packet.addUriOptions(url);
+
+    // if Content-Format option
+    uint8_t formatBuf[3];
+    if (content_type != COAP_NONE)
+        packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(content_type, formatBuf), formatBuf);
+
+    // send packet
+    return this->sendPacket(packet, ip, port);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type, CoapResponseCallback callback, void *context)
+{
+    const uint8_t *token = transactionToken();
+    if (token == NULL)
+        return 0;
+    uint16_t mid = this->send(ip, port, url, type, method, token, sizeof(transactions[0].token), payload, payloadlen, content_type, nextMessageId());
+    return mid != 0 ? transactionAdd(ip, port, mid, callback, context) : 0;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::send(IPAddress ip, int port, CoapPacket &request, CoapResponseCallback callback, void *context)
+{
+    const uint8_t *token = transactionToken();
+    if (token == NULL)
+        return 0;
+    request.token = token;
+    request.tokenlen = sizeof(transactions[0].token);
+    request.messageid = nextMessageId();
+    if (coapIsMulticast(ip))
+        request.type = COAP_NONCON;
+    uint16_t mid = this->sendPacket(request, ip, port);
+    return mid != 0 ? transactionAdd(ip, port, mid, callback, context) : 0;
+}
+
+// The token of the next transaction, which transactionAdd() then takes once
+// its request has been sent.
+template <class Traits>
+const uint8_t *BasicCoap<Traits>::transactionToken()
+{
+    if (transaction_free == NO_TRANSACTION)
+        return NULL;
+    Transaction &t = transactions[transaction_free];
+    // unpredictable, so a spoofed response cannot guess it (RFC 7252
+    // section 5.3.1), and unlike every token still outstanding
+    bool taken;
+    do
+    {
+        uint32_t token = coapRandom();
+        t.token[0] = token >> 24;
+        t.token[1] = token >> 16;
+        t.token[2] = token >> 8;
+        t.token[3] = token;
+        taken = false;
+        for (uint8_t i = 0; i < Traits::MAX_TRANSACTIONS && !taken; i++)
+            taken = transactions[i].in_use && memcmp(transactions[i].token, t.token, sizeof(t.token)) == 0;
+    } while (taken);
+    return t.token;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::transactionAdd(IPAddress ip, int port, uint16_t messageid, CoapResponseCallback callback, void *context)
+{
+    uint8_t n = transaction_free;
+    Transaction &t = transactions[n];
+    transaction_free = t.newer;
+    t.in_use = true;
+    t.acked = false;
+    t.generation++;
+    t.ip = ip;
+    t.port = (uint16_t)port;
+    t.messageid = messageid;
+    // a group request collects responses for as long as members may delay them
+    t.multicast = Traits::MULTICAST && coapIsMulticast(ip);
+    t.expires_ms = millis() + (t.multicast ? Traits::MULTICAST_LEISURE_MS + COAP_ACK_TIMEOUT_MS : COAP_REQUEST_TIMEOUT_MS);
+    t.callback = callback;
+    t.context = context;
+    if (t.multicast)
+        transaction_multicast++;
+
+    // kept in expiry order; only group requests expire sooner than older ones
+    uint8_t older = transaction_newest;
+    while (older != NO_TRANSACTION && (long)(transactions[older].expires_ms - t.expires_ms) > 0)
+        older = transactions[older].older;
+    t.older = older;
+    t.newer = older != NO_TRANSACTION ? transactions[older].newer : transaction_oldest;
+    if (older != NO_TRANSACTION)
+        transactions[older].newer = n;
+    else
+        transaction_oldest = n;
+    if (t.newer != NO_TRANSACTION)
+        transactions[t.newer].older = n;
+    else
+        transaction_newest = n;
+
+    uint16_t slot = transactionMidHome(t);
+    while (transaction_mid_index[slot] != 0)
+        slot = (slot + 1) & (TRANSACTION_INDEX_SIZE - 1);
+    transaction_mid_index[slot] = n + 1;
+    slot = transactionTokenHome(t);
+    while (transaction_token_index[slot] != 0)
+        slot = (slot + 1) & (TRANSACTION_INDEX_SIZE - 1);
+    transaction_token_index[slot] = n + 1;
+
+    return (uint16_t)t.generation << 8 | (n + 1);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::get(IPAddress ip, int port, const char *url, CoapResponseCallback callback, void *context)
+{
+    return this->send(ip, port, url, COAP_CON, COAP_GET, NULL, 0, COAP_NONE, callback, context);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::put(IPAddress ip, int port, const char *url, const char *payload, size_t payloadlen, CoapResponseCallback callback, void *context)
+{
+    return this->send(ip, port, url, COAP_CON, COAP_PUT, (const uint8_t *)payload, payloadlen, COAP_NONE, callback, context);
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::cancel(uint16_t handle)
+{
+    uint8_t n = (handle & 0xFF) - 1;
+    if (n >= Traits::MAX_TRANSACTIONS || !transactions[n].in_use || transactions[n].generation != handle >> 8)
+        return false;
+    Transaction &t = transactions[n];
+    cancelTransmission(t.ip, t.port, t.messageid);
+    transactionComplete(n, NULL, t.ip, t.port);
+    return true;
+}
+
+template <class Traits>
+uint8_t BasicCoap<Traits>::blockSzx(int room, uint8_t szx) const
+{
+    while (szx > 0 && (16 << szx) > room)
+        szx--;
+    return szx;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::getBlockwise(IPAddress ip, int port, const char *url, CoapBlockWriter writer)
+{
+    if (!Traits::BLOCKWISE || block->in_use)
+        return 0;
+
+    block->ip = ip;
+    block->port = (uint16_t)port;
+    block->url = url;
+    block->method = COAP_GET;
+    block->option = COAP_BLOCK2;
+    block->num = 0;
+    // leave room in rx_buffer for the response header, token and options
+    block->szx = tcpBert(ip, port) ? 7 : blockSzx(coap_buf_size - 32, 6);
+    block->total_len = 0;
+    block->content_type = COAP_NONE;
+    block->reader = NULL;
+    block->writer = writer;
+
+    block->in_use = sendBlockRequest();
+    return block->in_use ? block->messageid : 0;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::putBlockwise(IPAddress ip, int port, const char *url, CoapBlockReader reader, size_t total_len)
+{
+    return this->sendBlockwise(ip, port, url, COAP_PUT, reader, total_len, COAP_NONE);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendBlockwise(IPAddress ip, int port, const char *url, COAP_METHOD method, CoapBlockReader reader, size_t total_len, COAP_CONTENT_TYPE content_type)
+{
+    if (!Traits::BLOCKWISE || block->in_use)
+        return 0;
+
+    block->ip = ip;
+    block->port = (uint16_t)port;
+    block->url = url;
+    block->method = method;
+    block->option = COAP_BLOCK1;
+    block->num = 0;
+    block->szx = tcpBert(ip, port) ? 7 : 6;
+    block->total_len = total_len;
+    block->content_type = content_type;
+    block->reader = reader;
+    block->writer = NULL;
+
+    block->in_use = sendBlockRequest();
+    return block->in_use ? block->messageid : 0;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::sendBlockRequest()
+{
+    CoapPacket packet;
+    char ipaddress[16] = "";
+    uint8_t formatBuf[3], sizeBuf[3], blockBuf[3];
+    uint32_t offset = blockOffset(block->num, block->szx);
+    int limit = tcpLimit(block->ip, block->port);
+    uint16_t packetSize = 0;
+
+    block->messageid = nextMessageId();
+    sprintf(ipaddress, "%d.%d.%d.%d", block->ip[0], block->ip[1], block->ip[2], block->ip[3]);
+
+    // an upload block shrinks until it fits next to the header and options
+    for (;;)
+    {
+        packet.type = COAP_CON;
+        packet.code = block->method;
+        packet.token = NULL;
+        packet.tokenlen = 0;
+        packet.messageid = block->messageid;
+        packet.optionnum = 0;
+
+        packet.addOption(COAP_URI_HOST, strlen(ipaddress), (uint8_t *)ipaddress);
+        packet.addUriOptions(block->url);
+
+        bool more = false;
+        if (block->option == COAP_BLOCK1)
+        {
+            more = offset + blockSize(block->szx, limit) < block->total_len;
+            if (block->content_type != COAP_NONE)
+                packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(block->content_type, formatBuf), formatBuf);
+            if (block->num == 0)
+                packet.addOption(COAP_SIZE1, coapEncodeUint(block->total_len, sizeBuf), sizeBuf);
+        }
+        packet.addOption(block->option, coapEncodeUint(block->num << 4 | (more ? 0x08 : 0) | block->szx, blockBuf), blockBuf);
+
+        packetSize = encodePacket(packet);
+        if (packetSize == 0)
+            return false;
+        if (block->option == COAP_BLOCK2 || packetSize + 2 + blockSize(block->szx, limit) <= (uint32_t)limit)
+            break;
+        if (block->szx == 0)
+            return false;
+        block->szx--;
+        block->num = blockNum(offset, block->szx);
+    }
+
+    block->sent = 0;
+    if (block->option == COAP_BLOCK1 && offset < block->total_len)
+    {
+        size_t chunk = block->total_len - offset;
+        if (chunk > blockSize(block->szx, limit))
+            chunk = blockSize(block->szx, limit);
+        chunk = block->reader(offset, this->tx_buffer + packetSize + 1, chunk);
+        block->sent = chunk;
+        if (chunk > 0)
+        {
+            this->tx_buffer[packetSize] = 0xFF;
+            packetSize += 1 + chunk;
+        }
+    }
+
+    transmitPacket(packet, block->ip, block->port, packetSize);
+    return true;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::handleBlockResponse(CoapPacket &packet, IPAddress ip, int port)
+{
+    if (!Traits::BLOCKWISE || !block->in_use || block->port != (uint16_t)port || !(block->ip == ip))
+        return false;
+    // a stream has no message IDs, block requests are the ones without a token
+    bool stream = tcpFind(ip, port) != NO_CONNECTION;
+    if (stream ? packet.tokenlen != 0 : packet.messageid != block->messageid)
+        return false;
+
+    uint32_t num = 0;
+    bool more = false;
+    uint8_t szx = 0;
+    bool bert = tcpBert(ip, port);
+
+    if (block->option == COAP_BLOCK2)
+    {
+        if ((packet.code >> 5) != 2)
+        {
+            block->in_use = false;
+            return false;
+        }
+        if (!packet.getBlock(COAP_BLOCK2, num, more, szx, bert))
+        {
+            // the server sent the whole representation at once
+            block->in_use = false;
+            block->writer(0, packet.payload, packet.payloadlen);
+            return false;
+        }
+        block->writer(blockOffset(num, szx), packet.payload, packet.payloadlen);
+        // a BERT block moves on by the 1024 byte units it carried
+        uint32_t units = szx == 7 ? packet.payloadlen / 1024 : 1;
+        if (!more || units == 0)
+        {
+            block->in_use = false;
+            return false;
+        }
+        block->num = num + units;
+        block->szx = szx;
+    }
+    else
+    {
+        if (packet.code != COAP_CONTINUE || !packet.getBlock(COAP_BLOCK1, num, more, szx, bert))
+        {
+            block->in_use = false;
+            return false;
+        }
+        // the server may ask for smaller blocks from here on
+        uint32_t offset = blockOffset(num, szx) + (szx == 7 ? block->sent : 16UL << szx);
+        if (szx < block->szx)
+            block->szx = szx;
+        block->num = blockNum(offset, block->szx);
+        if (offset >= block->total_len)
+        {
+            block->in_use = false;
+            return false;
+        }
+    }
+
+    block->in_use = sendBlockRequest();
+    return true;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::loop()
+{
+    processTimers();
+    return processReadable();
+}
+
+template <class Traits>
+void BasicCoap<Traits>::processTimers()
+{
+    unsigned long now = millis();
+    processTransmissions(now);
+    transactionExpire(now);
+    dedupExpire(now);
+    observerExpire(now);
+    notifyDue(now);
+    multicastDue(now);
+    if (Traits::TRACE)
+        trace->tick(micros());
+}
+
+// Keeps the earliest of the deadlines seen so far in deadline_ms.
+static inline void coapEarliest(bool &found, unsigned long &deadline_ms, unsigned long due_ms)
+{
+    if (!found || (long)(due_ms - deadline_ms) < 0)
+        deadline_ms = due_ms;
+    found = true;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::nextDeadline(unsigned long &deadline_ms) const
+{
+    // every queue is kept in due order, so only its head counts
+    bool found = false;
+    if (transmit_heap_len > 0)
+        coapEarliest(found, deadline_ms, transmissions[transmit_heap[0]].due_ms);
+    if (transaction_oldest != NO_TRANSACTION)
+        coapEarliest(found, deadline_ms, transactions[transaction_oldest].expires_ms);
+    if (Traits::DEDUP && dedup->count > 0)
+        coapEarliest(found, deadline_ms, dedup->entries[dedup->head].expires_ms);
+    if (Traits::OBSERVE && COAP_OBSERVER_LEASE_MS > 0 && observe->oldest != NO_OBSERVER)
+        coapEarliest(found, deadline_ms, observe->entries[observe->oldest].last_seen_ms + COAP_OBSERVER_LEASE_MS + 1);
+    if (Traits::OBSERVE && Traits::NOTIFY_COALESCE)
+    {
+        for (uint8_t i = 0; i < Traits::MAX_OBSERVE_RESOURCES; i++)
+        {
+            const ObserveResource &res = observe->resources[i];
+            if (notifications->values[i].due && res.count > 0)
+                coapEarliest(found, deadline_ms, res.last_sent_ms + res.interval_ms);
+        }
+    }
+    if (Traits::MULTICAST)
+    {
+        for (uint8_t i = 0; i < Traits::MULTICAST_RESPONSES; i++)
+            if (multicast->responses[i].in_use)
+                coapEarliest(found, deadline_ms, multicast->responses[i].due_ms);
+    }
+    return found;
+}
+
+template <class Traits>
+long BasicCoap<Traits>::timeUntilNextEvent() const
+{
+    unsigned long deadline_ms = 0;
+    if (!nextDeadline(deadline_ms))
+        return -1;
+    long remaining = (long)(deadline_ms - millis());
+    return remaining > 0 ? remaining : 0;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::processReadable()
+{
+    unsigned long now = millis();
+    if (coap_buf_size < COAP_HEADER_SIZE)
+        return false;
+
+    receive(_udp, false, now);
+    if (Traits::MULTICAST)
+    {
+        for (uint8_t i = 0; i < Traits::MULTICAST_GROUPS && multicast->groups[i] != NULL; i++)
+            receive(multicast->groups[i], true, now);
+    }
+    if (Traits::TCP)
+    {
+        for (uint8_t i = 0; i < Traits::TCP_CONNECTIONS; i++)
+            if (tcp->connections[i].client != NULL)
+                tcpReceive(i, now);
+    }
+    return true;
+}
+
+// Handles the datagrams waiting on udp, the unicast socket or a group;
+// everything is sent through the unicast one.
+template <class Traits>
+bool BasicCoap<Traits>::receive(UDP *udp, bool group, unsigned long now)
+{
+    int32_t packetlen = udp->parsePacket();
+
+    while (packetlen > 0)
+    {
+        bool truncated = packetlen > coap_buf_size;
+        uint8_t *rx = rx_lent != NULL ? rx_lent : this->rx_buffer;
+        packetlen = udp->read(rx, packetlen >= coap_buf_size ? coap_buf_size : packetlen);
+        traceRecord(COAP_TRACE_RX, udp->remoteIP(), udp->remotePort(), rx, packetlen);
+        handleMessage(rx, packetlen, truncated, udp->remoteIP(), udp->remotePort(), group ? FROM_GROUP : FROM_UNICAST, now);
+        packetlen = udp->parsePacket();
+    }
+
+    if (Traits::MULTICAST)
+        multicast->dispatching = false;
+    return true;
+}
+
+// Handles one message in rx, in the UDP layout whatever it arrived over.
+template <class Traits>
+void BasicCoap<Traits>::handleMessage(uint8_t *rx, int32_t packetlen, bool truncated, IPAddress ip, int port,
+                                      MessageSource source, unsigned long now)
+{
+    unsigned long started = timingStart();
+    count(COAP_STAT_RX);
+
+    CoapPacket packet;
+
+    // parse coap packet header
+    if (packetlen < COAP_HEADER_SIZE || (((rx[0] & 0xC0) >> 6) != 1))
+    {
+        count(COAP_STAT_RX_MALFORMED);
+        return;
+    }
+
+    packet.type = (rx[0] & 0x30) >> 4;
+    packet.tokenlen = rx[0] & 0x0F;
+    packet.code = rx[1];
+    packet.messageid = 0xFF00 & (rx[2] << 8);
+    packet.messageid |= 0x00FF & rx[3];
+
+    // only NON requests are sent to a group (RFC 7252 section 8.1)
+    bool group = source == FROM_GROUP;
+    if (group && (packet.type != COAP_NONCON || packet.code == 0 || (packet.code >> 5) != 0))
+        return;
+    if (Traits::MULTICAST)
+    {
+        // its responses, errors included, go through transmitPacket()
+        multicast->dispatching = group;
+        multicast->ip = ip;
+        multicast->port = (uint16_t)port;
+    }
+
+    if (packet.tokenlen == 0)
+        packet.token = NULL;
+    else if (packet.tokenlen <= 8)
+        packet.token = rx + 4;
+    else
+    {
+        count(COAP_STAT_RX_MALFORMED);
+        return;
+    }
+
+    // a request that does not fit rx_buffer should be retried block-wise
+    if (truncated)
+    {
+        count(COAP_STAT_RX_TOO_LARGE);
+        if (packet.type == COAP_CON && packet.code != 0 && (packet.code >> 5) == 0)
+        {
+            sendResponse(ip, port, packet.messageid, NULL, 0,
+                         COAP_REQUEST_ENTITY_TOO_LARGE, COAP_NONE, packet.token, packet.tokenlen);
+        }
+        return;
+    }
+
+    // parse packet options/payload
+    if (COAP_HEADER_SIZE + packet.tokenlen < packetlen)
+    {
+        int parsed = packet.parseOptions(rx + COAP_HEADER_SIZE + packet.tokenlen, rx + packetlen);
+        if (parsed < 0)
+        {
+            count(COAP_STAT_RX_MALFORMED);
+            return;
+        }
+        // a critical option that did not fit cannot be honoured
+        if (parsed > 0)
+        {
+            count(COAP_STAT_RX_BAD_OPTION);
+            if (packet.code != 0 && (packet.code >> 5) == 0 && packet.type != COAP_ACK && packet.type != COAP_RESET)
+            {
+                sendResponse(ip, port, packet.messageid, NULL, 0,
+                             COAP_BAD_OPTION, COAP_NONE, packet.token, packet.tokenlen);
+            }
+            return;
+        }
+    }
+    timingEnd(COAP_TIMING_PARSE, started);
+
+    if (packet.type == COAP_ACK)
+    {
+        if (cancelTransmission(ip, port, packet.messageid, true))
+            observerAcked(ip, port, packet.messageid);
+        // intermediate blocks of a block-wise transfer are not reported
+        if (!handleBlockResponse(packet, ip, port) &&
+            !handleResponse(packet, ip, port) && resp)
+        {
+            // call response function
+            resp(packet, ip, port);
+        }
+    }
+    else if (packet.type == COAP_RESET)
+    {
+        // the peer rejected our message, stop retransmitting it
+        cancelTransmission(ip, port, packet.messageid, true);
+        if (!handleResponse(packet, ip, port))
+            observerRejected(ip, port, packet.messageid);
+    }
+    else
+    {
+        started = timingStart();
+        // a stream neither loses nor duplicates messages
+        if (Traits::DEDUP && source != FROM_TCP)
+        {
+            // A duplicate gets the cached reply instead of running the handler again.
+            int16_t seen = dedupFind(ip, port, packet.messageid);
+            if (seen >= 0 && !dedup->entries[seen].overflow)
+            {
+                count(COAP_STAT_DUPLICATES);
+                if (dedup->entries[seen].len > 0)
+                {
+                    traceRecord(COAP_TRACE_TX, ip, port, dedup->entries[seen].buffer, dedup->entries[seen].len);
+                    _udp->beginPacket(ip, port);
+                    _udp->write(dedup->entries[seen].buffer, dedup->entries[seen].len);
+                    _udp->endPacket();
+                }
+                return;
+            }
+            if (seen < 0)
+                seen = dedupInsert(ip, port, packet.messageid, now);
+            else
+                dedup->entries[seen].overflow = false;
+            dedup->current = seen;
+        }
+
+        if ((packet.code >> 5) != 0)
+        {
+            // a separate response or a notification, not a request
+            if (packet.type == COAP_CON)
+                sendEmpty(COAP_ACK, ip, port, packet.messageid);
+            // over TCP a block arrives like a separate response
+            if (!(source == FROM_TCP && handleBlockResponse(packet, ip, port)) &&
+                !handleResponse(packet, ip, port) && resp)
+                resp(packet, ip, port);
+        }
+        else if (packet.hasOption(COAP_PROXY_URI) || packet.hasOption(COAP_PROXY_SCHEME))
+        {
+            timingEnd(COAP_TIMING_DISPATCH, started);
+            if (Traits::PROXY)
+                proxyRequest(packet, ip, port);
+            else
+                sendResponse(ip, port, packet.messageid, NULL, 0,
+                             COAP_PROXYING_NOT_SUPPORTED, COAP_NONE, packet.token, packet.tokenlen);
+        }
+        else
+        {
+            CoapCallback callback = routes->find(packet);
+            timingEnd(COAP_TIMING_DISPATCH, started);
+            if (!callback)
+            {
+                // routes registered by the application take precedence
+                if (Traits::STATS && packet.code == COAP_GET && CoapStats::isStatsPath(packet))
+                    sendStats(ip, port, packet);
+                else if (Traits::TRACE && packet.code == COAP_GET && CoapTrace::isTracePath(packet))
+                    sendTrace(ip, port, packet);
+                else
+                {
+                    count(COAP_STAT_NOT_FOUND);
+                    sendResponse(ip, port, packet.messageid, NULL, 0,
+                                 COAP_NOT_FOUND, COAP_NONE, NULL, 0);
+                }
+            }
+            else if (handoff != NULL && source == FROM_UNICAST)
+            {
+                count(COAP_STAT_REQUESTS);
+                uint8_t *next = handoff(callback, packet, ip, port, handoff_context);
+                if (next != NULL)
+                    rx_lent = next;
+                else
+                {
+                    count(COAP_STAT_UNAVAILABLE);
+                    sendResponse(ip, port, packet.messageid, NULL, 0,
+                                 COAP_SERVICE_UNAVAILABLE, COAP_NONE, packet.token, packet.tokenlen);
+                }
+            }
+            else
+            {
+                count(COAP_STAT_REQUESTS);
+                size_t scratch_mark = arena != NULL ? arena->mark() : 0;
+                started = timingStart();
+                callback(packet, ip, port);
+                timingEnd(COAP_TIMING_HANDLER, started);
+                if (arena != NULL)
+                    arena->release(scratch_mark);
+            }
+        }
+        if (Traits::DEDUP)
+            dedup->current = -1;
+    }
+
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::joinGroup(UDP &group, IPAddress address, int port)
+{
+    if (!Traits::MULTICAST || !coapIsMulticast(address))
+        return false;
+    for (uint8_t i = 0; i < Traits::MULTICAST_GROUPS; i++)
+    {
+        if (multicast->groups[i] != NULL)
+            continue;
+        if (!group.beginMulticast(address, port))
+            return false;
+        multicast->groups[i] = &group;
+        return true;
+    }
+    return false;
+}
+
+// Holds the response in tx_buffer to a group request for a random Leisure
+// (RFC 7252 section 8.2), or drops it if it is an error.
+template <class Traits>
+bool BasicCoap<Traits>::multicastDelay(IPAddress ip, int port, uint16_t packetSize)
+{
+    if ((this->tx_buffer[1] >> 5) >= 4)
+        return true;
+
+    uint8_t i = 0;
+    while (i < Traits::MULTICAST_RESPONSES && multicast->responses[i].in_use)
+        i++;
+    if (i == Traits::MULTICAST_RESPONSES || packetSize > Traits::BUF_MAX_SIZE)
+    {
+        count(COAP_STAT_TX_FAILED);
+        return false;
+    }
+
+    MulticastResponse &response = multicast->responses[i];
+    response.in_use = true;
+    response.ip = ip;
+    response.port = (uint16_t)port;
+    // members running the same firmware must still pick different delays
+    response.due_ms = millis() + coapRandom() % (Traits::MULTICAST_LEISURE_MS + 1);
+    response.len = packetSize;
+    memcpy(response.buffer, this->tx_buffer, packetSize);
+    // there is no message to piggyback on, it goes out as NON
+    if (((response.buffer[0] >> 4) & 0x03) == COAP_ACK)
+    {
+        uint16_t messageid = nextMessageId();
+        response.buffer[0] = (response.buffer[0] & 0xCF) | (COAP_NONCON << 4);
+        response.buffer[2] = messageid >> 8;
+        response.buffer[3] = messageid & 0xFF;
+    }
+    return true;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::multicastDue(unsigned long now)
+{
+    if (!Traits::MULTICAST)
+        return;
+    for (uint8_t i = 0; i < Traits::MULTICAST_RESPONSES; i++)
+    {
+        MulticastResponse &response = multicast->responses[i];
+        if (!response.in_use || (long)(now - response.due_ms) < 0)
+            continue;
+        traceRecord(COAP_TRACE_TX, response.ip, response.port, response.buffer, response.len);
+        unsigned long started = timingStart();
+        _udp->beginPacket(response.ip, response.port);
+        _udp->write(response.buffer, response.len);
+        _udp->endPacket();
+        timingEnd(COAP_TIMING_SEND, started);
+        count(COAP_STAT_TX);
+        response.in_use = false;
+    }
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::attach(Client &client, IPAddress ip, int port)
+{
+    if (!Traits::TCP || coap_buf_size < COAP_HEADER_SIZE || tcpFind(ip, port) != NO_CONNECTION)
+        return false;
+    for (uint8_t i = 0; i < Traits::TCP_CONNECTIONS; i++)
+    {
+        TcpConnection &conn = tcp->connections[i];
+        if (conn.client != NULL)
+            continue;
+        conn = TcpConnection();
+        conn.client = &client;
+        conn.ip = ip;
+        conn.port = (uint16_t)port;
+        // a CSM is the first message either side sends (RFC 8323 section 5.3)
+        if (tcpSendSignal(i, COAP_CSM, NULL, 0))
+            return true;
+        conn.client = NULL;
+        return false;
+    }
+    return false;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::detach(IPAddress ip, int port)
+{
+    uint8_t c = tcpFind(ip, port);
+    if (c != NO_CONNECTION)
+        tcpClose(c);
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::ping(IPAddress ip, int port)
+{
+    uint8_t c = tcpFind(ip, port);
+    return c != NO_CONNECTION && tcpSendSignal(c, COAP_PING, NULL, 0);
+}
+
+template <class Traits>
+uint8_t BasicCoap<Traits>::tcpFind(IPAddress ip, int port) const
+{
+    if (!Traits::TCP)
+        return NO_CONNECTION;
+    for (uint8_t i = 0; i < Traits::TCP_CONNECTIONS; i++)
+    {
+        const TcpConnection &conn = tcp->connections[i];
+        if (conn.client != NULL && conn.port == (uint16_t)port && conn.ip == ip)
+            return i;
+    }
+    return NO_CONNECTION;
+}
+
+// True if ip:port is a connection whose peer takes BERT blocks and at least
+// one 1024 byte unit fits the messages both sides take.
+template <class Traits>
+bool BasicCoap<Traits>::tcpBert(IPAddress ip, int port) const
+{
+    uint8_t c = tcpFind(ip, port);
+    return c != NO_CONNECTION && tcp->connections[c].bert && tcpLimit(ip, port) >= 1024 + BERT_HEADROOM;
+}
+
+// The largest message, counted in the UDP layout, that can be sent to
+// ip:port. The TCP header is never longer than the UDP one.
+template <class Traits>
+int BasicCoap<Traits>::tcpLimit(IPAddress ip, int port) const
+{
+    uint8_t c = tcpFind(ip, port);
+    if (c == NO_CONNECTION || tcp->connections[c].max_message_size >= (uint32_t)coap_buf_size)
+        return coap_buf_size;
+    return (int)tcp->connections[c].max_message_size;
+}
+
+template <class Traits>
+uint32_t BasicCoap<Traits>::tcpLength(const uint8_t *head)
+{
+    switch (head[0] >> 4)
+    {
+    case 13:
+        return head[1] + 13UL;
+    case 14:
+        return (head[1] << 8 | head[2]) + 269UL;
+    case 15:
+        return ((uint32_t)head[1] << 24 | (uint32_t)head[2] << 16 | head[3] << 8 | head[4]) + 65805UL;
+    default:
+        return head[0] >> 4;
+    }
+}
+
+// Sends a message encoded in the UDP layout over connection c. Its header
+// is rewritten in place into the TCP one (RFC 8323 section 3.2), which is
+// never longer, so header, token, options and payload go out in one write;
+// tail follows unchanged.
+template <class Traits>
+bool BasicCoap<Traits>::tcpWrite(uint8_t c, uint8_t *message, uint16_t len, const uint8_t *tail, uint16_t taillen)
+{
+    TcpConnection &conn = tcp->connections[c];
+    uint8_t code = message[1];
+    uint8_t tokenlen = message[0] & 0x0F;
+    // a stream has nothing to acknowledge or reset
+    if (code == 0)
+        return true;
+    if ((uint32_t)len + taillen > conn.max_message_size)
+    {
+        count(COAP_STAT_TX_FAILED);
+        return false;
+    }
+
+    traceRecord(COAP_TRACE_TX, conn.ip, conn.port, message, len, tail, taillen);
+    uint32_t length = len + taillen - COAP_HEADER_SIZE - tokenlen;
+    uint8_t *p = message + COAP_HEADER_SIZE - 1;
+    *p = code;
+    if (length < 13)
+        *--p = length << 4 | tokenlen;
+    else if (length < 269)
+    {
+        *--p = length - 13;
+        *--p = 13 << 4 | tokenlen;
+    }
+    else
+    {
+        // below 65805, BUF_MAX_SIZE is checked for that
+        *--p = (length - 269) & 0xFF;
+        *--p = (length - 269) >> 8;
+        *--p = 14 << 4 | tokenlen;
+    }
+
+    unsigned long started = timingStart();
+    size_t framed = message + len - p;
+    bool sent = conn.client->write(p, framed) == framed &&
+                (taillen == 0 || conn.client->write(tail, taillen) == taillen);
+    timingEnd(COAP_TIMING_SEND, started);
+    if (!sent)
+    {
+        // the framing is lost; loop() closes the connection
+        count(COAP_STAT_TX_FAILED);
+        conn.client->stop();
+        return false;
+    }
+    count(COAP_STAT_TX);
+    return true;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::tcpSendSignal(uint8_t c, uint8_t code, const uint8_t *token, uint8_t tokenlen)
+{
+    CoapPacket packet;
+    packet.type = COAP_NONCON;
+    packet.code = code;
+    packet.token = token;
+    packet.tokenlen = tokenlen;
+    packet.messageid = 0;
+    packet.optionnum = 0;
+
+    uint8_t sizeBuf[3];
+    if (code == COAP_CSM)
+    {
+        // a message is kept in rx_buffer behind a 4 byte header, one byte
+        // more than the TCP one once it carries 13 bytes or more
+        packet.addOption(COAP_CSM_MAX_MESSAGE_SIZE, coapEncodeUint(coap_buf_size - 1, sizeBuf), sizeBuf);
+        if (Traits::BLOCKWISE)
+            packet.addOption(COAP_CSM_BLOCK_WISE_TRANSFER, 0, sizeBuf);
+    }
+    uint16_t packetSize = encodePacket(packet);
+    return packetSize > 0 && tcpWrite(c, this->tx_buffer, packetSize);
+}
+
+// Reads the messages that have fully arrived on connection c. Each is put
+// in rx_buffer behind a made up NON header and handled like a datagram.
+template <class Traits>
+void BasicCoap<Traits>::tcpReceive(uint8_t c, unsigned long now)
+{
+    TcpConnection &conn = tcp->connections[c];
+    Client *client = conn.client;
+    int available = client->available();
+    if (available <= 0 && !client->connected())
+    {
+        tcpClose(c);
+        return;
+    }
+
+    while (available > 0)
+    {
+        // the rest of a message that does not fit is read and dropped
+        if (conn.skip > 0)
+        {
+            int n = conn.skip < (uint32_t)available ? (int)conn.skip : available;
+            if (n > coap_buf_size)
+                n = coap_buf_size;
+            if ((n = client->read(this->rx_buffer, n)) <= 0)
+                return;
+            conn.skip -= n;
+            available -= n;
+            continue;
+        }
+
+        // Len/TKL tells how long the rest of the frame header is
+        if (conn.head_len == 0)
+        {
+            if (client->read(conn.head, 1) != 1)
+                return;
+            conn.head_len = 1;
+            available--;
+        }
+        uint8_t headSize = tcpHeaderSize(conn.head[0]);
+        if (conn.head_len < headSize)
+        {
+            int n = headSize - conn.head_len < available ? headSize - conn.head_len : available;
+            if (n <= 0 || (n = client->read(conn.head + conn.head_len, n)) <= 0)
+                return;
+            conn.head_len += n;
+            available -= n;
+            if (conn.head_len < headSize)
+                return;
+        }
+
+        uint8_t tokenlen = conn.head[0] & 0x0F;
+        uint8_t code = conn.head[headSize - 1];
+        uint32_t len = tokenlen + tcpLength(conn.head);
+        if (tokenlen > 8)
+        {
+            // the next frame cannot be found
+            count(COAP_STAT_RX);
+            count(COAP_STAT_RX_MALFORMED);
+            client->stop();
+            return;
+        }
+        if (COAP_HEADER_SIZE + len > (uint32_t)coap_buf_size)
+        {
+            // larger than the Max-Message-Size we gave
+            count(COAP_STAT_RX);
+            count(COAP_STAT_RX_TOO_LARGE);
+            conn.skip = len;
+            conn.head_len = 0;
+            continue;
+        }
+        if ((uint32_t)available < len)
+            return;
+
+        uint8_t *rx = this->rx_buffer;
+        if (len > 0 && client->read(rx + COAP_HEADER_SIZE, len) != (int)len)
+        {
+            // part of the body is gone, and with it the next frame
+            client->stop();
+            return;
+        }
+        available -= len;
+        conn.head_len = 0;
+
+        rx[0] = 0x01 << 6 | COAP_NONCON << 4 | tokenlen;
+        rx[1] = code;
+        rx[2] = rx[3] = 0;
+        traceRecord(COAP_TRACE_RX, conn.ip, conn.port, rx, COAP_HEADER_SIZE + len);
+
+        if ((code >> 5) == 7)
+            tcpSignal(c, rx, len, tokenlen, code);
+        else if (code != 0)
+        {
+            handleMessage(rx, COAP_HEADER_SIZE + len, false, conn.ip, conn.port, FROM_TCP, now);
+        }
+        // closed or detached meanwhile
+        if (conn.client != client)
+            return;
+    }
+}
+
+// Handles a signaling message (RFC 8323 section 5) of len bytes after the
+// header in rx.
+template <class Traits>
+void BasicCoap<Traits>::tcpSignal(uint8_t c, uint8_t *rx, uint32_t len, uint8_t tokenlen, uint8_t code)
+{
+    TcpConnection &conn = tcp->connections[c];
+    count(COAP_STAT_RX);
+
+    CoapPacket packet;
+    packet.code = code;
+    packet.token = tokenlen > 0 ? rx + COAP_HEADER_SIZE : NULL;
+    packet.tokenlen = tokenlen;
+    if (len > tokenlen && packet.parseOptions(rx + COAP_HEADER_SIZE + tokenlen, rx + COAP_HEADER_SIZE + len) < 0)
+    {
+        count(COAP_STAT_RX_MALFORMED);
+        return;
+    }
+
+    uint32_t size = 0;
+    switch (code)
+    {
+    case COAP_CSM:
+        // settings stay until a later CSM changes them
+        if (packet.getUintOption(COAP_CSM_MAX_MESSAGE_SIZE, size))
+            conn.max_message_size = size;
+        if (Traits::BLOCKWISE && packet.hasOption(COAP_CSM_BLOCK_WISE_TRANSFER))
+            conn.bert = true;
+        break;
+    case COAP_PING:
+        tcpSendSignal(c, COAP_PONG, packet.token, packet.tokenlen);
+        break;
+    case COAP_RELEASE:
+    case COAP_ABORT:
+        tcpClose(c);
+        break;
+    }
+}
+
+// Frees connection c. Whatever still waited on it ends as if it timed out.
+template <class Traits>
+void BasicCoap<Traits>::tcpClose(uint8_t c)
+{
+    TcpConnection &conn = tcp->connections[c];
+    IPAddress ip = conn.ip;
+    uint16_t port = conn.port;
+    conn.client->stop();
+    conn = TcpConnection();
+
+    if (Traits::BLOCKWISE && block->in_use && block->port == port && block->ip == ip)
+        block->in_use = false;
+    if (Traits::OBSERVE)
+    {
+        for (uint16_t n = 0; n < Traits::MAX_OBSERVERS; n++)
+        {
+            if (observe->entries[n].in_use && observe->entries[n].port == port && observe->entries[n].ip == ip)
+                observerRemove(n);
+        }
+    }
+
+    // callbacks may send new requests; those are appended after last
+    uint8_t last = transaction_newest;
+    uint8_t n = transaction_oldest;
+    while (n != NO_TRANSACTION && transactions[n].in_use)
+    {
+        uint8_t next = n == last ? NO_TRANSACTION : transactions[n].newer;
+        if (transactions[n].port == port && transactions[n].ip == ip)
+            transactionComplete(n, NULL, ip, port);
+        n = next;
+    }
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendResponse(IPAddress ip, int port, uint16_t messageid)
+{
+    return this->sendResponse(ip, port, messageid, NULL, 0, COAP_CONTENT, COAP_TEXT_PLAIN, NULL, 0);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload)
+{
+    return this->sendResponse(ip, port, messageid, payload, strlen(payload), COAP_CONTENT, COAP_TEXT_PLAIN, NULL, 0);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen)
+{
+    return this->sendResponse(ip, port, messageid, payload, payloadlen, COAP_CONTENT, COAP_TEXT_PLAIN, NULL, 0);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen,
+                            COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type, const uint8_t *token, int tokenlen)
+{
+    // make packet
+    CoapPacket packet;
+
+    packet.type = COAP_ACK;
+    packet.code = code;
+    packet.token = token;
+    packet.tokenlen = tokenlen;
+    packet.payload = (uint8_t *)payload;
+    packet.payloadlen = payloadlen;
+    packet.optionnum = 0;
+    packet.messageid = messageid;
+
+    // Content-Format describes the payload, in as few bytes as it takes
+    uint8_t formatBuf[3];
+    if (payloadlen > 0 && type != COAP_NONE)
+        packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+
+    return this->sendPacket(packet, ip, port);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendObserveResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen,
+                                   COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type, const uint8_t *token, int tokenlen, uint32_t observe_seq)
+{
+    CoapPacket packet;
+
+    packet.type = COAP_ACK;
+    packet.code = code;
+    packet.token = token;
+    packet.tokenlen = tokenlen;
+    packet.payload = (uint8_t *)payload;
+    packet.payloadlen = payloadlen;
+    packet.optionnum = 0;
+    packet.messageid = messageid;
+
+    uint8_t observeBuf[3] = {0};
+    uint8_t observeLen = coapEncodeUint(observe_seq, observeBuf);
+    packet.addOption(COAP_OBSERVE, observeLen, observeBuf);
+
+    uint8_t formatBuf[3];
+    if (payloadlen > 0 && type != COAP_NONE)
+        packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+
+    return this->sendPacket(packet, ip, port);
+}
+
+template <class Traits>
+CoapExchange BasicCoap<Traits>::exchangeOf(const CoapPacket &request, IPAddress ip, int port)
+{
+    CoapExchange exchange;
+    exchange.ip = ip;
+    exchange.port = (uint16_t)port;
+    exchange.messageid = request.messageid;
+    exchange.type = request.type;
+    exchange.tokenlen = request.tokenlen <= sizeof(exchange.token) ? request.tokenlen : 0;
+    if (exchange.tokenlen > 0)
+        memcpy(exchange.token, request.token, exchange.tokenlen);
+    return exchange;
+}
+
+template <class Traits>
+CoapExchange BasicCoap<Traits>::defer(CoapPacket &request, IPAddress ip, int port)
+{
+    CoapExchange exchange = exchangeOf(request, ip, port);
+
+    // the empty ACK is also what the dedup cache replays to duplicates
+    if (request.type == COAP_CON)
+        sendEmpty(COAP_ACK, ip, port, request.messageid);
+    return exchange;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::respond(const CoapExchange &exchange, const char *payload, size_t payloadlen,
+                                    COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type)
+{
+    if (!exchange.valid())
+        return 0;
+
+    CoapPacket packet;
+    packet.type = exchange.type == COAP_CON ? COAP_CON : COAP_NONCON;
+    packet.code = code;
+    packet.token = exchange.token;
+    packet.tokenlen = exchange.tokenlen;
+    packet.payload = (const uint8_t *)payload;
+    packet.payloadlen = payloadlen;
+    packet.messageid = nextMessageId();
+
+    uint8_t formatBuf[3];
+    if (payloadlen > 0 && type != COAP_NONE)
+        packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+
+    return this->sendPacket(packet, exchange.ip, exchange.port);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendBlockResponse(IPAddress ip, int port, CoapPacket &request, CoapBlockReader reader, size_t total_len,
+                                 COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type)
+{
+    return this->sendBlocks(ip, port, request, reader, total_len, code, type);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendStats(IPAddress ip, int port, CoapPacket &request)
+{
+    if (!Traits::STATS)
+        return 0;
+    const CoapStats *s = stats.operator->();
+    return this->sendBlocks(ip, port, request, [s](uint32_t offset, uint8_t *buffer, size_t len)
+                            { return s->read(offset, buffer, len); },
+                            s->size(), COAP_CONTENT, COAP_APPLICATION_CBOR);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendTrace(IPAddress ip, int port, CoapPacket &request)
+{
+    if (!Traits::TRACE)
+        return 0;
+    CoapTrace *t = trace.operator->();
+    // the ring stands still until its last block is read, or the client gives up
+    t->hold(micros() + COAP_TRACE_HOLD_MS * 1000UL);
+    size_t total = t->size();
+    return this->sendBlocks(ip, port, request, [t, total](uint32_t offset, uint8_t *buffer, size_t len)
+                            {
+                                size_t n = t->read(offset, buffer, len);
+                                if (offset + n >= total)
+                                    t->release();
+                                return n; },
+                            total, COAP_CONTENT, COAP_APPLICATION_OCTET_STREAM);
+}
+
+template <class Traits>
+template <class Reader>
+uint16_t BasicCoap<Traits>::sendBlocks(IPAddress ip, int port, CoapPacket &request, Reader reader, size_t total_len,
+                                       COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type)
+{
+    int limit = tcpLimit(ip, port);
+    bool bert = tcpBert(ip, port);
+    uint32_t num = 0;
+    bool more = false;
+    uint8_t szx = bert ? 7 : 6;
+    request.getBlock(COAP_BLOCK2, num, more, szx, bert);
+
+    uint32_t offset = blockOffset(num, szx);
+    if (offset > 0 && offset >= total_len)
+    {
+        return this->sendResponse(ip, port, request.messageid, NULL, 0, COAP_BAD_OPTION, COAP_NONE, request.token, request.tokenlen);
+    }
+
+    CoapPacket packet;
+    uint8_t formatBuf[3], blockBuf[3], sizeBuf[3];
+    uint16_t packetSize = 0;
+    // piggybacked on the ACK of a CON request, a NON request gets a NON block
+    bool con = request.type == COAP_CON;
+    uint16_t messageid = con ? request.messageid : nextMessageId();
+
+    // shrink the block until it fits next to the header and options
+    for (;;)
+    {
+        num = blockNum(offset, szx);
+        more = offset + blockSize(szx, limit) < total_len;
+
+        packet.type = con ? COAP_ACK : COAP_NONCON;
+        packet.code = code;
+        packet.token = request.token;
+        packet.tokenlen = request.tokenlen;
+        packet.messageid = messageid;
+        packet.optionnum = 0;
+
+        if (type != COAP_NONE)
+            packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+        packet.addOption(COAP_BLOCK2, coapEncodeUint(num << 4 | (more ? 0x08 : 0) | szx, blockBuf), blockBuf);
+        if (num == 0)
+            packet.addOption(COAP_SIZE2, coapEncodeUint(total_len, sizeBuf), sizeBuf);
+
+        packetSize = encodePacket(packet);
+        if (packetSize == 0)
+            return 0;
+        if (packetSize + 2 + blockSize(szx, limit) <= (uint32_t)limit)
+            break;
+        if (szx == 0)
+            return 0;
+        szx--;
+    }
+
+    size_t chunk = total_len - offset;
+    if (chunk > blockSize(szx, limit))
+        chunk = blockSize(szx, limit);
+    if (chunk > 0)
+    {
+        chunk = reader(offset, this->tx_buffer + packetSize + 1, chunk);
+        if (chunk > 0)
+        {
+            this->tx_buffer[packetSize] = 0xFF;
+            packetSize += 1 + chunk;
+        }
+    }
+
+    return transmitPacket(packet, ip, port, packetSize);
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::receiveBlock(IPAddress ip, int port, CoapPacket &request, CoapBlockWriter writer)
+{
+    uint32_t num = 0;
+    bool more = false;
+    uint8_t szx = 0;
+
+    if (!request.getBlock(COAP_BLOCK1, num, more, szx, tcpBert(ip, port)))
+    {
+        if (request.payloadlen > 0)
+            writer(0, request.payload, request.payloadlen);
+        return true;
+    }
+
+    if (request.payloadlen > 0)
+        writer(blockOffset(num, szx), request.payload, request.payloadlen);
+    if (!more)
+        return true;
+
+    CoapPacket packet;
+    bool con = request.type == COAP_CON;
+    packet.type = con ? COAP_ACK : COAP_NONCON;
+    packet.code = COAP_CONTINUE;
+    packet.token = request.token;
+    packet.tokenlen = request.tokenlen;
+    packet.messageid = con ? request.messageid : nextMessageId();
+    packet.optionnum = 0;
+
+    uint8_t blockBuf[3] = {0};
+    packet.addOption(COAP_BLOCK1, coapEncodeUint(num << 4 | 0x08 | szx, blockBuf), blockBuf);
+    this->sendPacket(packet, ip, port);
+    return false;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::sendBlockComplete(IPAddress ip, int port, CoapPacket &request, COAP_RESPONSE_CODE code,
+                                              const char *payload, size_t payloadlen, COAP_CONTENT_TYPE type)
+{
+    CoapPacket packet;
+    bool con = request.type == COAP_CON;
+    packet.type = con ? COAP_ACK : COAP_NONCON;
+    packet.code = code;
+    packet.token = request.token;
+    packet.tokenlen = request.tokenlen;
+    packet.messageid = con ? request.messageid : nextMessageId();
+    packet.payload = (uint8_t *)payload;
+    packet.payloadlen = payloadlen;
+    packet.optionnum = 0;
+
+    uint8_t formatBuf[3], blockBuf[3];
+    if (type != COAP_NONE && payloadlen > 0)
+        packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+    uint32_t num = 0;
+    bool more = false;
+    uint8_t szx = 0;
+    if (request.getBlock(COAP_BLOCK1, num, more, szx, true))
+        packet.addOption(COAP_BLOCK1, coapEncodeUint(num << 4 | szx, blockBuf), blockBuf);
+    return this->sendPacket(packet, ip, port);
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::notify(Observer *observer, const char *payload, int payload_len, COAP_CONTENT_TYPE type)
+{
+    CoapPacket packet;
+
+    packet.type = COAP_NONCON; // Notifications are non-confirmable.
+    packet.code = COAP_CONTENT;
+    packet.token = observer->token;
+    packet.tokenlen = observer->token_len;
+    packet.payload = (uint8_t *)payload;
+    packet.payloadlen = payload_len;
+    packet.optionnum = 0;
+    uint32_t observe_seq = ++observer->counter;
+    packet.messageid = nextMessageId();
+
+    uint8_t observeBuf[3] = {0};
+    uint8_t observeLen = coapEncodeUint(observe_seq, observeBuf);
+    packet.addOption(COAP_OBSERVE, observeLen, observeBuf);
+
+    uint8_t formatBuf[3];
+    if (payload_len > 0 && type != COAP_NONE)
+        packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+
+    return this->sendPacket(packet, observer->ip, observer->port);
+}
+
+template <class Traits>
+int BasicCoap<Traits>::observeResourceFind(const char *url, bool create)
+{
+    uint32_t hash = coapHash(COAP_HASH_SEED, (const uint8_t *)url, strlen(url));
+    int free_slot = -1;
+    for (int i = 0; i < Traits::MAX_OBSERVE_RESOURCES; i++)
+    {
+        ObserveResource &res = observe->resources[i];
+        if (res.count == 0)
+        {
+            if (free_slot < 0)
+                free_slot = i;
+            continue;
+        }
+        if (res.hash == hash && strcmp(res.url, url) == 0)
+            return i;
+    }
+    if (!create || free_slot < 0)
+        return -1;
+
+    ObserveResource &res = observe->resources[free_slot];
+    res.hash = hash;
+    res.head = NO_OBSERVER;
+    res.interval_ms = Traits::NOTIFY_INTERVAL_MS;
+    res.notified = false;
+    if (Traits::NOTIFY_COALESCE)
+        notifications->values[free_slot].due = notifications->values[free_slot].valid = false;
+    strncpy(res.url, url, Traits::MAX_OBSERVE_URL_LEN - 1);
+    res.url[Traits::MAX_OBSERVE_URL_LEN - 1] = 0;
+    return free_slot;
+}
+
+template <class Traits>
+uint16_t BasicCoap<Traits>::observerFind(IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen) const
+{
+    uint16_t slot = coapTokenHash(ip, port, token, tokenlen) & (ObserveState::INDEX_SIZE - 1);
+    while (observe->index[slot] != 0)
+    {
+        uint16_t n = observe->index[slot] - 1;
+        const ObserveEntry &entry = observe->entries[n];
+        if (entry.port == (uint16_t)port && entry.ip == ip && coapTokenEquals(entry.token, entry.tokenlen, token, tokenlen))
+            return n;
+        slot = (slot + 1) & (ObserveState::INDEX_SIZE - 1);
+    }
+    return NO_OBSERVER;
+}
+
+// Moves an observer to the newest end of the lease order.
+template <class Traits>
+void BasicCoap<Traits>::observerTouch(uint16_t n)
+{
+    ObserveEntry &entry = observe->entries[n];
+    if (observe->newest == n)
+        return;
+
+    // unlink, if it is linked
+    if (entry.older != NO_OBSERVER)
+        observe->entries[entry.older].newer = entry.newer;
+    else if (observe->oldest == n)
+        observe->oldest = entry.newer;
+    if (entry.newer != NO_OBSERVER)
+        observe->entries[entry.newer].older = entry.older;
+
+    entry.older = observe->newest;
+    entry.newer = NO_OBSERVER;
+    if (observe->newest != NO_OBSERVER)
+        observe->entries[observe->newest].newer = n;
+    observe->newest = n;
+    if (observe->oldest == NO_OBSERVER)
+        observe->oldest = n;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::observerRemove(uint16_t n)
+{
+    ObserveEntry &entry = observe->entries[n];
+
+    // index, with backward-shift deletion
+    uint16_t mask = ObserveState::INDEX_SIZE - 1;
+    uint16_t slot = coapTokenHash(entry.ip, entry.port, entry.token, entry.tokenlen) & mask;
+    while (observe->index[slot] != n + 1)
+        slot = (slot + 1) & mask;
+    uint16_t hole = slot;
+    for (uint16_t next = (hole + 1) & mask; observe->index[next] != 0; next = (next + 1) & mask)
+    {
+        const ObserveEntry &moved = observe->entries[observe->index[next] - 1];
+        uint16_t home = coapTokenHash(moved.ip, moved.port, moved.token, moved.tokenlen) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            observe->index[hole] = observe->index[next];
+            hole = next;
+        }
+    }
+    observe->index[hole] = 0;
+
+    // resource list; the URL is released with its last observer
+    ObserveResource &res = observe->resources[entry.resource];
+    if (entry.prev != NO_OBSERVER)
+        observe->entries[entry.prev].next = entry.next;
+    else
+        res.head = entry.next;
+    if (entry.next != NO_OBSERVER)
+        observe->entries[entry.next].prev = entry.prev;
+    res.count--;
+
+    // lease order
+    if (entry.older != NO_OBSERVER)
+        observe->entries[entry.older].newer = entry.newer;
+    else
+        observe->oldest = entry.newer;
+    if (entry.newer != NO_OBSERVER)
+        observe->entries[entry.newer].older = entry.older;
+    else
+        observe->newest = entry.older;
+
+    if (entry.confirming)
+        observe->confirming--;
+    entry.in_use = false;
+    entry.tokenlen = 0;
+    entry.observe_seq = 0;
+    entry.confirming = entry.pending = false;
+    entry.older = entry.newer = entry.prev = NO_OBSERVER;
+    entry.next = observe->free_list;
+    observe->free_list = n;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::observerExpire(unsigned long now)
+{
+    if (!Traits::OBSERVE || COAP_OBSERVER_LEASE_MS == 0)
+        return;
+    // every lease has the same length, so the oldest registration expires first
+    while (observe->oldest != NO_OBSERVER && (unsigned long)(now - observe->entries[observe->oldest].last_seen_ms) > COAP_OBSERVER_LEASE_MS)
+    {
+        count(COAP_STAT_OBSERVERS_EXPIRED);
+        observerRemove(observe->oldest);
+    }
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::addObserver(const char *url, IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen)
+{
+    if (!Traits::OBSERVE || url == NULL)
+        return false;
+    if (strlen(url) >= Traits::MAX_OBSERVE_URL_LEN)
+        return false;
+    if (tokenlen > 8)
+        return false;
+
+    unsigned long now = millis();
+    observerExpire(now);
+
+    // re-registration of the same observation refreshes its lease
+    uint16_t n = observerFind(ip, port, token, tokenlen);
+    if (n != NO_OBSERVER && strcmp(observe->resources[observe->entries[n].resource].url, url) == 0)
+    {
+        observe->entries[n].last_seen_ms = now;
+        observerTouch(n);
+        return true;
+    }
+    // the token now refers to another resource
+    if (n != NO_OBSERVER)
+        observerRemove(n);
+
+    if (observe->free_list == NO_OBSERVER)
+        return false;
+    int resource = observeResourceFind(url, true);
+    if (resource < 0)
+        return false;
+
+    n = observe->free_list;
+    ObserveEntry &entry = observe->entries[n];
+    observe->free_list = entry.next;
+
+    entry.in_use = true;
+    entry.ip = ip;
+    entry.port = (uint16_t)port;
+    entry.tokenlen = tokenlen;
+    if (tokenlen > 0 && token != NULL)
+        memcpy(entry.token, token, tokenlen);
+    entry.resource = (uint8_t)resource;
+    entry.observe_seq = 0;
+    entry.last_seen_ms = now;
+    entry.last_con_ms = now;
+
+    ObserveResource &res = observe->resources[resource];
+    entry.prev = NO_OBSERVER;
+    entry.next = res.head;
+    if (res.head != NO_OBSERVER)
+        observe->entries[res.head].prev = n;
+    res.head = n;
+    res.count++;
+
+    entry.older = entry.newer = NO_OBSERVER;
+    observerTouch(n);
+
+    uint16_t slot = coapTokenHash(ip, port, token, tokenlen) & (ObserveState::INDEX_SIZE - 1);
+    while (observe->index[slot] != 0)
+        slot = (slot + 1) & (ObserveState::INDEX_SIZE - 1);
+    observe->index[slot] = n + 1;
+    return true;
+}
+
+template <class Traits>
+bool BasicCoap<Traits>::removeObserver(const char *url, IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen)
+{
+    if (!Traits::OBSERVE || url == NULL)
+        return false;
+    uint16_t n = observerFind(ip, port, token, tokenlen);
+    if (n == NO_OBSERVER || strcmp(observe->resources[observe->entries[n].resource].url, url) != 0)
+        return false;
+    observerRemove(n);
+    return true;
+}
+
+template <class Traits>
+int BasicCoap<Traits>::notify(const char *url, const char *payload, int payload_len, COAP_CONTENT_TYPE type)
+{
+    return this->notify(url, payload, payload_len, type, Traits::NOTIFY_INTERVAL_MS);
+}
+
+template <class Traits>
+int BasicCoap<Traits>::notify(const char *url, const char *payload, int payload_len, COAP_CONTENT_TYPE type, uint32_t min_interval_ms)
+{
+    if (!Traits::OBSERVE || url == NULL)
+        return 0;
+
+    unsigned long now = millis();
+    observerExpire(now);
+    int resource = observeResourceFind(url, false);
+    if (resource < 0)
+        return 0;
+    ObserveResource &res = observe->resources[resource];
+    res.interval_ms = min_interval_ms;
+
+    // the latest value is kept for coalescing and for observers skipped
+    // while they confirm; one that does not fit is only sent now
+    if (Traits::NOTIFY_COALESCE)
+    {
+        NotifyValue &latest = notifications->values[resource];
+        latest.valid = payload_len >= 0 && (size_t)payload_len <= sizeof(latest.value);
+        latest.due = false;
+        if (latest.valid)
+        {
+            latest.type = type;
+            latest.len = payload_len;
+            memcpy(latest.value, payload, payload_len);
+            if (res.notified && min_interval_ms > 0 && (unsigned long)(now - res.last_sent_ms) < min_interval_ms)
+            {
+                latest.due = true;
+                return 0;
+            }
+        }
+    }
+    return notifyResource(resource, (const uint8_t *)payload, payload_len, type, now);
+}
+
+// Encodes everything after the Observe option into tx_buffer. It is the
+// same for every observer and sent after a per-observer head. Returns its
+// length, 0 for a notification without options and payload, or -1 if it
+// does not fit.
+template <class Traits>
+int BasicCoap<Traits>::notifyTail(const uint8_t *payload, size_t payload_len, COAP_CONTENT_TYPE type)
+{
+    CoapPacket shared;
+    shared.optionnum = 0;
+    uint8_t formatBuf[3];
+    if (type != COAP_NONE)
+        shared.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+
+    // room for the head: header, token, Observe option header and value
+    const size_t head_max = COAP_HEADER_SIZE + 8 + 1 + 3;
+    uint16_t tailSize = encodeOptions(shared, 0, COAP_OBSERVE);
+    if ((tailSize == 0 && shared.optionnum > 0) || tailSize + 1 + payload_len + head_max >= (size_t)coap_buf_size)
+    {
+        count(COAP_STAT_TX_FAILED);
+        return -1;
+    }
+    if (payload_len > 0)
+    {
+        this->tx_buffer[tailSize] = 0xFF;
+        memcpy(this->tx_buffer + tailSize + 1, payload, payload_len);
+        tailSize += 1 + payload_len;
+    }
+    return tailSize;
+}
+
+// Sends the tail in tx_buffer to observer n after its own head.
+template <class Traits>
+bool BasicCoap<Traits>::notifyObserver(uint16_t n, uint16_t tailSize, unsigned long now)
+{
+    ObserveEntry &observer = observe->entries[n];
+    uint8_t c = tcpFind(observer.ip, observer.port);
+    bool confirmable = c == NO_CONNECTION && (unsigned long)(now - observer.last_con_ms) >= COAP_NOTIFY_CON_INTERVAL_MS;
+    uint16_t messageid = nextMessageId();
+
+    uint8_t head[COAP_HEADER_SIZE + 8 + 1 + 3];
+    uint8_t *p = head;
+    *p++ = 0x01 << 6 | ((confirmable ? COAP_CON : COAP_NONCON) << 4) | (observer.tokenlen & 0x0F);
+    *p++ = COAP_CONTENT;
+    *p++ = messageid >> 8;
+    *p++ = messageid & 0xFF;
+    memcpy(p, observer.token, observer.tokenlen);
+    p += observer.tokenlen;
+
+    uint32_t observe_seq = ++observer.observe_seq;
+    uint8_t observeLen = coapEncodeUint(observe_seq, p + 1);
+    *p = (COAP_OBSERVE << 4) | observeLen;
+    p += 1 + observeLen;
+
+    if (c != NO_CONNECTION)
+    {
+        observer.messageid = messageid;
+        observer.pending = false;
+        return tcpWrite(c, head, p - head, this->tx_buffer, tailSize);
+    }
+
+    TransmitAction action = TRANSMIT_NOW;
+    if (confirmable)
+        action = scheduleTransmission(observer.ip, observer.port, messageid, head, p - head, this->tx_buffer, tailSize);
+    if (action == TRANSMIT_DROPPED)
+    {
+        count(COAP_STAT_TX_FAILED);
+        return false;
+    }
+
+    bool sent = true;
+    if (action == TRANSMIT_NOW)
+    {
+        traceRecord(COAP_TRACE_TX, observer.ip, observer.port, head, p - head, this->tx_buffer, tailSize);
+        unsigned long started = timingStart();
+        _udp->beginPacket(observer.ip, observer.port);
+        _udp->write(head, p - head);
+        _udp->write(this->tx_buffer, tailSize);
+        sent = _udp->endPacket();
+        timingEnd(COAP_TIMING_SEND, started);
+        count(COAP_STAT_TX);
+    }
+
+    observer.messageid = messageid;
+    observer.pending = false;
+    if (confirmable)
+    {
+        observer.last_con_ms = now;
+        if (!observer.confirming)
+            observe->confirming++;
+        observer.confirming = true;
+    }
+    return sent;
+}
+
+template <class Traits>
+int BasicCoap<Traits>::notifyResource(uint8_t resource, const uint8_t *payload, size_t payload_len, COAP_CONTENT_TYPE type, unsigned long now)
+{
+    ObserveResource &res = observe->resources[resource];
+    res.last_sent_ms = now;
+    res.notified = true;
+
+    int tailSize = notifyTail(payload, payload_len, type);
+    if (tailSize < 0)
+        return 0;
+
+    int sent = 0;
+    for (uint16_t n = res.head; n != NO_OBSERVER; n = observe->entries[n].next)
+    {
+        ObserveEntry &observer = observe->entries[n];
+        // a newer value replaces the one still being confirmed
+        if (Traits::NOTIFY_COALESCE && observer.confirming && notifications->values[resource].valid)
+        {
+            observer.pending = true;
+            continue;
+        }
+        if (notifyObserver(n, tailSize, now))
+            sent++;
+    }
+    return sent;
+}
+
+// Sends coalesced values whose interval has passed.
+template <class Traits>
+void BasicCoap<Traits>::notifyDue(unsigned long now)
+{
+    if (!Traits::OBSERVE || !Traits::NOTIFY_COALESCE)
+        return;
+    for (uint8_t i = 0; i < Traits::MAX_OBSERVE_RESOURCES; i++)
+    {
+        NotifyValue &latest = notifications->values[i];
+        const ObserveResource &res = observe->resources[i];
+        if (latest.due && res.count > 0 && (unsigned long)(now - res.last_sent_ms) >= res.interval_ms)
+        {
+            latest.due = false;
+            notifyResource(i, latest.value, latest.len, latest.type, now);
+        }
+    }
+}
+
+template <class Traits>
+void BasicCoap<Traits>::observerAcked(IPAddress ip, int port, uint16_t messageid)
+{
+    if (!Traits::OBSERVE || observe->confirming == 0)
+        return;
+    for (uint16_t n = 0; n < Traits::MAX_OBSERVERS; n++)
+    {
+        ObserveEntry &observer = observe->entries[n];
+        if (!observer.confirming || observer.messageid != messageid || observer.port != (uint16_t)port || !(observer.ip == ip))
+            continue;
+        observer.confirming = false;
+        observe->confirming--;
+        if (Traits::NOTIFY_COALESCE && observer.pending)
+        {
+            const NotifyValue &latest = notifications->values[observer.resource];
+            int tailSize = notifyTail(latest.value, latest.len, latest.type);
+            if (tailSize >= 0)
+                notifyObserver(n, tailSize, millis());
+        }
+        return;
+    }
+}
+
+// A Reset to a notification, or a CON one that was never acknowledged,
+// ends the observation (RFC 7641 section 3.6 and 4.5).
+template <class Traits>
+void BasicCoap<Traits>::observerRejected(IPAddress ip, int port, uint16_t messageid)
+{
+    if (!Traits::OBSERVE || observe->oldest == NO_OBSERVER)
+        return;
+    for (uint16_t n = 0; n < Traits::MAX_OBSERVERS; n++)
+    {
+        const ObserveEntry &observer = observe->entries[n];
+        if (observer.in_use && observer.messageid == messageid && observer.port == (uint16_t)port && observer.ip == ip)
+        {
+            observerRemove(n);
+            return;
+        }
+    }
+}
+
+// Forward proxy (RFC 7252 section 5.7). A GET is answered from the cache
+// while its response is fresh. A stale one is fetched again, with its ETag
+// so that the origin can answer 2.03 instead of the whole representation.
+// Clients asking for a target that is being fetched wait for that response.
+template <class Traits>
+void BasicCoap<Traits>::proxyRequest(CoapPacket &request, IPAddress ip, int port)
+{
+    if (!Traits::PROXY)
+        return;
+
+    char url[Traits::PROXY_URL_LEN];
+    IPAddress origin;
+    uint16_t origin_port;
+    int urllen = coapProxyTarget(request, origin, origin_port, url, sizeof(url));
+    if (urllen < 0)
+    {
+        sendResponse(ip, port, request.messageid, NULL, 0, COAP_PROXYING_NOT_SUPPORTED, COAP_NONE, request.token, request.tokenlen);
+        return;
+    }
+    uint32_t value;
+    int32_t accept = request.getUintOption(COAP_ACCEPT, value) ? (int32_t)value : (int32_t)COAP_NONE;
+    // each block of a larger body is cached on its own (RFC 7959 section 2.10)
+    int32_t block = request.getUintOption(COAP_BLOCK2, value) ? (int32_t)(value & ~0x08UL) : (int32_t)COAP_NONE;
+    uint32_t hash = coapHash(coapTokenHash(origin, origin_port, (const uint8_t *)url, urllen), (const uint8_t *)&accept, sizeof(accept));
+    hash = coapHash(hash, (const uint8_t *)&block, sizeof(block));
+    uint8_t n = proxyFind(origin, origin_port, accept, block, url, hash);
+    unsigned long now = millis();
+
+    if (request.code != COAP_GET)
+    {
+        // other methods are forwarded uncached and outdate the cached GET
+        // responses of their target (RFC 7252 section 5.9)
+        proxyInvalidate(origin, origin_port, url);
+    }
+    else if (n != NO_PROXY_ENTRY)
+    {
+        ProxyEntry &entry = proxy->entries[n];
+        proxyUnlink(n);
+        proxyLink(n);
+        if (entry.fetching)
+        {
+            proxyWait(n, request, ip, port);
+            return;
+        }
+        if (now - entry.stored_ms < entry.max_age_s * 1000UL)
+        {
+            count(COAP_STAT_PROXY_HITS);
+            // the client's own copy may still be current (RFC 7252 section 5.10.6.2)
+            uint8_t code = entry.code;
+            for (const CoapOption *etag = request.getOption(COAP_E_TAG); etag != NULL; etag = request.nextOption(etag))
+            {
+                if (entry.code == COAP_CONTENT && entry.etaglen > 0 && etag->length == entry.etaglen &&
+                    memcmp(etag->buffer, entry.etag, entry.etaglen) == 0)
+                    code = COAP_VALID;
+            }
+            proxyRespond(exchangeOf(request, ip, port), false, &entry, code, now);
+            return;
+        }
+        proxyFetch(n, request, ip, port);
+        return;
+    }
+
+    n = proxyAllocate();
+    if (n == NO_PROXY_ENTRY)
+    {
+        count(COAP_STAT_UNAVAILABLE);
+        sendResponse(ip, port, request.messageid, NULL, 0, COAP_SERVICE_UNAVAILABLE, COAP_NONE, request.token, request.tokenlen);
+        return;
+    }
+    ProxyEntry &entry = proxy->entries[n];
+    entry.indexed = request.code == COAP_GET;
+    entry.hash = hash;
+    entry.ip = origin;
+    entry.port = origin_port;
+    entry.accept = accept;
+    entry.block = block;
+    memcpy(entry.url, url, urllen + 1);
+    if (entry.indexed)
+    {
+        uint16_t slot = proxyHome(entry);
+        while (proxy->index[slot] != 0)
+            slot = (slot + 1) & (ProxyState::INDEX_SIZE - 1);
+        proxy->index[slot] = n + 1;
+    }
+    if (!proxyFetch(n, request, ip, port))
+        proxyRelease(n);
+}
+
+template <class Traits>
+uint8_t BasicCoap<Traits>::proxyFind(IPAddress ip, uint16_t port, int32_t accept, int32_t block, const char *url, uint32_t hash) const
+{
+    uint16_t mask = ProxyState::INDEX_SIZE - 1;
+    for (uint16_t slot = hash & mask; proxy->index[slot] != 0; slot = (slot + 1) & mask)
+    {
+        uint8_t n = proxy->index[slot] - 1;
+        const ProxyEntry &entry = proxy->entries[n];
+        if (entry.hash == hash && entry.port == port && entry.ip == ip && entry.accept == accept && entry.block == block &&
+            strcmp(entry.url, url) == 0)
+            return n;
+    }
+    return NO_PROXY_ENTRY;
+}
+
+// Drops the cached responses of a target, whatever their Accept and block.
+template <class Traits>
+void BasicCoap<Traits>::proxyInvalidate(IPAddress ip, uint16_t port, const char *url)
+{
+    for (uint8_t n = 0; n < Traits::PROXY_CACHE_ENTRIES; n++)
+    {
+        const ProxyEntry &entry = proxy->entries[n];
+        if (entry.indexed && !entry.fetching && entry.port == port && entry.ip == ip && strcmp(entry.url, url) == 0)
+            proxyRelease(n);
+    }
+}
+
+// A free entry, or the least recently used one that no client waits for.
+template <class Traits>
+uint8_t BasicCoap<Traits>::proxyAllocate()
+{
+    if (proxy->free_entry == NO_PROXY_ENTRY)
+    {
+        uint8_t victim = proxy->oldest;
+        while (victim != NO_PROXY_ENTRY && proxy->entries[victim].fetching)
+            victim = proxy->entries[victim].newer;
+        if (victim == NO_PROXY_ENTRY)
+            return NO_PROXY_ENTRY;
+        proxyRelease(victim);
+    }
+    uint8_t n = proxy->free_entry;
+    proxy->free_entry = proxy->entries[n].newer;
+    proxyLink(n);
+    return n;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::proxyRelease(uint8_t n)
+{
+    ProxyEntry &entry = proxy->entries[n];
+    if (entry.indexed)
+    {
+        // backward-shift deletion, as for the other indexes
+        uint16_t mask = ProxyState::INDEX_SIZE - 1;
+        uint16_t slot = proxyHome(entry);
+        while (proxy->index[slot] != n + 1)
+            slot = (slot + 1) & mask;
+        uint16_t hole = slot;
+        for (uint16_t next = (hole + 1) & mask; proxy->index[next] != 0; next = (next + 1) & mask)
+        {
+            uint16_t home = proxyHome(proxy->entries[proxy->index[next] - 1]);
+            if (((next - home) & mask) >= ((next - hole) & mask))
+            {
+                proxy->index[hole] = proxy->index[next];
+                hole = next;
+            }
+        }
+        proxy->index[hole] = 0;
+    }
+    proxyUnlink(n);
+    entry.cached = false;
+    entry.fetching = false;
+    entry.indexed = false;
+    entry.etaglen = 0;
+    entry.newer = proxy->free_entry;
+    proxy->free_entry = n;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::proxyLink(uint8_t n)
+{
+    ProxyEntry &entry = proxy->entries[n];
+    entry.newer = NO_PROXY_ENTRY;
+    entry.older = proxy->newest;
+    if (proxy->newest != NO_PROXY_ENTRY)
+        proxy->entries[proxy->newest].newer = n;
+    else
+        proxy->oldest = n;
+    proxy->newest = n;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::proxyUnlink(uint8_t n)
+{
+    ProxyEntry &entry = proxy->entries[n];
+    if (entry.older != NO_PROXY_ENTRY)
+        proxy->entries[entry.older].newer = entry.newer;
+    else
+        proxy->oldest = entry.newer;
+    if (entry.newer != NO_PROXY_ENTRY)
+        proxy->entries[entry.newer].older = entry.older;
+    else
+        proxy->newest = entry.older;
+    entry.older = NO_PROXY_ENTRY;
+    entry.newer = NO_PROXY_ENTRY;
+}
+
+// Sends request on to the origin through the transaction table.
+// @return false if it could not be sent; the client got a 5.03 then.
+template <class Traits>
+bool BasicCoap<Traits>::proxyFetch(uint8_t n, CoapPacket &request, IPAddress ip, int port)
+{
+    ProxyEntry &entry = proxy->entries[n];
+    CoapPacket forward;
+    forward.type = COAP_CON;
+    forward.code = request.code;
+    forward.payload = request.payload;
+    forward.payloadlen = request.payloadlen;
+    if (entry.url[0] != '\0')
+        forward.addUriOptions(entry.url);
+    if (entry.cached && entry.etaglen > 0)
+        forward.addOption(COAP_E_TAG, entry.etaglen, entry.etag);
+    uint8_t acceptBuf[3];
+    if (entry.accept != COAP_NONE)
+        forward.addOption(COAP_ACCEPT, coapEncodeUint(entry.accept, acceptBuf), acceptBuf);
+    // the block-wise options pass through, the origin does the reassembly
+    static const uint16_t copied[] = {COAP_CONTENT_FORMAT, COAP_BLOCK2, COAP_BLOCK1, COAP_SIZE2, COAP_SIZE1};
+    for (uint8_t i = 0; i < sizeof(copied) / sizeof(copied[0]); i++)
+    {
+        const CoapOption *option = request.getOption(copied[i]);
+        if (option != NULL)
+            forward.addOption(copied[i], option->length, option->buffer);
+    }
+
+    if (this->send(entry.ip, entry.port, forward, proxyResponse, &entry) == 0)
+    {
+        count(COAP_STAT_UNAVAILABLE);
+        sendResponse(ip, port, request.messageid, NULL, 0, COAP_SERVICE_UNAVAILABLE, COAP_NONE, request.token, request.tokenlen);
+        return false;
+    }
+    count(COAP_STAT_PROXY_FORWARDED);
+    entry.fetching = true;
+    proxyWait(n, request, ip, port);
+    return true;
+}
+
+// Queues the client for the response of the outstanding request.
+template <class Traits>
+void BasicCoap<Traits>::proxyWait(uint8_t n, CoapPacket &request, IPAddress ip, int port)
+{
+    uint8_t w = proxy->free_waiter;
+    if (w == NO_PROXY_ENTRY)
+    {
+        count(COAP_STAT_UNAVAILABLE);
+        sendResponse(ip, port, request.messageid, NULL, 0, COAP_SERVICE_UNAVAILABLE, COAP_NONE, request.token, request.tokenlen);
+        return;
+    }
+    ProxyWaiter &waiter = proxy->waiters[w];
+    proxy->free_waiter = waiter.next;
+    // the origin may take a while, a CON request is acknowledged now
+    waiter.exchange = defer(request, ip, port);
+    waiter.next = proxy->entries[n].waiters;
+    proxy->entries[n].waiters = w;
+}
+
+template <class Traits>
+void BasicCoap<Traits>::proxyResponse(CoapPacket *response, IPAddress ip, int port, void *context)
+{
+    ProxyEntry *entry = (ProxyEntry *)context;
+    BasicCoap *coap = entry->owner;
+    coap->proxyComplete(entry - coap->proxy->entries, response);
+}
+
+// Copies the response into entry; a 2.03 only refreshes its freshness
+// and ETag when body is false.
+template <class Traits>
+void BasicCoap<Traits>::proxyStore(ProxyEntry &entry, const CoapPacket &response, bool body, unsigned long now)
+{
+    // Max-Age defaults to 60 seconds (RFC 7252 section 5.10.5)
+    uint32_t max_age = 60;
+    response.getUintOption(COAP_MAX_AGE, max_age);
+    entry.max_age_s = max_age < PROXY_MAX_AGE_S ? max_age : PROXY_MAX_AGE_S;
+    entry.stored_ms = now;
+
+    const uint8_t *etag;
+    uint16_t etaglen;
+    if (response.getOpaqueOption(COAP_E_TAG, etag, etaglen) && etaglen <= sizeof(entry.etag))
+    {
+        memcpy(entry.etag, etag, etaglen);
+        entry.etaglen = (uint8_t)etaglen;
+    }
+    else if (body)
+        entry.etaglen = 0;
+    if (!body)
+        return;
+
+    uint32_t value;
+    entry.code = response.code;
+    entry.format = response.getUintOption(COAP_CONTENT_FORMAT, value) ? (int32_t)value : (int32_t)COAP_NONE;
+    entry.block1 = response.getUintOption(COAP_BLOCK1, value) ? (int32_t)value : (int32_t)COAP_NONE;
+    entry.block2 = response.getUintOption(COAP_BLOCK2, value) ? (int32_t)value : (int32_t)COAP_NONE;
+    entry.size1 = response.getUintOption(COAP_SIZE1, value) ? (int32_t)value : (int32_t)COAP_NONE;
+    entry.size2 = response.getUintOption(COAP_SIZE2, value) ? (int32_t)value : (int32_t)COAP_NONE;
+    entry.len = response.payloadlen < sizeof(entry.payload) ? response.payloadlen : sizeof(entry.payload);
+    memcpy(entry.payload, response.payload, entry.len);
+    // 2.05 and error responses can be cached (RFC 7252 section 5.6), a
+    // block of a larger body under the Block2 it was asked with
+    entry.cached = entry.indexed && entry.max_age_s > 0 && entry.len == response.payloadlen &&
+                   (entry.code == COAP_CONTENT || (entry.code >> 5) >= 4);
+}
+
+template <class Traits>
+void BasicCoap<Traits>::proxyComplete(uint8_t n, CoapPacket *response)
+{
+    ProxyEntry &entry = proxy->entries[n];
+    unsigned long now = millis();
+    entry.fetching = false;
+
+    uint8_t code = COAP_GATEWAY_TIMEOUT;
+    const ProxyEntry *relay = NULL;
+    if (response != NULL)
+    {
+        bool valid = response->code == COAP_VALID && entry.cached;
+        if (valid)
+            count(COAP_STAT_PROXY_REVALIDATED);
+        proxyStore(entry, *response, !valid, now);
+        code = entry.code;
+        relay = &entry;
+    }
+
+    uint8_t w = entry.waiters;
+    entry.waiters = NO_PROXY_ENTRY;
+    while (w != NO_PROXY_ENTRY)
+    {
+        ProxyWaiter &waiter = proxy->waiters[w];
+        uint8_t next = waiter.next;
+        proxyRespond(waiter.exchange, true, relay, code, now);
+        waiter.next = proxy->free_waiter;
+        proxy->free_waiter = w;
+        w = next;
+    }
+
+    // a stale response is kept when the origin did not answer
+    if (!entry.cached)
+        proxyRelease(n);
+}
+
+// Answers a client with entry, piggybacked or as a separate response.
+template <class Traits>
+uint16_t BasicCoap<Traits>::proxyRespond(const CoapExchange &exchange, bool separate, const ProxyEntry *entry, uint8_t code, unsigned long now)
+{
+    CoapPacket packet;
+    if (exchange.type == COAP_CON)
+        packet.type = separate ? COAP_CON : COAP_ACK;
+    else
+        packet.type = COAP_NONCON;
+    packet.messageid = packet.type == COAP_ACK ? exchange.messageid : nextMessageId();
+    packet.code = code;
+    packet.token = exchange.token;
+    packet.tokenlen = exchange.tokenlen;
+
+    uint8_t ageBuf[3];
+    uint8_t formatBuf[3];
+    uint8_t blockBuf[4][3];
+    if (entry != NULL)
+    {
+        if (entry->etaglen > 0)
+            packet.addOption(COAP_E_TAG, entry->etaglen, (uint8_t *)entry->etag);
+        if (entry->indexed)
+        {
+            // what is left of the freshness (RFC 7252 section 5.6.1)
+            uint32_t age = (now - entry->stored_ms) / 1000;
+            uint32_t left = age < entry->max_age_s ? entry->max_age_s - age : 0;
+            packet.addOption(COAP_MAX_AGE, coapEncodeUint(left, ageBuf), ageBuf);
+        }
+        if (entry->block1 != COAP_NONE)
+            packet.addOption(COAP_BLOCK1, coapEncodeUint(entry->block1, blockBuf[0]), blockBuf[0]);
+        if (entry->block2 != COAP_NONE)
+            packet.addOption(COAP_BLOCK2, coapEncodeUint(entry->block2, blockBuf[1]), blockBuf[1]);
+        if (entry->size1 != COAP_NONE)
+            packet.addOption(COAP_SIZE1, coapEncodeUint(entry->size1, blockBuf[2]), blockBuf[2]);
+        if (entry->size2 != COAP_NONE)
+            packet.addOption(COAP_SIZE2, coapEncodeUint(entry->size2, blockBuf[3]), blockBuf[3]);
+        if (code != COAP_VALID)
+        {
+            if (entry->format != COAP_NONE)
+                packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(entry->format, formatBuf), formatBuf);
+            packet.payload = entry->payload;
+            packet.payloadlen = entry->len;
+        }
+    }
+    return this->sendPacket(packet, exchange.ip, exchange.port);
+}
+
+#endif
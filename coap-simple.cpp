@@ -1,281 +1,343 @@
 #include "coap-simple.h"
 #include "Arduino.h"
+#include <stdarg.h>
+#include <stdio.h>
 
 #define LOGGING
 
-void CoapPacket::addOption(uint8_t number, uint8_t length, uint8_t *opt_payload)
+// Compact number of a registered option, or -1.
+static int8_t optionId(uint16_t number)
 {
+    switch (number)
+    {
+    case COAP_IF_MATCH:
+        return 0;
+    case COAP_URI_HOST:
+        return 1;
+    case COAP_E_TAG:
+        return 2;
+    case COAP_IF_NONE_MATCH:
+        return 3;
+    case COAP_OBSERVE:
+        return 4;
+    case COAP_URI_PORT:
+        return 5;
+    case COAP_LOCATION_PATH:
+        return 6;
+    case COAP_URI_PATH:
+        return 7;
+    case COAP_CONTENT_FORMAT:
+        return 8;
+    case COAP_MAX_AGE:
+        return 9;
+    case COAP_URI_QUERY:
+        return 10;
+    case COAP_ACCEPT:
+        return 11;
+    case COAP_LOCATION_QUERY:
+        return 12;
+    case COAP_BLOCK2:
+        return 13;
+    case COAP_BLOCK1:
+        return 14;
+    case COAP_SIZE2:
+        return 15;
+    case COAP_PROXY_URI:
+        return 16;
+    case COAP_PROXY_SCHEME:
+        return 17;
+    case COAP_SIZE1:
+        return 18;
+    }
+    return -1;
+}
+
+void CoapPacket::indexOption(uint8_t pos)
+{
+    int8_t id = optionId(options[pos].number);
+    if (id < 0 || (option_present & (1UL << id)))
+        return;
+    option_present |= 1UL << id;
+    option_first[id] = pos;
+}
+
+void CoapPacket::addOption(uint16_t number, uint16_t length, uint8_t *opt_payload)
+{
+    if (optionnum == 0)
+        option_present = 0;
     if (optionnum >= COAP_MAX_OPTION_NUM)
     {
         return;
     }
-    options[optionnum].number = number;
-    options[optionnum].length = length;
-    options[optionnum].buffer = opt_payload;
+    // keep options ordered by number, the encoder writes them as deltas
+    int i = optionnum;
+    while (i > 0 && options[i - 1].number > number)
+    {
+        options[i] = options[i - 1];
+        i--;
+    }
+    options[i].number = number;
+    options[i].length = length;
+    options[i].buffer = opt_payload;
 
     ++optionnum;
-}
 
-bool CoapPacket::isObserve()
-{
-    for (int i = 0; i < optionnum; i++)
+    // options behind the insertion point moved up by one
+    for (uint8_t id = 0; id < COAP_INDEXED_OPTIONS; id++)
     {
-        if (options[i].number == COAP_OBSERVE)
-        {
-            return true;
-        }
+        if ((option_present & (1UL << id)) && option_first[id] >= i)
+            option_first[id]++;
     }
-    return false;
+    indexOption(i);
 }
 
-bool CoapPacket::getObserveValue(uint32_t &value)
+const CoapOption *CoapPacket::getOption(uint16_t number) const
 {
+    int8_t id = optionId(number);
+    if (id >= 0)
+    {
+        if (!(option_present & (1UL << id)) || option_first[id] >= optionnum)
+            return NULL;
+        return &options[option_first[id]];
+    }
     for (int i = 0; i < optionnum; i++)
     {
-        if (options[i].number != COAP_OBSERVE)
-            continue;
-        if (options[i].length > 3)
-            return false;
-        uint32_t v = 0;
-        for (uint8_t j = 0; j < options[i].length; j++)
-        {
-            v = (v << 8) | options[i].buffer[j];
-        }
-        value = v;
-        return true;
+        if (options[i].number == number)
+            return &options[i];
     }
-    return false;
+    return NULL;
 }
 
-Coap::Coap(
-    UDP &udp,
-    int coap_buf_size /* default value is COAP_BUF_MAX_SIZE */
-)
+const CoapOption *CoapPacket::nextOption(const CoapOption *prev) const
 {
-    this->_udp = &udp;
-    this->coap_buf_size = coap_buf_size;
-    this->tx_buffer = new uint8_t[this->coap_buf_size];
-    this->rx_buffer = new uint8_t[this->coap_buf_size];
+    // options[] is ordered by number, so repeated options are adjacent
+    if (prev == NULL || prev + 1 >= options + optionnum || prev[1].number != prev->number)
+        return NULL;
+    return prev + 1;
 }
 
-Coap::~Coap()
+bool CoapPacket::getUintOption(uint16_t number, uint32_t &value) const
 {
-    if (this->tx_buffer != NULL)
-        delete[] this->tx_buffer;
-
-    if (this->rx_buffer != NULL)
-        delete[] this->rx_buffer;
+    const CoapOption *option = getOption(number);
+    if (option == NULL || option->length > 4)
+        return false;
+    uint32_t v = 0;
+    for (uint16_t i = 0; i < option->length; i++)
+        v = (v << 8) | option->buffer[i];
+    value = v;
+    return true;
 }
 
-bool Coap::start()
+bool CoapPacket::getOpaqueOption(uint16_t number, const uint8_t *&value, uint16_t &length) const
 {
-    this->start(COAP_DEFAULT_PORT);
+    const CoapOption *option = getOption(number);
+    if (option == NULL)
+        return false;
+    value = option->buffer;
+    length = option->length;
     return true;
 }
 
-bool Coap::start(int port)
+bool CoapPacket::getStringOption(uint16_t number, const char *&value, uint16_t &length) const
 {
-    this->_udp->begin(port);
+    const uint8_t *data;
+    if (!getOpaqueOption(number, data, length))
+        return false;
+    value = (const char *)data;
     return true;
 }
 
-uint16_t Coap::sendPacket(CoapPacket &packet, IPAddress ip)
+bool CoapPacket::isObserve() const
 {
-    return this->sendPacket(packet, ip, COAP_DEFAULT_PORT);
+    return hasOption(COAP_OBSERVE);
 }
 
-uint16_t Coap::sendPacket(CoapPacket &packet, IPAddress ip, int port)
+bool CoapPacket::getObserveValue(uint32_t &value) const
 {
-    uint8_t *p = this->tx_buffer;
-    uint16_t running_delta = 0;
-    uint16_t packetSize = 0;
-
-    // make coap packet base header
-    *p = 0x01 << 6;
-    *p |= (packet.type & 0x03) << 4;
-    *p++ |= (packet.tokenlen & 0x0F);
-    *p++ = packet.code;
-    *p++ = (packet.messageid >> 8);
-    *p++ = (packet.messageid & 0xFF);
-    p = this->tx_buffer + COAP_HEADER_SIZE;
-    packetSize += 4;
+    const CoapOption *option = getOption(COAP_OBSERVE);
+    if (option == NULL || option->length > 3)
+        return false;
+    return getUintOption(COAP_OBSERVE, value);
+}
 
-    // make token
-    if (packet.token != NULL && packet.tokenlen <= 0x0F)
+uint8_t coapEncodeUint(uint32_t value, uint8_t out[3])
+{
+    if (value == 0)
     {
-        memcpy(p, packet.token, packet.tokenlen);
-        p += packet.tokenlen;
-        packetSize += packet.tokenlen;
+        // CoAP uint option encoding uses a zero-length option for value 0.
+        return 0;
     }
-
-    // make option header
-    for (int i = 0; i < packet.optionnum; i++)
+    if (value <= 0xFF)
     {
-        uint32_t optdelta;
-        uint8_t len, delta;
-
-        if (packetSize + 5 + packet.options[i].length >= coap_buf_size)
-        {
-            return 0;
-        }
-        optdelta = packet.options[i].number - running_delta;
-        COAP_OPTION_DELTA(optdelta, &delta);
-        COAP_OPTION_DELTA((uint32_t)packet.options[i].length, &len);
-
-        *p++ = (0xFF & (delta << 4 | len));
-        if (delta == 13)
-        {
-            *p++ = (optdelta - 13);
-            packetSize++;
-        }
-        else if (delta == 14)
-        {
-            *p++ = ((optdelta - 269) >> 8);
-            *p++ = (0xFF & (optdelta - 269));
-            packetSize += 2;
-        }
-        if (len == 13)
-        {
-            *p++ = (packet.options[i].length - 13);
-            packetSize++;
-        }
-        else if (len == 14)
-        {
-            *p++ = (packet.options[i].length >> 8);
-            *p++ = (0xFF & (packet.options[i].length - 269));
-            packetSize += 2;
-        }
-
-        memcpy(p, packet.options[i].buffer, packet.options[i].length);
-        p += packet.options[i].length;
-        packetSize += packet.options[i].length + 1;
-        running_delta = packet.options[i].number;
+        out[0] = (uint8_t)value;
+        return 1;
     }
-
-    // make payload
-    if (packet.payloadlen > 0)
+    if (value <= 0xFFFF)
     {
-        if ((packetSize + 1 + packet.payloadlen) >= coap_buf_size)
-        {
-            return 0;
-        }
-        *p++ = 0xFF;
-        memcpy(p, packet.payload, packet.payloadlen);
-        packetSize += 1 + packet.payloadlen;
+        out[0] = (uint8_t)(value >> 8);
+        out[1] = (uint8_t)(value & 0xFF);
+        return 2;
     }
+    out[0] = (uint8_t)((value >> 16) & 0xFF);
+    out[1] = (uint8_t)((value >> 8) & 0xFF);
+    out[2] = (uint8_t)(value & 0xFF);
+    return 3;
+}
 
-    _udp->beginPacket(ip, port);
-    _udp->write(this->tx_buffer, packetSize);
-    _udp->endPacket();
-
-    return packet.messageid;
+bool CoapPacket::getBlock(uint16_t number, uint32_t &num, bool &more, uint8_t &szx, bool bert) const
+{
+    const CoapOption *option = getOption(number);
+    uint32_t v = 0;
+    if (option == NULL || option->length > 3 || !getUintOption(number, v))
+        return false;
+    // SZX 7 is reserved (RFC 7959 section 2.2) except for BERT
+    if ((v & 0x07) == 7 && !bert)
+        return false;
+    num = v >> 4;
+    more = (v & 0x08) != 0;
+    szx = v & 0x07;
+    return true;
 }
 
-uint16_t Coap::get(IPAddress ip, int port, const char *url)
+// FNV-1a
+static const uint32_t FNV_PRIME = 16777619UL;
+
+uint32_t coapHash(uint32_t hash, const uint8_t *data, size_t len)
 {
-    return this->send(ip, port, url, COAP_CON, COAP_GET, NULL, 0, NULL, 0);
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
 }
 
-uint16_t Coap::put(IPAddress ip, int port, const char *url, const char *payload)
+static uint32_t (*random_source)() = NULL;
+
+void coapSetRandom(uint32_t (*source)())
 {
-    return this->send(ip, port, url, COAP_CON, COAP_PUT, NULL, 0, (uint8_t *)payload, strlen(payload));
+    random_source = source;
 }
 
-uint16_t Coap::put(IPAddress ip, int port, const char *url, const char *payload, size_t payloadlen)
+uint32_t coapRandom()
 {
-    return this->send(ip, port, url, COAP_CON, COAP_PUT, NULL, 0, (uint8_t *)payload, payloadlen);
+    if (random_source != NULL)
+        return random_source();
+    uint32_t value = (uint32_t)random(0x10000) << 16 | (uint32_t)random(0x10000);
+    unsigned long now = micros();
+    return coapHash(value, (const uint8_t *)&now, sizeof(now));
 }
 
-uint16_t Coap::send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen)
+// the Uri-Path segments are hashed as if joined by '/'
+uint32_t CoapPacket::uriPathHash() const
 {
-    return this->send(ip, port, url, type, method, token, tokenlen, payload, payloadlen, COAP_NONE);
+    uint32_t hash = COAP_HASH_SEED;
+    bool first = true;
+    for (const CoapOption *option = getOption(COAP_URI_PATH); option != NULL; option = nextOption(option))
+    {
+        if (option->length == 0)
+            continue;
+        if (!first)
+            hash = coapHash(hash, (const uint8_t *)"/", 1);
+        hash = coapHash(hash, option->buffer, option->length);
+        first = false;
+    }
+    return hash;
 }
 
-uint16_t Coap::send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type)
+void *CoapArena::allocate(size_t n)
 {
-    return this->send(ip, port, url, type, method, token, tokenlen, payload, payloadlen, content_type, rand());
+    const size_t align = alignof(uint64_t);
+    size_t start = (used + align - 1) & ~(align - 1);
+    if (start > size || n > size - start)
+        return NULL;
+    used = start + n;
+    if (used > high_water)
+        high_water = used;
+    return base + start;
 }
 
-uint16_t Coap::send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type, uint16_t messageid)
+uint16_t CoapPacket::encode(uint8_t *buffer, int size) const
 {
+    uint8_t *p = buffer;
+    uint16_t packetSize = 0;
 
-    // make packet
-    CoapPacket packet;
+    if (buffer == NULL || COAP_HEADER_SIZE + tokenlen >= size)
+        return 0;
 
-    packet.type = type;
-    packet.code = method;
-    packet.token = token;
-    packet.tokenlen = tokenlen;
-    packet.payload = payload;
-    packet.payloadlen = payloadlen;
-    packet.optionnum = 0;
-    packet.messageid = messageid;
+    // make coap packet base header
+    *p = 0x01 << 6;
+    *p |= (type & 0x03) << 4;
+    *p++ |= (tokenlen & 0x0F);
+    *p++ = code;
+    *p++ = (messageid >> 8);
+    *p++ = (messageid & 0xFF);
+    p = buffer + COAP_HEADER_SIZE;
+    packetSize += 4;
 
-    // use URI_HOST UIR_PATH
-    char ipaddress[16] = "";
-    sprintf(ipaddress, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-    packet.addOption(COAP_URI_HOST, strlen(ipaddress), (uint8_t *)ipaddress);
+    // make token
+    if (token != NULL && tokenlen <= 0x0F)
+    {
+        memcpy(p, token, tokenlen);
+        p += tokenlen;
+        packetSize += tokenlen;
+    }
 
-    /*
-        Add Query Support
-        Author: @YelloooBlue
-    */
+    return encodeOptions(buffer, size, packetSize, 0);
+}
 
-    // parse url
-    size_t idx = 0;
-    bool hasQuery = false;
-    for (size_t i = 0; i < strlen(url); i++)
+uint16_t CoapPacket::encodeOptions(uint8_t *buffer, int size, uint16_t packetSize, uint16_t running_delta) const
+{
+    uint8_t *p = buffer + packetSize;
+
+    // make option header
+    for (int i = 0; i < optionnum; i++)
     {
-        // The reserved characters "/"  "?"  "&"
-        if (url[i] == '/')
+        uint32_t optdelta;
+        uint8_t len, delta;
+
+        if (packetSize + 5 + options[i].length >= size)
         {
-            packet.addOption(COAP_URI_PATH, i - idx, (uint8_t *)(url + idx)); // one URI_PATH (terminated by '/')
-            idx = i + 1;
+            return 0;
         }
-        else if (url[i] == '?' && !hasQuery)
+        optdelta = options[i].number - running_delta;
+        COAP_OPTION_DELTA(optdelta, &delta);
+        COAP_OPTION_DELTA((uint32_t)options[i].length, &len);
+
+        *p++ = (0xFF & (delta << 4 | len));
+        if (delta == 13)
         {
-            packet.addOption(COAP_URI_PATH, i - idx, (uint8_t *)(url + idx)); // the last URI_PATH (between / and ?)
-            hasQuery = true;                                                  // now start to parse the query
-            idx = i + 1;
+            *p++ = (optdelta - 13);
+            packetSize++;
         }
-        else if (url[i] == '&' && hasQuery)
+        else if (delta == 14)
         {
-            packet.addOption(COAP_URI_QUERY, i - idx, (uint8_t *)(url + idx)); // one URI_QUERY (terminated by '&')
-            idx = i + 1;
+            *p++ = ((optdelta - 269) >> 8);
+            *p++ = (0xFF & (optdelta - 269));
+            packetSize += 2;
         }
-    }
-
-    if (idx <= strlen(url))
-    {
-        if (hasQuery)
+        if (len == 13)
         {
-            packet.addOption(COAP_URI_QUERY, strlen(url) - idx, (uint8_t *)(url + idx)); // the last URI_QUERY (between &/? and the end)
+            *p++ = (options[i].length - 13);
+            packetSize++;
         }
-        else
+        else if (len == 14)
         {
-            packet.addOption(COAP_URI_PATH, strlen(url) - idx, (uint8_t *)(url + idx)); // the last URI_PATH (between / and the end)
+            *p++ = ((options[i].length - 269) >> 8);
+            *p++ = (0xFF & (options[i].length - 269));
+            packetSize += 2;
         }
-    }
-
-    /*
-        Adding query support ends
-        Date: 2024.03.03
-    */
 
-    // if Content-Format option
-    uint8_t optionBuffer[2]{0};
-    if (content_type != COAP_NONE)
-    {
-        optionBuffer[0] = ((uint16_t)content_type & 0xFF00) >> 8;
-        optionBuffer[1] = ((uint16_t)content_type & 0x00FF);
-        packet.addOption(COAP_CONTENT_FORMAT, 2, optionBuffer);
+        memcpy(p, options[i].buffer, options[i].length);
+        p += options[i].length;
+        packetSize += options[i].length + 1;
+        running_delta = options[i].number;
     }
 
-    // send packet
-    return this->sendPacket(packet, ip, port);
+    return packetSize;
 }
 
-int Coap::parseOption(CoapOption *option, uint16_t *running_delta, uint8_t **buf, size_t buflen)
+int CoapPacket::parseOption(CoapOption *option, uint16_t *running_delta, uint8_t **buf, size_t buflen)
 {
     uint8_t *p = *buf;
     uint8_t headlen = 1;
@@ -327,6 +389,8 @@ int Coap::parseOption(CoapOption *option, uint16_t *running_delta, uint8_t **buf
 
     if ((p + 1 + len) > (*buf + buflen))
         return -1;
+    if ((uint32_t)delta + *running_delta > 0xFFFF)
+        return -1;
     option->number = delta + *running_delta;
     option->buffer = p + 1;
     option->length = len;
@@ -336,201 +400,537 @@ int Coap::parseOption(CoapOption *option, uint16_t *running_delta, uint8_t **buf
     return 0;
 }
 
-bool Coap::loop()
+int CoapPacket::parseOptions(uint8_t *p, uint8_t *end)
 {
-    int32_t packetlen = _udp->parsePacket();
+    int result = 0;
+    uint16_t delta = 0;
+    CoapOption skipped;
 
-    while (packetlen > 0)
+    optionnum = 0;
+    option_present = 0;
+    while (p < end && *p != COAP_PAYLOAD_MARKER)
     {
-        packetlen = _udp->read(this->rx_buffer, packetlen >= coap_buf_size ? coap_buf_size : packetlen);
-
-        CoapPacket packet;
-
-        // parse coap packet header
-        if (packetlen < COAP_HEADER_SIZE || (((this->rx_buffer[0] & 0xC0) >> 6) != 1))
+        // options that do not fit are still decoded to reach the payload
+        CoapOption *option = optionnum < COAP_MAX_OPTION_NUM ? &options[optionnum] : &skipped;
+        if (CoapPacket::parseOption(option, &delta, &p, end - p) != 0)
+            return -1;
+        if (option == &skipped)
         {
-            packetlen = _udp->parsePacket();
+            // odd option numbers are critical (RFC 7252 section 5.4.1)
+            if (skipped.number & 1)
+                result = 1;
             continue;
         }
+        // options arrive ordered by number, so the first one seen is kept
+        indexOption(optionnum);
+        optionnum++;
+    }
 
-        packet.type = (this->rx_buffer[0] & 0x30) >> 4;
-        packet.tokenlen = this->rx_buffer[0] & 0x0F;
-        packet.code = this->rx_buffer[1];
-        packet.messageid = 0xFF00 & (this->rx_buffer[2] << 8);
-        packet.messageid |= 0x00FF & this->rx_buffer[3];
+    if (p < end)
+    {
+        payload = p + 1;
+        payloadlen = end - (p + 1);
+    }
+    else
+    {
+        payload = NULL;
+        payloadlen = 0;
+    }
+    return result;
+}
 
-        if (packet.tokenlen == 0)
-            packet.token = NULL;
-        else if (packet.tokenlen <= 8)
-            packet.token = this->rx_buffer + 4;
-        else
+void CoapPacket::addUriOptions(const char *url)
+{
+    /*
+        Add Query Support
+        Author: @YelloooBlue
+    */
+
+    // parse url
+    size_t idx = 0;
+    bool hasQuery = false;
+    for (size_t i = 0; i < strlen(url); i++)
+    {
+        // The reserved characters "/"  "?"  "&"
+        if (url[i] == '/')
         {
-            packetlen = _udp->parsePacket();
-            continue;
+            addOption(COAP_URI_PATH, i - idx, (uint8_t *)(url + idx)); // one URI_PATH (terminated by '/')
+            idx = i + 1;
         }
-
-        // parse packet options/payload
-        if (COAP_HEADER_SIZE + packet.tokenlen < packetlen)
+        else if (url[i] == '?' && !hasQuery)
         {
-            int optionIndex = 0;
-            uint16_t delta = 0;
-            uint8_t *end = this->rx_buffer + packetlen;
-            uint8_t *p = this->rx_buffer + COAP_HEADER_SIZE + packet.tokenlen;
-            while (optionIndex < COAP_MAX_OPTION_NUM && p < end && *p != 0xFF)
-            {
-                // packet.options[optionIndex];
-                if (0 != parseOption(&packet.options[optionIndex], &delta, &p, end - p))
-                    return false;
-                optionIndex++;
-            }
-            packet.optionnum = optionIndex;
-            if (p < end && *p == 0xFF)
-            {
-                packet.payload = p + 1;
-                packet.payloadlen = end - (p + 1);
-            }
-            else
-            {
-                packet.payload = NULL;
-                packet.payloadlen = 0;
-            }
+            addOption(COAP_URI_PATH, i - idx, (uint8_t *)(url + idx)); // the last URI_PATH (between / and ?)
+            hasQuery = true;                                                  // now start to parse the query
+            idx = i + 1;
+        }
+        else if (url[i] == '&' && hasQuery)
+        {
+            addOption(COAP_URI_QUERY, i - idx, (uint8_t *)(url + idx)); // one URI_QUERY (terminated by '&')
+            idx = i + 1;
         }
+    }
 
-        if (packet.type == COAP_ACK)
+    if (idx <= strlen(url))
+    {
+        if (hasQuery)
         {
-            // call response function
-            resp(packet, _udp->remoteIP(), _udp->remotePort());
+            addOption(COAP_URI_QUERY, strlen(url) - idx, (uint8_t *)(url + idx)); // the last URI_QUERY (between &/? and the end)
         }
         else
         {
+            addOption(COAP_URI_PATH, strlen(url) - idx, (uint8_t *)(url + idx)); // the last URI_PATH (between / and the end)
+        }
+    }
 
-            String url = "";
-            // call endpoint url function
-            for (int i = 0; i < packet.optionnum; i++)
+    /*
+        Adding query support ends
+        Date: 2024.03.03
+    */
+}
+
+uint16_t coapMessageIdHash(IPAddress ip, int port, uint16_t messageid)
+{
+    uint32_t key = ((uint32_t)ip[0] << 24 | (uint32_t)ip[1] << 16 | (uint32_t)ip[2] << 8 | ip[3]);
+    key ^= ((uint32_t)(uint16_t)port << 16) | messageid;
+    key *= 2654435761UL; // Knuth multiplicative hash
+    return (uint16_t)(key >> 16);
+}
+
+bool coapTokenEquals(const uint8_t *a, uint8_t alen, const uint8_t *b, uint8_t blen)
+{
+    if (alen != blen)
+        return false;
+    if (alen == 0)
+        return true;
+    if (a == NULL || b == NULL)
+        return false;
+    return memcmp(a, b, alen) == 0;
+}
+
+uint32_t coapTokenHash(IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen)
+{
+    uint8_t key[6] = {ip[0], ip[1], ip[2], ip[3], (uint8_t)(port >> 8), (uint8_t)port};
+    uint32_t hash = coapHash(COAP_HASH_SEED, key, sizeof(key));
+    return coapHash(hash, token, tokenlen);
+}
+
+// Builds the url of a proxy target, which must survive addUriOptions().
+struct ProxyUrl
+{
+    char *url;
+    size_t size;
+    size_t len = 0;
+    bool ok = true;
+
+    ProxyUrl(char *url, size_t size) : url(url), size(size) {}
+
+    void put(char c)
+    {
+        if (len + 1 < size)
+            url[len++] = c;
+        else
+            ok = false;
+    }
+
+    // a byte of a path segment or query argument, not a delimiter
+    void text(char c)
+    {
+        if (c == '/' || c == '?' || c == '&' || c == '\0')
+            ok = false;
+        put(c);
+    }
+};
+
+static bool isCoapScheme(const char *scheme, size_t len)
+{
+    static const char coap[] = "coap";
+    if (len != sizeof(coap) - 1)
+        return false;
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((scheme[i] | 0x20) != coap[i])
+            return false;
+    }
+    return true;
+}
+
+static bool parseIPv4(const char *text, size_t len, IPAddress &ip)
+{
+    uint8_t bytes[4];
+    uint8_t part = 0;
+    uint16_t value = 0;
+    uint8_t digits = 0;
+    for (size_t i = 0; i <= len; i++)
+    {
+        if (i == len || text[i] == '.')
+        {
+            if (digits == 0 || part == 4)
+                return false;
+            bytes[part++] = (uint8_t)value;
+            value = 0;
+            digits = 0;
+        }
+        else if (text[i] >= '0' && text[i] <= '9' && digits < 3)
+        {
+            value = value * 10 + (text[i] - '0');
+            digits++;
+            if (value > 255)
+                return false;
+        }
+        else
+            return false;
+    }
+    if (part != 4)
+        return false;
+    ip = IPAddress(bytes[0], bytes[1], bytes[2], bytes[3]);
+    return true;
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+int coapProxyTarget(const CoapPacket &request, IPAddress &ip, uint16_t &port, char *url, size_t size)
+{
+    ProxyUrl out(url, size);
+    const char *text;
+    uint16_t len;
+    uint32_t value;
+    port = COAP_DEFAULT_PORT;
+
+    if (request.getStringOption(COAP_PROXY_URI, text, len))
+    {
+        // coap://host[:port][/path][?query][#fragment]
+        const char *end = text + len;
+        const char *p = text;
+        while (p < end && *p != ':')
+            p++;
+        if (end - p < 3 || p[1] != '/' || p[2] != '/' || !isCoapScheme(text, p - text))
+            return -1;
+        p += 3;
+        const char *host = p;
+        while (p < end && *p != ':' && *p != '/' && *p != '?' && *p != '#')
+            p++;
+        if (!parseIPv4(host, p - host, ip))
+            return -1;
+        if (p < end && *p == ':')
+        {
+            const char *digits = ++p;
+            value = 0;
+            while (p < end && *p >= '0' && *p <= '9')
             {
-                if (packet.options[i].number == COAP_URI_PATH && packet.options[i].length > 0)
-                {
-                    char urlname[packet.options[i].length + 1];
-                    memcpy(urlname, packet.options[i].buffer, packet.options[i].length);
-                    urlname[packet.options[i].length] = 0;
-                    if (url.length() > 0)
-                        url += "/";
-                    url += (const char *)urlname;
-                }
+                value = value * 10 + (*p++ - '0');
+                if (value > 0xFFFF)
+                    return -1;
             }
+            // an empty port is the default one
+            if (p > digits)
+                port = (uint16_t)value;
+        }
+        if (p < end && *p == '/')
+            p++;
 
-            if (!uri.find(url))
+        bool query = false;
+        for (; p < end && *p != '#'; p++)
+        {
+            char c = *p;
+            if ((c == '?' && !query) || (c == '/' && !query) || (c == '&' && query))
             {
-                sendResponse(_udp->remoteIP(), _udp->remotePort(), packet.messageid, NULL, 0,
-                             COAP_NOT_FOUND, COAP_NONE, NULL, 0);
+                query = query || c == '?';
+                out.put(c);
+                continue;
             }
-            else
+            if (c == '%')
             {
-                uri.find(url)(packet, _udp->remoteIP(), _udp->remotePort());
+                if (end - p < 3 || hexDigit(p[1]) < 0 || hexDigit(p[2]) < 0)
+                    return -1;
+                c = (char)(hexDigit(p[1]) << 4 | hexDigit(p[2]));
+                p += 2;
             }
+            out.text(c);
         }
-
-        /* this type check did not use.
-        if (packet.type == COAP_CON) {
-            // send response
-             sendResponse(_udp->remoteIP(), _udp->remotePort(), packet.messageid);
+    }
+    else if (request.getStringOption(COAP_PROXY_SCHEME, text, len))
+    {
+        if (!isCoapScheme(text, len) || !request.getStringOption(COAP_URI_HOST, text, len) || !parseIPv4(text, len, ip))
+            return -1;
+        if (request.getUintOption(COAP_URI_PORT, value))
+        {
+            if (value > 0xFFFF)
+                return -1;
+            port = (uint16_t)value;
         }
-         */
 
-        // next packet
-        packetlen = _udp->parsePacket();
+        char separator = 0;
+        for (const CoapOption *o = request.getOption(COAP_URI_PATH); o != NULL; o = request.nextOption(o))
+        {
+            if (separator)
+                out.put(separator);
+            separator = '/';
+            for (uint16_t i = 0; i < o->length; i++)
+                out.text(o->buffer[i]);
+        }
+        separator = '?';
+        for (const CoapOption *o = request.getOption(COAP_URI_QUERY); o != NULL; o = request.nextOption(o))
+        {
+            out.put(separator);
+            separator = '&';
+            for (uint16_t i = 0; i < o->length; i++)
+                out.text(o->buffer[i]);
+        }
     }
+    else
+        return -1;
 
-    return true;
+    if (!out.ok)
+        return -1;
+    url[out.len] = '\0';
+    return (int)out.len;
 }
 
-uint16_t Coap::sendResponse(IPAddress ip, int port, uint16_t messageid)
+CoapResponseWriter::CoapResponseWriter(uint8_t *buffer, size_t size, uint8_t type, uint8_t code, uint16_t messageid,
+                                       const uint8_t *token, uint8_t tokenlen, IPAddress ip, int port, Sender sender, void *owner)
+    : buffer(buffer), size(size), ip(ip), port((uint16_t)port), sender(sender), owner(owner)
 {
-    return this->sendResponse(ip, port, messageid, NULL, 0, COAP_CONTENT, COAP_TEXT_PLAIN, NULL, 0);
+    if (buffer == NULL || tokenlen > 8 || size < (size_t)COAP_HEADER_SIZE + tokenlen)
+    {
+        fail();
+        return;
+    }
+    buffer[0] = 0x40 | (type & 0x03) << 4 | tokenlen;
+    buffer[1] = code;
+    buffer[2] = messageid >> 8;
+    buffer[3] = messageid & 0xFF;
+    if (tokenlen > 0)
+        memcpy(buffer + COAP_HEADER_SIZE, token, tokenlen);
+    len = COAP_HEADER_SIZE + tokenlen;
 }
 
-uint16_t Coap::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload)
+// Delta and length nibble of an option header and its extended bytes.
+static uint8_t optionNibble(uint16_t value, uint8_t *ext, uint8_t &extlen)
 {
-    return this->sendResponse(ip, port, messageid, payload, strlen(payload), COAP_CONTENT, COAP_TEXT_PLAIN, NULL, 0);
+    if (value < 13)
+        return (uint8_t)value;
+    if (value < 269)
+    {
+        ext[extlen++] = (uint8_t)(value - 13);
+        return 13;
+    }
+    ext[extlen++] = (uint8_t)((value - 269) >> 8);
+    ext[extlen++] = (uint8_t)(value - 269);
+    return 14;
 }
 
-uint16_t Coap::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen)
+CoapResponseWriter &CoapResponseWriter::option(uint16_t number, const uint8_t *value, uint16_t length)
 {
-    return this->sendResponse(ip, port, messageid, payload, payloadlen, COAP_CONTENT, COAP_TEXT_PLAIN, NULL, 0);
+    if (buffer == NULL || payload_start != 0 || number < last_option)
+        return fail();
+
+    uint8_t ext[4];
+    uint8_t extlen = 0;
+    uint8_t delta = optionNibble(number - last_option, ext, extlen);
+    uint8_t lengthNibble = optionNibble(length, ext, extlen);
+    if (len + 1 + extlen + length > size)
+        return fail();
+
+    buffer[len++] = delta << 4 | lengthNibble;
+    memcpy(buffer + len, ext, extlen);
+    len += extlen;
+    if (length > 0)
+        memcpy(buffer + len, value, length);
+    len += length;
+    last_option = number;
+    return *this;
 }
 
-uint16_t Coap::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen,
-                            COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type, const uint8_t *token, int tokenlen)
+CoapResponseWriter &CoapResponseWriter::uintOption(uint16_t number, uint32_t value)
 {
-    // make packet
-    CoapPacket packet;
+    uint8_t bytes[4];
+    uint8_t n = 0;
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        if (n > 0 || (value >> shift) != 0)
+            bytes[n++] = (uint8_t)(value >> shift);
+    }
+    return option(number, bytes, n);
+}
 
-    packet.type = COAP_ACK;
-    packet.code = code;
-    packet.token = token;
-    packet.tokenlen = tokenlen;
-    packet.payload = (uint8_t *)payload;
-    packet.payloadlen = payloadlen;
-    packet.optionnum = 0;
-    packet.messageid = messageid;
+CoapResponseWriter &CoapResponseWriter::contentFormat(COAP_CONTENT_TYPE type)
+{
+    if (type == COAP_NONE)
+        return *this;
+    return uintOption(COAP_CONTENT_FORMAT, (uint16_t)type);
+}
+
+CoapResponseWriter &CoapResponseWriter::block1(const CoapPacket &request)
+{
+    uint32_t num = 0;
+    bool more = false;
+    uint8_t szx = 0;
+    if (!request.getBlock(COAP_BLOCK1, num, more, szx, true))
+        return *this;
+    return uintOption(COAP_BLOCK1, num << 4 | szx);
+}
 
-    // if more options?
-    uint8_t optionBuffer[2] = {0};
-    optionBuffer[0] = ((uint16_t)type & 0xFF00) >> 8;
-    optionBuffer[1] = ((uint16_t)type & 0x00FF);
-    packet.addOption(COAP_CONTENT_FORMAT, 2, optionBuffer);
+// Makes room for n payload bytes, after the payload marker.
+bool CoapResponseWriter::payload(size_t n)
+{
+    if (buffer == NULL)
+        return false;
+    if (payload_start == 0)
+    {
+        if (len + 1 > size)
+        {
+            fail();
+            return false;
+        }
+        buffer[len++] = COAP_PAYLOAD_MARKER;
+        payload_start = len;
+    }
+    if (len + n > size)
+    {
+        fail();
+        return false;
+    }
+    return true;
+}
 
-    return this->sendPacket(packet, ip, port);
+size_t CoapResponseWriter::write(const uint8_t *data, size_t n)
+{
+    if (!payload(n))
+        return 0;
+    memcpy(buffer + len, data, n);
+    len += n;
+    return n;
 }
 
-static uint8_t encodeUintOption(uint32_t value, uint8_t out[3])
+size_t CoapResponseWriter::printf(const char *format, ...)
 {
-    if (value == 0)
+    if (!payload(0))
+        return 0;
+    va_list args;
+    va_start(args, format);
+    // vsnprintf also writes a NUL, which the next byte overwrites
+    int n = vsnprintf((char *)buffer + len, size - len, format, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= size - len)
     {
-        // CoAP uint option encoding uses a zero-length option for value 0.
+        fail();
         return 0;
     }
-    if (value <= 0xFF)
+    len += n;
+    return n;
+}
+
+uint8_t *CoapResponseWriter::reserve(size_t &room)
+{
+    if (!payload(0))
     {
-        out[0] = (uint8_t)value;
-        return 1;
+        room = 0;
+        return NULL;
     }
-    if (value <= 0xFFFF)
+    room = size - len;
+    return buffer + len;
+}
+
+void CoapResponseWriter::commit(size_t n)
+{
+    if (payload(n))
+        len += n;
+}
+
+CoapResponseWriter &CoapResponseWriter::cborHead(uint8_t major, uint32_t value)
+{
+    uint8_t head[5];
+    uint8_t n = 1;
+    if (value < 24)
+        head[0] = major << 5 | value;
+    else if (value <= 0xFF)
     {
-        out[0] = (uint8_t)(value >> 8);
-        out[1] = (uint8_t)(value & 0xFF);
-        return 2;
+        head[0] = major << 5 | 24;
+        head[n++] = value;
     }
-    out[0] = (uint8_t)((value >> 16) & 0xFF);
-    out[1] = (uint8_t)((value >> 8) & 0xFF);
-    out[2] = (uint8_t)(value & 0xFF);
-    return 3;
+    else if (value <= 0xFFFF)
+    {
+        head[0] = major << 5 | 25;
+        head[n++] = value >> 8;
+        head[n++] = value;
+    }
+    else
+    {
+        head[0] = major << 5 | 26;
+        for (int shift = 24; shift >= 0; shift -= 8)
+            head[n++] = value >> shift;
+    }
+    write(head, n);
+    return *this;
 }
 
-uint16_t Coap::sendObserveResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen,
-                                   COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type, const uint8_t *token, int tokenlen, uint32_t observe_seq)
+CoapResponseWriter &CoapResponseWriter::cborInt(int32_t value)
 {
-    CoapPacket packet;
+    // a negative integer n is encoded as -1 - n
+    if (value < 0)
+        return cborHead(1, (uint32_t)(-1 - value));
+    return cborHead(0, (uint32_t)value);
+}
 
-    packet.type = COAP_ACK;
-    packet.code = code;
-    packet.token = token;
-    packet.tokenlen = tokenlen;
-    packet.payload = (uint8_t *)payload;
-    packet.payloadlen = payloadlen;
-    packet.optionnum = 0;
-    packet.messageid = messageid;
+CoapResponseWriter &CoapResponseWriter::cborText(const char *text)
+{
+    size_t n = strlen(text);
+    cborHead(3, n);
+    write((const uint8_t *)text, n);
+    return *this;
+}
 
-    uint8_t observeBuf[3] = {0};
-    uint8_t observeLen = encodeUintOption(observe_seq, observeBuf);
-    packet.addOption(COAP_OBSERVE, observeLen, observeBuf);
+CoapResponseWriter &CoapResponseWriter::cborBytes(const uint8_t *data, size_t n)
+{
+    cborHead(2, n);
+    write(data, n);
+    return *this;
+}
 
-    uint8_t optionBuffer[2] = {0};
-    optionBuffer[0] = ((uint16_t)type & 0xFF00) >> 8;
-    optionBuffer[1] = ((uint16_t)type & 0x00FF);
-    packet.addOption(COAP_CONTENT_FORMAT, 2, optionBuffer);
+CoapResponseWriter &CoapResponseWriter::cborFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint8_t item[5] = {0xFA, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits};
+    write(item, sizeof(item));
+    return *this;
+}
 
-    return this->sendPacket(packet, ip, port);
+CoapResponseWriter &CoapResponseWriter::cborBool(bool value)
+{
+    write(value ? 0xF5 : 0xF4);
+    return *this;
+}
+
+CoapResponseWriter &CoapResponseWriter::cborNull()
+{
+    write(0xF6);
+    return *this;
+}
+
+size_t CoapResponseWriter::length() const
+{
+    if (buffer == NULL)
+        return 0;
+    // a payload marker must not be followed by an empty payload
+    return len == payload_start ? len - 1 : len;
+}
+
+uint16_t CoapResponseWriter::send()
+{
+    if (buffer == NULL || sender == NULL)
+        return 0;
+    uint16_t messageid = sender(owner, *this);
+    sender = NULL;
+    return messageid;
 }
 
 Observer::Observer(IPAddress ip, int port, const uint8_t *token, int token_len)
@@ -542,157 +942,267 @@ Observer::Observer(IPAddress ip, int port, const uint8_t *token, int token_len)
         memcpy(this->token, token, this->token_len);
 }
 
-uint16_t Coap::notify(Observer *observer, const char *payload, int payload_len, COAP_CONTENT_TYPE type)
-{
-    CoapPacket packet;
+static const char *const stat_names[COAP_STAT_COUNT] = {
+    "rx", "rx_malformed", "rx_too_large", "rx_bad_option", "duplicates",
+    "requests", "not_found", "unavailable", "tx", "tx_failed",
+    "retransmits", "tx_timeouts", "request_timeouts", "observers_expired",
+    "proxy_hits", "proxy_forwarded", "proxy_revalidated", "tx_queued", "tx_unreliable"};
 
-    packet.type = COAP_NONCON; // Notifications are non-confirmable.
-    packet.code = COAP_CONTENT;
-    packet.token = observer->token;
-    packet.tokenlen = observer->token_len;
-    packet.payload = (uint8_t *)payload;
-    packet.payloadlen = payload_len;
-    packet.optionnum = 0;
-    uint32_t observe_seq = ++observer->counter;
-    packet.messageid = rand();
+static const char *const timing_names[COAP_TIMING_COUNT] = {
+    "parse_us", "dispatch_us", "handler_us", "send_us"};
 
-    uint8_t observeBuf[3] = {0};
-    uint8_t observeLen = encodeUintOption(observe_seq, observeBuf);
-    packet.addOption(COAP_OBSERVE, observeLen, observeBuf);
+// Writes the bytes of a CBOR document that fall into a window of it.
+struct CborWindow
+{
+    uint8_t *out;
+    uint32_t start;
+    size_t len;
+    uint32_t pos;
 
-    uint8_t optionBuffer[2] = {0};
-    optionBuffer[0] = ((uint16_t)type & 0xFF00) >> 8;
-    optionBuffer[1] = ((uint16_t)type & 0x00FF);
-    packet.addOption(COAP_CONTENT_FORMAT, 2, optionBuffer);
+    void put(uint8_t b)
+    {
+        if (pos >= start && pos - start < len)
+            out[pos - start] = b;
+        pos++;
+    }
+    // major type and a length below 24 or 256
+    void head(uint8_t major, uint8_t value)
+    {
+        if (value < 24)
+            put(major << 5 | value);
+        else
+        {
+            put(major << 5 | 24);
+            put(value);
+        }
+    }
+    void text(const char *s)
+    {
+        size_t n = strlen(s);
+        head(3, n);
+        for (size_t i = 0; i < n; i++)
+            put(s[i]);
+    }
+    // always 4 bytes, so the document size does not depend on the values
+    void uint32(uint32_t value)
+    {
+        put(0x1A);
+        put(value >> 24);
+        put(value >> 16);
+        put(value >> 8);
+        put(value);
+    }
+};
 
-    return this->sendPacket(packet, observer->ip, observer->port);
+size_t CoapStats::encode(uint32_t offset, uint8_t *buffer, size_t len) const
+{
+    CborWindow w = {buffer, offset, buffer != NULL ? len : 0, 0};
+    w.head(5, (uint32_t)COAP_STAT_COUNT + COAP_TIMING_COUNT);
+    for (int i = 0; i < COAP_STAT_COUNT; i++)
+    {
+        w.text(stat_names[i]);
+        w.uint32(counters[i]);
+    }
+    for (int i = 0; i < COAP_TIMING_COUNT; i++)
+    {
+        w.text(timing_names[i]);
+        w.head(4, COAP_STATS_BUCKETS);
+        for (int b = 0; b < COAP_STATS_BUCKETS; b++)
+            w.uint32(timings[i].buckets[b]);
+    }
+    return w.pos;
 }
 
-static bool urlEquals(const char *a, const char *b)
+size_t CoapStats::read(uint32_t offset, uint8_t *buffer, size_t len) const
 {
-    if (a == NULL || b == NULL)
-        return false;
-    return strcmp(a, b) == 0;
+    size_t total = encode(offset, buffer, len);
+    if (offset >= total)
+        return 0;
+    return total - offset < len ? total - offset : len;
 }
 
-static bool tokenEquals(const uint8_t *a, uint8_t alen, const uint8_t *b, uint8_t blen)
+// Uri-Path of .well-known/name
+static bool isWellKnownPath(const CoapPacket &packet, const char *name)
 {
-    if (alen != blen)
-        return false;
-    if (alen == 0)
-        return true;
-    if (a == NULL || b == NULL)
-        return false;
-    return memcmp(a, b, alen) == 0;
+    const char *const segments[] = {".well-known", name};
+    const CoapOption *option = packet.getOption(COAP_URI_PATH);
+    for (const char *segment : segments)
+    {
+        if (option == NULL || option->length != strlen(segment) || memcmp(option->buffer, segment, option->length) != 0)
+            return false;
+        option = packet.nextOption(option);
+    }
+    return option == NULL;
 }
 
-bool Coap::addObserver(const char *url, IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen)
+bool CoapStats::isStatsPath(const CoapPacket &packet)
 {
-    if (url == NULL)
-        return false;
-    if (strlen(url) >= COAP_MAX_OBSERVE_URL_LEN)
-        return false;
-    if (tokenlen > 8)
-        return false;
+    return isWellKnownPath(packet, "stats");
+}
 
-    unsigned long now = millis();
+void CoapTrace::tick(unsigned long now_us)
+{
+    if ((uint32_t)now_us < clock_last)
+        clock_hi++;
+    clock_last = now_us;
+}
 
-    for (int i = 0; i < COAP_MAX_OBSERVERS; i++)
+void CoapTrace::record(COAP_TRACE_DIRECTION direction, IPAddress ip, uint16_t port, unsigned long now_us,
+                       const uint8_t *message, size_t len, const uint8_t *tail, size_t taillen)
+{
+    if (held)
     {
-        if (!observers[i].in_use)
-            continue;
-        if (observers[i].ip == ip && observers[i].port == (uint16_t)port && urlEquals(observers[i].url, url) && tokenEquals(observers[i].token, observers[i].tokenlen, token, tokenlen))
+        if ((int32_t)((uint32_t)now_us - held_until_us) < 0)
         {
-            observers[i].last_seen_ms = now;
-            return true;
+            missed++;
+            return;
         }
+        held = false;
     }
+    tick(now_us);
+
+    CoapTraceRecord &r = records[head];
+    r.time_hi = clock_hi;
+    r.time_lo = now_us;
+    r.ip = ip;
+    r.port = port;
+    r.len = len + taillen;
+    r.direction = direction;
+    size_t n = len < COAP_TRACE_SNAPLEN ? len : COAP_TRACE_SNAPLEN;
+    memcpy(r.data, message, n);
+    size_t m = taillen < COAP_TRACE_SNAPLEN - n ? taillen : COAP_TRACE_SNAPLEN - n;
+    if (m > 0)
+        memcpy(r.data + n, tail, m);
+    r.caplen = n + m;
+
+    head = head + 1 == COAP_TRACE_ENTRIES ? 0 : head + 1;
+    recorded++;
+}
 
-    for (int i = 0; i < COAP_MAX_OBSERVERS; i++)
+void CoapTrace::reset()
+{
+    recorded = 0;
+    missed = 0;
+    head = 0;
+    held = false;
+}
+
+// The pcap headers are written little-endian, the packets in network order.
+struct PcapWindow
+{
+    uint8_t *out;
+    uint32_t start;
+    size_t len;
+    uint32_t pos;
+
+    void bytes(const uint8_t *data, size_t n)
     {
-        if (!observers[i].in_use)
-        {
-            observers[i].in_use = true;
-            observers[i].ip = ip;
-            observers[i].port = (uint16_t)port;
-            observers[i].tokenlen = tokenlen;
-            if (tokenlen > 0 && token != NULL)
-                memcpy(observers[i].token, token, tokenlen);
-            observers[i].observe_seq = 0;
-            observers[i].last_seen_ms = now;
-            strncpy(observers[i].url, url, COAP_MAX_OBSERVE_URL_LEN - 1);
-            observers[i].url[COAP_MAX_OBSERVE_URL_LEN - 1] = 0;
-            return true;
-        }
+        for (size_t i = 0; i < n; i++, pos++)
+            if (pos >= start && pos - start < len)
+                out[pos - start] = data[i];
+    }
+    void le16(uint16_t value)
+    {
+        uint8_t b[2] = {(uint8_t)value, (uint8_t)(value >> 8)};
+        bytes(b, sizeof(b));
     }
+    void le32(uint32_t value)
+    {
+        uint8_t b[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+        bytes(b, sizeof(b));
+    }
+};
 
-    return false;
-}
+static const uint32_t PCAP_MAGIC_US = 0xA1B2C3D4;
+static const uint32_t PCAP_LINKTYPE_IPV4 = 228;
+static const uint8_t TRACE_IP_UDP_SIZE = 28;
 
-bool Coap::removeObserver(const char *url, IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen)
+// IPv4 and UDP header of a traced message; the UDP checksum is left out.
+static void traceHeader(const CoapTraceRecord &r, uint16_t local_port, uint8_t h[TRACE_IP_UDP_SIZE])
 {
-    if (url == NULL)
-        return false;
-    bool removed = false;
-    for (int i = 0; i < COAP_MAX_OBSERVERS; i++)
+    bool rx = r.direction == COAP_TRACE_RX;
+    IPAddress local;
+    IPAddress src = rx ? r.ip : local;
+    IPAddress dst = rx ? local : r.ip;
+    uint16_t sport = rx ? r.port : local_port;
+    uint16_t dport = rx ? local_port : r.port;
+    uint16_t total = TRACE_IP_UDP_SIZE + r.len;
+
+    memset(h, 0, TRACE_IP_UDP_SIZE);
+    h[0] = 0x45;
+    h[2] = total >> 8;
+    h[3] = total;
+    h[8] = 64;
+    h[9] = 17;
+    for (int i = 0; i < 4; i++)
     {
-        if (!observers[i].in_use)
-            continue;
-        if (observers[i].ip == ip && observers[i].port == (uint16_t)port && urlEquals(observers[i].url, url) && tokenEquals(observers[i].token, observers[i].tokenlen, token, tokenlen))
-        {
-            observers[i].in_use = false;
-            observers[i].tokenlen = 0;
-            observers[i].observe_seq = 0;
-            observers[i].last_seen_ms = 0;
-            observers[i].url[0] = 0;
-            removed = true;
-        }
+        h[12 + i] = src[i];
+        h[16 + i] = dst[i];
     }
-    return removed;
+    uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2)
+        sum += h[i] << 8 | h[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    h[10] = ~sum >> 8;
+    h[11] = ~sum;
+
+    h[20] = sport >> 8;
+    h[21] = sport;
+    h[22] = dport >> 8;
+    h[23] = dport;
+    h[24] = (total - 20) >> 8;
+    h[25] = total - 20;
 }
 
-int Coap::notify(const char *url, const char *payload, int payload_len, COAP_CONTENT_TYPE type)
+size_t CoapTrace::encode(uint32_t offset, uint8_t *buffer, size_t len) const
 {
-    if (url == NULL)
-        return 0;
-    unsigned long now = millis();
-    int sent = 0;
-
-    for (int i = 0; i < COAP_MAX_OBSERVERS; i++)
+    PcapWindow w = {buffer, offset, buffer != NULL ? len : 0, 0};
+    w.le32(PCAP_MAGIC_US);
+    w.le16(2);
+    w.le16(4);
+    w.le32(0);
+    w.le32(0);
+    w.le32(TRACE_IP_UDP_SIZE + COAP_TRACE_SNAPLEN);
+    w.le32(PCAP_LINKTYPE_IPV4);
+
+    uint16_t count = recorded < COAP_TRACE_ENTRIES ? recorded : COAP_TRACE_ENTRIES;
+    uint16_t slot = (head + COAP_TRACE_ENTRIES - count) % COAP_TRACE_ENTRIES;
+    for (uint16_t i = 0; i < count; i++)
     {
-        if (!observers[i].in_use)
-            continue;
-        if (!urlEquals(observers[i].url, url))
-            continue;
+        const CoapTraceRecord &r = records[slot];
+        slot = slot + 1 == COAP_TRACE_ENTRIES ? 0 : slot + 1;
 
-        if (COAP_OBSERVER_LEASE_MS > 0 && (unsigned long)(now - observers[i].last_seen_ms) > COAP_OBSERVER_LEASE_MS)
+        // skipped without formatting when it lies outside the window
+        size_t size = 16 + TRACE_IP_UDP_SIZE + r.caplen;
+        if (buffer == NULL || w.pos + size <= offset || w.pos >= offset + len)
         {
-            observers[i].in_use = false;
+            w.pos += size;
             continue;
         }
 
-        CoapPacket packet;
-        packet.type = COAP_NONCON;
-        packet.code = COAP_CONTENT;
-        packet.token = observers[i].tokenlen ? observers[i].token : NULL;
-        packet.tokenlen = observers[i].tokenlen;
-        packet.payload = (uint8_t *)payload;
-        packet.payloadlen = payload_len;
-        packet.optionnum = 0;
-        packet.messageid = rand();
-
-        uint32_t observe_seq = ++observers[i].observe_seq;
-        uint8_t observeBuf[3] = {0};
-        uint8_t observeLen = encodeUintOption(observe_seq, observeBuf);
-        packet.addOption(COAP_OBSERVE, observeLen, observeBuf);
-
-        uint8_t optionBuffer[2] = {0};
-        optionBuffer[0] = ((uint16_t)type & 0xFF00) >> 8;
-        optionBuffer[1] = ((uint16_t)type & 0x00FF);
-        packet.addOption(COAP_CONTENT_FORMAT, 2, optionBuffer);
-
-        if (this->sendPacket(packet, observers[i].ip, observers[i].port) != 0)
-            sent++;
-    }
-    return sent;
+        uint64_t us = (uint64_t)r.time_hi << 32 | r.time_lo;
+        w.le32(us / 1000000);
+        w.le32(us % 1000000);
+        w.le32(TRACE_IP_UDP_SIZE + r.caplen);
+        w.le32(TRACE_IP_UDP_SIZE + r.len);
+        uint8_t header[TRACE_IP_UDP_SIZE];
+        traceHeader(r, local_port, header);
+        w.bytes(header, sizeof(header));
+        w.bytes(r.data, r.caplen);
+    }
+    return w.pos;
+}
+
+size_t CoapTrace::read(uint32_t offset, uint8_t *buffer, size_t len) const
+{
+    size_t total = encode(offset, buffer, len);
+    if (offset >= total)
+        return 0;
+    return total - offset < len ? total - offset : len;
+}
+
+bool CoapTrace::isTracePath(const CoapPacket &packet)
+{
+    return isWellKnownPath(packet, "trace");
 }
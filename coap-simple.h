@@ -28,6 +28,7 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define __SIMPLE_COAP_H__
 
 #include "Udp.h"
+#include "Client.h"
 #ifndef COAP_MAX_CALLBACK
 #define COAP_MAX_CALLBACK 10
 #endif
@@ -50,8 +51,178 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #ifndef COAP_MAX_OBSERVE_URL_LEN
 #define COAP_MAX_OBSERVE_URL_LEN 32
 #endif
+// Distinct resources that can be observed at the same time.
+#ifndef COAP_MAX_OBSERVE_RESOURCES
+#if defined(__AVR__)
+#define COAP_MAX_OBSERVE_RESOURCES 2
+#else
+#define COAP_MAX_OBSERVE_RESOURCES 4
+#endif
+#endif
+// Notification rate control (RFC 7641 section 4.5.2). Values notified
+// faster than the interval are coalesced and only the latest one is sent.
+// Each observed resource keeps a copy of its latest value for that.
+#ifndef COAP_NOTIFY_COALESCE
+#if defined(__AVR__)
+#define COAP_NOTIFY_COALESCE 0
+#else
+#define COAP_NOTIFY_COALESCE 1
+#endif
+#endif
+#ifndef COAP_NOTIFY_INTERVAL_MS
+#define COAP_NOTIFY_INTERVAL_MS 0
+#endif
+// Notifications are NON, with a CON at least this often to check that the
+// observer is still there (RFC 7641 section 4.5).
+#ifndef COAP_NOTIFY_CON_INTERVAL_MS
+#define COAP_NOTIFY_CON_INTERVAL_MS 86400000UL
+#endif
 #define COAP_DEFAULT_PORT 5683
 
+// Confirmable message transmission parameters (RFC 7252 section 4.8).
+#ifndef COAP_ACK_TIMEOUT_MS
+#define COAP_ACK_TIMEOUT_MS 2000UL
+#endif
+#ifndef COAP_ACK_RANDOM_FACTOR_PERCENT
+#define COAP_ACK_RANDOM_FACTOR_PERCENT 150
+#endif
+#ifndef COAP_MAX_RETRANSMIT
+#define COAP_MAX_RETRANSMIT 4
+#endif
+// Outstanding CON messages kept for retransmission. Each entry holds a copy
+// of the datagram, so keep it small on boards with little RAM.
+#ifndef COAP_MAX_TRANSMISSIONS
+#if defined(__AVR__)
+#define COAP_MAX_TRANSMISSIONS 1
+#else
+#define COAP_MAX_TRANSMISSIONS 4
+#endif
+#endif
+#ifndef COAP_EXCHANGE_LIFETIME_MS
+#define COAP_EXCHANGE_LIFETIME_MS 247000UL
+#endif
+// Recently received requests remembered for duplicate detection, each with
+// a copy of the response that was sent for it.
+#ifndef COAP_MAX_DEDUP
+#if defined(__AVR__)
+#define COAP_MAX_DEDUP 1
+#else
+#define COAP_MAX_DEDUP 16
+#endif
+#endif
+// Bytes of each cached response. A longer response is not kept, and the
+// duplicates of its request run the handler again. 0 keeps responses up to
+// the buffer size; AVR keeps only short ones, as the copies sit in its RAM.
+#ifndef COAP_DEDUP_RESPONSE_SIZE
+#if defined(__AVR__)
+#define COAP_DEDUP_RESPONSE_SIZE 32
+#else
+#define COAP_DEDUP_RESPONSE_SIZE 0
+#endif
+#endif
+// Client requests with a completion callback that can be outstanding at once.
+#ifndef COAP_MAX_TRANSACTIONS
+#if defined(__AVR__)
+#define COAP_MAX_TRANSACTIONS 1
+#else
+#define COAP_MAX_TRANSACTIONS 16
+#endif
+#endif
+// How long a request waits for its response, MAX_TRANSMIT_WAIT by default.
+#ifndef COAP_REQUEST_TIMEOUT_MS
+#define COAP_REQUEST_TIMEOUT_MS 93000UL
+#endif
+// Counters and latency histograms per instance, see CoapStats.
+#ifndef COAP_STATS
+#define COAP_STATS 0
+#endif
+// Histogram buckets; bucket i counts times below 2^i microseconds.
+#ifndef COAP_STATS_BUCKETS
+#define COAP_STATS_BUCKETS 16
+#endif
+// Forward proxy for Proxy-Uri requests with a response cache (RFC 7252
+// section 5.7). Each cache entry holds a copy of a response.
+#ifndef COAP_PROXY
+#define COAP_PROXY 0
+#endif
+#ifndef COAP_PROXY_CACHE_ENTRIES
+#define COAP_PROXY_CACHE_ENTRIES 8
+#endif
+// Clients waiting for a response from an origin server.
+#ifndef COAP_PROXY_WAITERS
+#define COAP_PROXY_WAITERS 8
+#endif
+// Longest target "path?query" that is proxied.
+#ifndef COAP_PROXY_MAX_URL_LEN
+#define COAP_PROXY_MAX_URL_LEN 48
+#endif
+
+// Congestion control of CON messages per destination: at most NSTART
+// outstanding, the rest wait in the transmission table, and the RTO adapts
+// to measured round-trip times (RFC 7252 section 4.7, CoCoA). Each peer
+// that can have CON messages outstanding needs an entry. The waiting
+// messages of all peers share COAP_CONGESTION_QUEUE extra entries of the
+// table, on top of COAP_MAX_TRANSMISSIONS.
+#ifndef COAP_CONGESTION
+#define COAP_CONGESTION 0
+#endif
+#ifndef COAP_NSTART
+#define COAP_NSTART 1
+#endif
+#ifndef COAP_CONGESTION_QUEUE
+#if defined(__AVR__)
+#define COAP_CONGESTION_QUEUE 2
+#else
+#define COAP_CONGESTION_QUEUE 32
+#endif
+#endif
+#ifndef COAP_CONGESTION_PEERS
+#define COAP_CONGESTION_PEERS (2 * COAP_MAX_TRANSMISSIONS)
+#endif
+
+// Multicast requests (RFC 7252 section 8). A server reads the groups it
+// joined through their own UDP objects and answers within a random Leisure;
+// each delayed response holds a copy of it. A client collects the responses
+// to a group request until Leisure plus ACK_TIMEOUT have passed.
+#ifndef COAP_MULTICAST
+#define COAP_MULTICAST 0
+#endif
+#ifndef COAP_MULTICAST_GROUPS
+#define COAP_MULTICAST_GROUPS 2
+#endif
+#ifndef COAP_MULTICAST_RESPONSES
+#define COAP_MULTICAST_RESPONSES 2
+#endif
+#ifndef COAP_MULTICAST_LEISURE_MS
+#define COAP_MULTICAST_LEISURE_MS 5000UL
+#endif
+// "All CoAP Nodes" IPv4 group
+#define COAP_MULTICAST_ALL_NODES IPAddress(224, 0, 1, 187)
+
+// CoAP over TCP (RFC 8323) to the peers whose connection is attached; only
+// the frame header of each connection is kept between reads.
+#ifndef COAP_TCP
+#define COAP_TCP 0
+#endif
+#ifndef COAP_TCP_CONNECTIONS
+#define COAP_TCP_CONNECTIONS 4
+#endif
+// Ring of the last messages received and sent, see CoapTrace.
+#ifndef COAP_TRACE
+#define COAP_TRACE 0
+#endif
+#ifndef COAP_TRACE_ENTRIES
+#define COAP_TRACE_ENTRIES 16
+#endif
+// Bytes kept of each message; the rest is cut off, as with tcpdump -s.
+#ifndef COAP_TRACE_SNAPLEN
+#define COAP_TRACE_SNAPLEN 64
+#endif
+// How long the ring stands still for the next block of a dump.
+#ifndef COAP_TRACE_HOLD_MS
+#define COAP_TRACE_HOLD_MS (2 * COAP_ACK_TIMEOUT_MS)
+#endif
+
 #define RESPONSE_CODE(class, detail) ((class << 5) | (detail))
 #define COAP_OPTION_DELTA(v, n) (v < 13 ? (*n = (0xFF & v)) : (v <= 0xFF + 13 ? (*n = 13) : (*n = 14)))
 
@@ -78,6 +249,7 @@ typedef enum
     COAP_VALID = RESPONSE_CODE(2, 3),
     COAP_CHANGED = RESPONSE_CODE(2, 4),
     COAP_CONTENT = RESPONSE_CODE(2, 5),
+    COAP_CONTINUE = RESPONSE_CODE(2, 31),
 
     COAP_BAD_REQUEST = RESPONSE_CODE(4, 0),
     COAP_UNAUTHORIZED = RESPONSE_CODE(4, 1),
@@ -86,6 +258,7 @@ typedef enum
     COAP_NOT_FOUND = RESPONSE_CODE(4, 4),
     COAP_METHOD_NOT_ALLOWED = RESPONSE_CODE(4, 5),
     COAP_NOT_ACCEPTABLE = RESPONSE_CODE(4, 6),
+    COAP_REQUEST_ENTITY_INCOMPLETE = RESPONSE_CODE(4, 8),
     COAP_PRECONDITION_FAILED = RESPONSE_CODE(4, 12),
     COAP_REQUEST_ENTITY_TOO_LARGE = RESPONSE_CODE(4, 13),
     COAP_UNSUPPORTED_CONTENT_FORMAT = RESPONSE_CODE(4, 15),
@@ -98,6 +271,20 @@ typedef enum
     COAP_PROXYING_NOT_SUPPORTED = RESPONSE_CODE(5, 5)
 } COAP_RESPONSE_CODE;
 
+// Signaling codes of CoAP over TCP (RFC 8323 section 5)
+typedef enum
+{
+    COAP_CSM = RESPONSE_CODE(7, 1),
+    COAP_PING = RESPONSE_CODE(7, 2),
+    COAP_PONG = RESPONSE_CODE(7, 3),
+    COAP_RELEASE = RESPONSE_CODE(7, 4),
+    COAP_ABORT = RESPONSE_CODE(7, 5)
+} COAP_SIGNAL_CODE;
+
+// Options of a Capabilities and Settings Message
+#define COAP_CSM_MAX_MESSAGE_SIZE 2
+#define COAP_CSM_BLOCK_WISE_TRANSFER 4
+
 typedef enum
 {
     COAP_IF_MATCH = 1,
@@ -113,8 +300,12 @@ typedef enum
     COAP_URI_QUERY = 15,
     COAP_ACCEPT = 17,
     COAP_LOCATION_QUERY = 20,
+    COAP_BLOCK2 = 23,
+    COAP_BLOCK1 = 27,
+    COAP_SIZE2 = 28,
     COAP_PROXY_URI = 35,
-    COAP_PROXY_SCHEME = 39
+    COAP_PROXY_SCHEME = 39,
+    COAP_SIZE1 = 60
 } COAP_OPTION_NUMBER;
 
 typedef enum
@@ -132,11 +323,14 @@ typedef enum
 class CoapOption
 {
 public:
-    uint8_t number;
-    uint8_t length;
+    uint16_t number;
+    uint16_t length;
     uint8_t *buffer;
 };
 
+// Option numbers of COAP_OPTION_NUMBER that CoapPacket indexes.
+#define COAP_INDEXED_OPTIONS 19
+
 class CoapPacket
 {
 public:
@@ -150,72 +344,520 @@ public:
     uint8_t optionnum = 0;
     CoapOption options[COAP_MAX_OPTION_NUM];
 
-    void addOption(uint8_t number, uint8_t length, uint8_t *opt_payload);
+    /**
+     * @brief Adds an option, keeping options[] ordered by number.
+     *
+     * Options beyond COAP_MAX_OPTION_NUM are ignored. Setting optionnum to 0
+     * removes all options.
+     */
+    void addOption(uint16_t number, uint16_t length, uint8_t *opt_payload);
+
+    /**
+     * @brief Looks up the first option with the given number.
+     *
+     * Registered option numbers (COAP_OPTION_NUMBER) are found in O(1)
+     * through an index kept next to options[]; other numbers are scanned.
+     * @return the option, or NULL if the packet does not carry it.
+     */
+    const CoapOption *getOption(uint16_t number) const;
+
+    /**
+     * @brief Iterates over a repeatable option such as Uri-Path or ETag.
+     * @return the next option after prev with the same number, or NULL.
+     */
+    const CoapOption *nextOption(const CoapOption *prev) const;
+
+    bool hasOption(uint16_t number) const { return getOption(number) != NULL; }
+
+    /**
+     * @brief Typed accessors for the first option with the given number.
+     *
+     * The returned values point into the packet buffer, nothing is copied.
+     * Strings are not NUL terminated. Each returns false if the option is
+     * absent, and getUintOption() also if it is longer than 4 bytes.
+     */
+    bool getUintOption(uint16_t number, uint32_t &value) const;
+    bool getOpaqueOption(uint16_t number, const uint8_t *&value, uint16_t &length) const;
+    bool getStringOption(uint16_t number, const char *&value, uint16_t &length) const;
+
+    /**
+     * @brief Decodes the options and payload that follow the token.
+     *
+     * Options that do not fit options[] are checked and skipped, so the
+     * payload is still found.
+     * @return 0 on success, 1 if a critical option had to be skipped, -1 if
+     *         the packet is malformed.
+     */
+    int parseOptions(uint8_t *p, uint8_t *end);
 
     /**
      * @brief Checks if the packet is an Observe request.
      * @return true if the packet is an Observe request, false otherwise.
      */
-    bool isObserve();
+    bool isObserve() const;
 
     /**
      * @brief Reads Observe option value (RFC 7641).
      * @param value Output observe value.
      * @return true if Observe option is present and valid.
      */
-    bool getObserveValue(uint32_t &value);
+    bool getObserveValue(uint32_t &value) const;
+
+    /**
+     * @brief Reads a Block1 or Block2 option (RFC 7959).
+     * @param number COAP_BLOCK1 or COAP_BLOCK2.
+     * @param num Output block number.
+     * @param more Output "more blocks follow" flag.
+     * @param szx Output size exponent, the block size is 16 << szx.
+     * @param bert Accept SZX 7, a BERT block of any multiple of 1024 bytes
+     *        whose num counts 1024 byte units (RFC 8323 section 6).
+     * @return true if the option is present and valid.
+     */
+    bool getBlock(uint16_t number, uint32_t &num, bool &more, uint8_t &szx, bool bert = false) const;
+
+    /**
+     * @brief Adds Uri-Path and Uri-Query options for a "path/to?query&..." url.
+     *
+     * The options point into url, which must outlive the packet.
+     */
+    void addUriOptions(const char *url);
+
+    /**
+     * @brief Hash of the Uri-Path options, as coapHash() of the joined path.
+     */
+    uint32_t uriPathHash() const;
+
+    /**
+     * @brief Encodes header, token and options into buffer.
+     * @return the encoded length, or 0 if it does not fit in size bytes.
+     */
+    uint16_t encode(uint8_t *buffer, int size) const;
+    uint16_t encodeOptions(uint8_t *buffer, int size, uint16_t packetSize, uint16_t running_delta) const;
+
+    static int parseOption(CoapOption *option, uint16_t *running_delta, uint8_t **buf, size_t buflen);
+
+private:
+    // presence bit and first position in options[] per indexed option number
+    uint32_t option_present = 0;
+    uint8_t option_first[COAP_INDEXED_OPTIONS];
+
+    void indexOption(uint8_t pos);
 };
 
+// Block-wise transfers stream the body through these callbacks one block at
+// a time. A reader fills buffer with up to len bytes starting at offset and
+// returns the number of bytes written; a writer consumes received bytes.
+// A CoapResponseCallback completes one client request; response is NULL
+// when the request timed out, was reset by the peer or was cancelled.
 #if defined(ESP8266)
 #include <functional>
 typedef std::function<void(CoapPacket &, IPAddress, int)> CoapCallback;
+typedef std::function<size_t(uint32_t, uint8_t *, size_t)> CoapBlockReader;
+typedef std::function<void(uint32_t, const uint8_t *, size_t)> CoapBlockWriter;
+typedef std::function<void(CoapPacket *, IPAddress, int, void *)> CoapResponseCallback;
 #elif defined(ESP32)
 #include <functional>
 typedef std::function<void(CoapPacket &, IPAddress, int)> CoapCallback;
+typedef std::function<size_t(uint32_t, uint8_t *, size_t)> CoapBlockReader;
+typedef std::function<void(uint32_t, const uint8_t *, size_t)> CoapBlockWriter;
+typedef std::function<void(CoapPacket *, IPAddress, int, void *)> CoapResponseCallback;
 #else
 typedef void (*CoapCallback)(CoapPacket &, IPAddress, int);
+typedef size_t (*CoapBlockReader)(uint32_t offset, uint8_t *buffer, size_t len);
+typedef void (*CoapBlockWriter)(uint32_t offset, const uint8_t *data, size_t len);
+typedef void (*CoapResponseCallback)(CoapPacket *response, IPAddress ip, int port, void *context);
 #endif
 
-class CoapUri
+// Takes a routed request away from Coap::loop(), see BasicCoap::handOff().
+typedef uint8_t *(*CoapHandOff)(CoapCallback callback, CoapPacket &request, IPAddress ip, int port, void *context);
+
+/**
+ * @brief Caller-supplied memory for a Coap instance.
+ *
+ * A bump allocator over a fixed buffer. Coap takes its transmit and receive
+ * buffers and its route strings from it, and handlers can borrow scratch
+ * space that is given back after each request. The high-water mark tells
+ * how much of the buffer a deployment really needs.
+ */
+class CoapArena
 {
 private:
-    String u[COAP_MAX_CALLBACK];
-    CoapCallback c[COAP_MAX_CALLBACK];
+    uint8_t *base;
+    size_t size;
+    size_t used = 0;
+    size_t high_water = 0;
 
 public:
-    CoapUri()
+    CoapArena(uint8_t *buffer, size_t size) : base(buffer), size(size) {}
+
+    /**
+     * @brief Allocates n bytes aligned for any scalar type.
+     * @return the memory, or NULL when the arena is exhausted.
+     */
+    void *allocate(size_t n);
+
+    size_t mark() const { return used; }
+    void release(size_t mark)
     {
-        for (int i = 0; i < COAP_MAX_CALLBACK; i++)
+        if (mark <= used)
+            used = mark;
+    }
+
+    size_t capacity() const { return size; }
+    size_t bytesUsed() const { return used; }
+    size_t highWater() const { return high_water; }
+};
+
+typedef enum
+{
+    COAP_STAT_RX = 0,            // datagrams received
+    COAP_STAT_RX_MALFORMED,      // dropped: bad version, token or options
+    COAP_STAT_RX_TOO_LARGE,      // did not fit the receive buffer
+    COAP_STAT_RX_BAD_OPTION,     // critical option that could not be kept
+    COAP_STAT_DUPLICATES,        // requests answered from the dedup cache
+    COAP_STAT_REQUESTS,          // requests passed to a handler
+    COAP_STAT_NOT_FOUND,         // 4.04 sent
+    COAP_STAT_UNAVAILABLE,       // 5.03 sent, the hand-off hook was full
+    COAP_STAT_TX,                // datagrams sent, without retransmissions
+    COAP_STAT_TX_FAILED,         // not sent, did not fit the buffer or the queue
+    COAP_STAT_RETRANSMITS,       // CON retransmissions
+    COAP_STAT_TX_TIMEOUTS,       // CON messages never acknowledged
+    COAP_STAT_REQUEST_TIMEOUTS,  // client requests without a response
+    COAP_STAT_OBSERVERS_EXPIRED, // observer leases that ran out
+    COAP_STAT_PROXY_HITS,        // proxy requests answered from the cache
+    COAP_STAT_PROXY_FORWARDED,   // proxy requests sent to an origin server
+    COAP_STAT_PROXY_REVALIDATED, // stale cache entries confirmed with 2.03
+    COAP_STAT_TX_QUEUED,         // CON messages held back by NSTART
+    COAP_STAT_TX_UNRELIABLE,     // CON messages sent once, no room to retransmit
+    COAP_STAT_COUNT
+} COAP_STAT;
+
+typedef enum
+{
+    COAP_TIMING_PARSE = 0, // header and options of a received datagram
+    COAP_TIMING_DISPATCH,  // dedup lookup and route lookup
+    COAP_TIMING_HANDLER,   // the request callback
+    COAP_TIMING_SEND,      // handing a datagram to the UDP stack
+    COAP_TIMING_COUNT
+} COAP_TIMING;
+
+// Log2 histogram of durations in microseconds.
+class CoapHistogram
+{
+public:
+    uint32_t buckets[COAP_STATS_BUCKETS] = {0};
+
+    void record(unsigned long us)
+    {
+        uint8_t i = 0;
+        while (i < COAP_STATS_BUCKETS - 1 && us >= (1UL << i))
+            i++;
+        buckets[i]++;
+    }
+};
+
+/**
+ * @brief Counters and timings of one Coap instance.
+ *
+ * Kept when the instance's Traits::STATS is set (COAP_STATS for Coap).
+ * read() serves the block as a CBOR map from names to counters, and to
+ * arrays of histogram buckets. Every number is written with a fixed width,
+ * so the document keeps its size and can be fetched block-wise while the
+ * counters move.
+ */
+class CoapStats
+{
+public:
+    uint32_t counters[COAP_STAT_COUNT] = {0};
+    CoapHistogram timings[COAP_TIMING_COUNT];
+
+    void reset() { *this = CoapStats(); }
+
+    size_t size() const { return encode(0, NULL, 0); }
+    size_t read(uint32_t offset, uint8_t *buffer, size_t len) const;
+
+    // Uri-Path of the built-in resource, .well-known/stats
+    static bool isStatsPath(const CoapPacket &packet);
+
+private:
+    // writes the part of the document at [offset, offset + len), returns its size
+    size_t encode(uint32_t offset, uint8_t *buffer, size_t len) const;
+};
+
+typedef enum
+{
+    COAP_TRACE_RX = 0,
+    COAP_TRACE_TX
+} COAP_TRACE_DIRECTION;
+
+// One message of the trace, in the UDP layout whatever it went over.
+struct CoapTraceRecord
+{
+    uint32_t time_hi; // micros() at the time, extended past its wrap
+    uint32_t time_lo;
+    IPAddress ip; // the peer
+    uint16_t port;
+    uint16_t len; // of the message, of which caplen bytes are kept
+    uint16_t caplen;
+    uint8_t direction;
+    uint8_t data[COAP_TRACE_SNAPLEN];
+};
+
+/**
+ * @brief The last messages received and sent by one Coap instance.
+ *
+ * Kept when the instance's Traits::TRACE is set (COAP_TRACE for Coap).
+ * record() copies at most COAP_TRACE_SNAPLEN bytes over the oldest record;
+ * it takes no lock, never allocates and cannot fail. read() serves the ring
+ * as a pcap file, oldest message first, each one behind an IPv4 and UDP
+ * header between the peer and local_port. The own address is not known to
+ * the UDP interface and is written as 0.0.0.0.
+ *
+ * hold() keeps the ring as it is while a dump is fetched block-wise; the
+ * messages of that time are only counted in missed.
+ */
+class CoapTrace
+{
+public:
+    CoapTraceRecord records[COAP_TRACE_ENTRIES];
+    uint32_t recorded = 0;
+    uint32_t missed = 0;
+    uint16_t local_port = COAP_DEFAULT_PORT;
+
+    void record(COAP_TRACE_DIRECTION direction, IPAddress ip, uint16_t port, unsigned long now_us,
+                const uint8_t *message, size_t len, const uint8_t *tail = NULL, size_t taillen = 0);
+    // notes a wrap of micros() that falls between two records
+    void tick(unsigned long now_us);
+    void hold(uint32_t until_us)
+    {
+        held = true;
+        held_until_us = until_us;
+    }
+    void release() { held = false; }
+    void reset();
+
+    size_t size() const { return encode(0, NULL, 0); }
+    size_t read(uint32_t offset, uint8_t *buffer, size_t len) const;
+
+    // Writes the pcap file to out, Serial or anything else with
+    // write(const uint8_t *, size_t), and returns its size.
+    template <class Sink>
+    size_t dump(Sink &out) const
+    {
+        uint8_t chunk[64];
+        size_t total = 0;
+        size_t n;
+        while ((n = read(total, chunk, sizeof(chunk))) > 0)
         {
-            u[i] = "";
-            c[i] = NULL;
+            out.write(chunk, n);
+            total += n;
         }
-    };
-    void add(CoapCallback call, String url)
-    {
-        for (int i = 0; i < COAP_MAX_CALLBACK; i++)
-            if (c[i] != NULL && u[i].equals(url))
-            {
-                c[i] = call;
-                return;
-            }
-        for (int i = 0; i < COAP_MAX_CALLBACK; i++)
+        return total;
+    }
+
+    // Uri-Path of the built-in resource, .well-known/trace
+    static bool isTracePath(const CoapPacket &packet);
+
+private:
+    // the slot of the next record, the oldest one once the ring is full
+    uint16_t head = 0;
+    uint32_t clock_hi = 0;
+    uint32_t clock_last = 0;
+    bool held = false;
+    uint32_t held_until_us = 0;
+
+    // writes the part of the file at [offset, offset + len), returns its size
+    size_t encode(uint32_t offset, uint8_t *buffer, size_t len) const;
+};
+
+// Arena bytes needed for the buffers of one Coap instance, plus route strings
+// and scratch space on top.
+#define COAP_ARENA_SIZE(buf_size, extra) (2 * (buf_size) + 2 * alignof(uint64_t) + (extra))
+
+// Encodes value as a CoAP uint option into out and returns its length.
+uint8_t coapEncodeUint(uint32_t value, uint8_t out[3]);
+
+// FNV-1a, shared by the route, observer and dedup indexes.
+static const uint32_t COAP_HASH_SEED = 2166136261UL;
+uint32_t coapHash(uint32_t hash, const uint8_t *data, size_t len);
+uint16_t coapMessageIdHash(IPAddress ip, int port, uint16_t messageid);
+uint32_t coapTokenHash(IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen);
+bool coapTokenEquals(const uint8_t *a, uint8_t alen, const uint8_t *b, uint8_t blen);
+
+// 32 random bits for message IDs, tokens and Leisure. They come from Arduino
+// random(), seeded by randomSeed() in setup(), mixed with micros() so boards
+// running the same unseeded sketch still differ, or from the source given
+// to coapSetRandom(), such as a hardware RNG.
+uint32_t coapRandom();
+void coapSetRandom(uint32_t (*source)());
+
+// True for an IPv4 multicast address, 224.0.0.0/4.
+inline bool coapIsMulticast(IPAddress ip) { return ip[0] >= 224 && ip[0] <= 239; }
+
+/**
+ * @brief Target of a proxy request as origin address and "path?query".
+ *
+ * Taken from Proxy-Uri, or from Proxy-Scheme with Uri-Host, Uri-Port,
+ * Uri-Path and Uri-Query, and normalized so that both forms of a request
+ * give the same url: the scheme is case-insensitive, the default port is
+ * implied and percent-encoding is decoded. Only coap:// with an IPv4
+ * address as host is supported.
+ * @return the length of url, or -1 if the target is not supported or does
+ *         not fit size bytes with its terminating NUL.
+ */
+int coapProxyTarget(const CoapPacket &request, IPAddress &ip, uint16_t &port, char *url, size_t size);
+
+// Smallest power of two holding n entries at a load factor of at most 1/2.
+static constexpr uint16_t coapTableSize(uint16_t n, uint16_t size = 1)
+{
+    return size >= 2 * n ? size : coapTableSize(n, size << 1);
+}
+
+/**
+ * @brief Route table mapping Uri-Path to server callbacks.
+ *
+ * Routes are hashed once when they are registered. Incoming requests are
+ * matched by hashing their Uri-Path options in place and probing an
+ * open-addressing index, so dispatch does not allocate or copy the path.
+ */
+template <uint8_t Capacity>
+class BasicCoapUri
+{
+private:
+    static const uint16_t INDEX_SIZE = coapTableSize(Capacity);
+
+    // route strings are copied into the arena, or onto the heap without one
+    CoapArena *arena = NULL;
+    char *u[Capacity];
+    uint16_t l[Capacity];
+    CoapCallback c[Capacity];
+    uint32_t h[Capacity];
+    uint8_t count = 0;
+    uint8_t index[INDEX_SIZE]; // route number + 1, 0 is an empty slot
+
+    bool matches(uint8_t route, const CoapPacket &packet) const;
+
+public:
+    BasicCoapUri()
+    {
+        for (int i = 0; i < Capacity; i++)
         {
-            if (c[i] == NULL)
-            {
-                c[i] = call;
-                u[i] = url;
-                return;
-            }
+            u[i] = NULL;
+            l[i] = 0;
+            c[i] = NULL;
+            h[i] = 0;
         }
+        memset(index, 0, sizeof(index));
     };
-    CoapCallback find(String url)
+    ~BasicCoapUri();
+    void setArena(CoapArena *a) { arena = a; }
+    void add(CoapCallback call, const char *url);
+    CoapCallback find(const CoapPacket &packet) const;
+};
+
+typedef BasicCoapUri<COAP_MAX_CALLBACK> CoapUri;
+
+/**
+ * @brief A request whose response is sent later (RFC 7252 section 5.2.2).
+ *
+ * Returned by Coap::defer(). It is a small value that keeps what the
+ * response needs, so it can be stored and copied freely; nothing in the
+ * library refers to it.
+ */
+class CoapExchange
+{
+public:
+    IPAddress ip;
+    uint16_t port = 0;
+    uint16_t messageid = 0;
+    uint8_t type = COAP_CON; // of the request
+    uint8_t token[8] = {0};
+    uint8_t tokenlen = 0;
+
+    bool valid() const { return port != 0; }
+};
+
+/**
+ * @brief A response encoded in place, see Coap::reply().
+ *
+ * The header and token are written when it is created. Options follow in
+ * increasing number order, uint options in their shortest form. Payload
+ * bytes go straight after them with write(), print(), printf() or the CBOR
+ * helpers, so they are never copied. An option or payload that does not
+ * fit, or an option out of order, fails the response: ok() turns false
+ * and send() sends nothing.
+ */
+class CoapResponseWriter
+{
+public:
+    // Transmits a finished response for the instance that created it.
+    typedef uint16_t (*Sender)(void *owner, CoapResponseWriter &writer);
+
+    CoapResponseWriter(uint8_t *buffer, size_t size, uint8_t type, uint8_t code, uint16_t messageid,
+                       const uint8_t *token, uint8_t tokenlen, IPAddress ip, int port, Sender sender, void *owner);
+
+    CoapResponseWriter &option(uint16_t number, const uint8_t *value, uint16_t length);
+    CoapResponseWriter &option(uint16_t number, const char *value) { return option(number, (const uint8_t *)value, strlen(value)); }
+    CoapResponseWriter &uintOption(uint16_t number, uint32_t value);
+    // omitted for COAP_NONE, text/plain takes no value bytes
+    CoapResponseWriter &contentFormat(COAP_CONTENT_TYPE type);
+    // the request's Block1 with M=0, for the final response of an upload
+    CoapResponseWriter &block1(const CoapPacket &request);
+
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *data, size_t len);
+    size_t print(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    /**
+     * @brief Room for payload to be produced in place, e.g. by a sensor
+     * driver or an encoder; commit() then adds the bytes that were used.
+     * @return where the next payload byte goes, NULL once failed.
+     */
+    uint8_t *reserve(size_t &room);
+    void commit(size_t len);
+
+    // CBOR data items (RFC 8949); maps and arrays take their item count.
+    CoapResponseWriter &cborMap(uint32_t pairs) { return cborHead(5, pairs); }
+    CoapResponseWriter &cborArray(uint32_t items) { return cborHead(4, items); }
+    CoapResponseWriter &cborUint(uint32_t value) { return cborHead(0, value); }
+    CoapResponseWriter &cborInt(int32_t value);
+    CoapResponseWriter &cborText(const char *text);
+    CoapResponseWriter &cborBytes(const uint8_t *data, size_t len);
+    CoapResponseWriter &cborFloat(float value);
+    CoapResponseWriter &cborBool(bool value);
+    CoapResponseWriter &cborNull();
+
+    bool ok() const { return buffer != NULL; }
+    const uint8_t *data() const { return buffer; }
+    size_t length() const;
+    IPAddress remoteIP() const { return ip; }
+    int remotePort() const { return port; }
+
+    /**
+     * @brief Sends the response, once.
+     * @return its message ID, or 0 if it failed or was already sent.
+     */
+    uint16_t send();
+
+private:
+    uint8_t *buffer;
+    size_t size;
+    size_t len = 0;
+    size_t payload_start = 0; // after the payload marker, 0 before it
+    uint16_t last_option = 0;
+    IPAddress ip;
+    uint16_t port;
+    Sender sender;
+    void *owner;
+
+    bool payload(size_t n);
+    CoapResponseWriter &cborHead(uint8_t major, uint32_t value);
+    CoapResponseWriter &fail()
     {
-        for (int i = 0; i < COAP_MAX_CALLBACK; i++)
-            if (c[i] != NULL && u[i].equals(url))
-                return c[i];
-        return NULL;
-    };
+        buffer = NULL;
+        return *this;
+    }
 };
 
 /**
@@ -236,16 +878,138 @@ public:
     Observer(IPAddress ip, int port, const uint8_t *token, int token_len);
 };
 
-class Coap
+/**
+ * @brief Capacities and feature switches of a BasicCoap instance.
+ *
+ * The defaults come from the COAP_* macros. Derive from it and override
+ * what differs, e.g. to give a proxy more observers than a sensor endpoint
+ * in the same image:
+ *
+ *   struct SensorTraits : CoapDefaultTraits
+ *   {
+ *       static const uint16_t BUF_MAX_SIZE = 64;
+ *       static const bool OBSERVE = false;
+ *   };
+ *   BasicCoap<SensorTraits> coap(udp);
+ *
+ * A disabled feature has no state in the instance and its code is dropped
+ * by the optimizer. The option count of CoapPacket stays global
+ * (COAP_MAX_OPTION_NUM) because packets are shared with the callbacks.
+ */
+struct CoapDefaultTraits
+{
+    static const uint8_t MAX_CALLBACK = COAP_MAX_CALLBACK;
+    static const uint16_t BUF_MAX_SIZE = COAP_BUF_MAX_SIZE;
+    static const uint8_t MAX_TRANSMISSIONS = COAP_MAX_TRANSMISSIONS;
+    static const uint8_t MAX_TRANSACTIONS = COAP_MAX_TRANSACTIONS;
+
+    // duplicate detection and response replay (RFC 7252 section 4.5)
+    static const bool DEDUP = true;
+    static const uint8_t MAX_DEDUP = COAP_MAX_DEDUP;
+    static const uint16_t DEDUP_RESPONSE_SIZE = COAP_DEDUP_RESPONSE_SIZE;
+
+    // server side Observe (RFC 7641)
+    static const bool OBSERVE = true;
+    static const uint16_t MAX_OBSERVERS = COAP_MAX_OBSERVERS;
+    static const uint8_t MAX_OBSERVE_RESOURCES = COAP_MAX_OBSERVE_RESOURCES;
+    static const uint8_t MAX_OBSERVE_URL_LEN = COAP_MAX_OBSERVE_URL_LEN;
+    static const bool NOTIFY_COALESCE = COAP_NOTIFY_COALESCE;
+    static const uint32_t NOTIFY_INTERVAL_MS = COAP_NOTIFY_INTERVAL_MS;
+
+    // client side block-wise transfers (RFC 7959)
+    static const bool BLOCKWISE = true;
+
+    // counters and latency histograms, served at /.well-known/stats
+    static const bool STATS = COAP_STATS;
+
+    // caching forward proxy (RFC 7252 section 5.7)
+    static const bool PROXY = COAP_PROXY;
+    static const uint8_t PROXY_CACHE_ENTRIES = COAP_PROXY_CACHE_ENTRIES;
+    static const uint8_t PROXY_WAITERS = COAP_PROXY_WAITERS;
+    static const uint8_t PROXY_URL_LEN = COAP_PROXY_MAX_URL_LEN;
+
+    // NSTART and adaptive RTO per destination (RFC 7252 section 4.7, CoCoA)
+    static const bool CONGESTION = COAP_CONGESTION;
+    static const uint8_t NSTART = COAP_NSTART;
+    static const uint8_t CONGESTION_QUEUE = COAP_CONGESTION_QUEUE;
+    static const uint8_t CONGESTION_PEERS = COAP_CONGESTION_PEERS;
+
+    // group requests and Leisure (RFC 7252 section 8)
+    static const bool MULTICAST = COAP_MULTICAST;
+    static const uint8_t MULTICAST_GROUPS = COAP_MULTICAST_GROUPS;
+    static const uint8_t MULTICAST_RESPONSES = COAP_MULTICAST_RESPONSES;
+    static const uint32_t MULTICAST_LEISURE_MS = COAP_MULTICAST_LEISURE_MS;
+
+    // CoAP over TCP and BERT blocks (RFC 8323)
+    static const bool TCP = COAP_TCP;
+    static const uint8_t TCP_CONNECTIONS = COAP_TCP_CONNECTIONS;
+
+    // ring of the last messages, served as a pcap file
+    static const bool TRACE = COAP_TRACE;
+};
+
+// State of an optional subsystem. When it is disabled nothing is stored and
+// every access sits behind a constant false Traits check.
+template <bool Enabled, class State>
+struct CoapFeature
+{
+    State state;
+    State *operator->() { return &state; }
+    const State *operator->() const { return &state; }
+};
+
+template <class State>
+struct CoapFeature<false, State>
+{
+    State *operator->() { return NULL; }
+    const State *operator->() const { return NULL; }
+};
+
+template <class Traits = CoapDefaultTraits>
+class BasicCoap
 {
 private:
+    static_assert(Traits::MAX_CALLBACK > 0 && Traits::MAX_TRANSMISSIONS > 0 && Traits::MAX_TRANSACTIONS > 0,
+                  "capacities must not be zero");
+    static_assert(Traits::MAX_DEDUP > 0 && Traits::MAX_OBSERVERS > 0 && Traits::MAX_OBSERVE_RESOURCES > 0 &&
+                      Traits::PROXY_CACHE_ENTRIES > 0 && Traits::PROXY_WAITERS > 0,
+                  "turn a feature off with its switch instead of a zero capacity");
+    static_assert(Traits::PROXY_CACHE_ENTRIES < 0xFF && Traits::PROXY_WAITERS < 0xFF, "proxy tables are indexed by uint8_t");
+    static_assert(!Traits::CONGESTION || (Traits::NSTART > 0 && Traits::MAX_TRANSMISSIONS + Traits::CONGESTION_QUEUE < 0xFF &&
+                                          Traits::CONGESTION_PEERS > Traits::MAX_TRANSMISSIONS && Traits::CONGESTION_PEERS < 0xFF),
+                  "congestion control needs NSTART > 0 and more peers than transmissions, so an idle peer can be evicted");
+    static_assert(!Traits::MULTICAST || (Traits::MULTICAST_GROUPS > 0 && Traits::MULTICAST_RESPONSES > 0),
+                  "turn multicast off with its switch instead of a zero capacity");
+    static_assert(!Traits::TCP || (Traits::TCP_CONNECTIONS > 0 && Traits::TCP_CONNECTIONS < 0xFF),
+                  "turn TCP off with its switch instead of a zero capacity");
+    // a message and a tail of at most a buffer each, framed with at most
+    // the 2-byte extended length of RFC 8323 section 3.2
+    static_assert(!Traits::TCP || 2UL * Traits::BUF_MAX_SIZE < 65805UL,
+                  "TCP messages longer than 65804 bytes need the 4-byte length, which tcpWrite() does not encode");
+
+    void init();
+
     UDP *_udp;
-    CoapUri uri;
-    CoapCallback resp;
+    CoapArena *arena = NULL;
+    BasicCoapUri<Traits::MAX_CALLBACK> uri;
+    // uri, or the table of the instance given to shareRoutes()
+    const BasicCoapUri<Traits::MAX_CALLBACK> *routes = &uri;
+    CoapCallback resp = NULL;
     int _port;
     int coap_buf_size;
     uint8_t *tx_buffer = NULL;
     uint8_t *rx_buffer = NULL;
+    // hand-off hook, and the buffer it lent for the next datagram
+    CoapHandOff handoff = NULL;
+    void *handoff_context = NULL;
+    uint8_t *rx_lent = NULL;
+    // Message IDs are sequential from a random start (RFC 7252 section 4.4),
+    // so recently used IDs are not repeated within EXCHANGE_LIFETIME.
+    uint16_t messageid = 0;
+    // 0 is skipped, so send() can return it for a failure
+    uint16_t nextMessageId() { return ++messageid != 0 ? messageid : ++messageid; }
+
+    static const uint16_t NO_OBSERVER = 0xFFFF;
 
     struct ObserveEntry
     {
@@ -254,26 +1018,580 @@ private:
         uint16_t port = 0;
         uint8_t token[8] = {0};
         uint8_t tokenlen = 0;
+        uint8_t resource = 0;
         uint32_t observe_seq = 0;
         unsigned long last_seen_ms = 0;
-        char url[COAP_MAX_OBSERVE_URL_LEN] = {0};
+        unsigned long last_con_ms = 0; // last confirmable notification
+        uint16_t messageid = 0;        // of the last notification
+        bool confirming = false;       // a CON notification is unacknowledged
+        bool pending = false;          // skipped meanwhile, gets the latest value
+        // observers of the same resource, or the free list when unused
+        uint16_t next = NO_OBSERVER;
+        uint16_t prev = NO_OBSERVER;
+        // all observers from the least to the most recently registered
+        uint16_t older = NO_OBSERVER;
+        uint16_t newer = NO_OBSERVER;
+    };
+
+    // Observed URLs are interned once; observers refer to them by number.
+    struct ObserveResource
+    {
+        uint16_t count = 0; // 0 when the slot is free
+        uint16_t head = NO_OBSERVER;
+        uint32_t hash = 0;
+        uint32_t interval_ms = 0;
+        unsigned long last_sent_ms = 0;
+        bool notified = false; // last_sent_ms is set
+        char url[Traits::MAX_OBSERVE_URL_LEN] = {0};
+    };
+
+    struct ObserveState
+    {
+        static const uint16_t INDEX_SIZE = coapTableSize(Traits::MAX_OBSERVERS);
+
+        ObserveEntry entries[Traits::MAX_OBSERVERS];
+        ObserveResource resources[Traits::MAX_OBSERVE_RESOURCES];
+        // Open-addressing index on (ip, port, token): entry number + 1, 0 is empty.
+        uint16_t index[INDEX_SIZE] = {0};
+        uint16_t free_list = 0;
+        uint16_t oldest = NO_OBSERVER;
+        uint16_t newest = NO_OBSERVER;
+        // observers with a CON notification outstanding
+        uint16_t confirming = 0;
+    };
+    CoapFeature<Traits::OBSERVE, ObserveState> observe;
+
+    // Latest value of each observed resource, for coalesced notifications
+    // and for observers that were skipped while confirming.
+    struct NotifyValue
+    {
+        bool due = false; // coalesced, sent when the interval has passed
+        bool valid = false;
+        COAP_CONTENT_TYPE type = COAP_NONE;
+        uint16_t len = 0;
+        uint8_t value[Traits::BUF_MAX_SIZE];
+    };
+    struct NotifyState
+    {
+        NotifyValue values[Traits::MAX_OBSERVE_RESOURCES];
     };
-    ObserveEntry observers[COAP_MAX_OBSERVERS];
+    CoapFeature<Traits::OBSERVE && Traits::NOTIFY_COALESCE, NotifyState> notifications;
+
+    int observeResourceFind(const char *url, bool create);
+    uint16_t observerFind(IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen) const;
+    void observerRemove(uint16_t n);
+    void observerTouch(uint16_t n);
+    void observerExpire(unsigned long now);
+    void observerAcked(IPAddress ip, int port, uint16_t messageid);
+    void observerRejected(IPAddress ip, int port, uint16_t messageid);
+    int notifyTail(const uint8_t *payload, size_t payload_len, COAP_CONTENT_TYPE type);
+    bool notifyObserver(uint16_t n, uint16_t tailSize, unsigned long now);
+    int notifyResource(uint8_t resource, const uint8_t *payload, size_t payload_len, COAP_CONTENT_TYPE type, unsigned long now);
+    void notifyDue(unsigned long now);
+
+    static const uint8_t NO_TRANSMISSION = 0xFF; // also no peer
+
+    struct TransmissionEntry
+    {
+        bool in_use = false;
+        bool queued = false; // waiting for NSTART, not sent yet
+        IPAddress ip;
+        uint16_t port = 0;
+        uint16_t messageid = 0;
+        uint8_t retransmit_count = 0;
+        uint8_t heap_pos = 0;
+        uint8_t backoff = 4; // timeout multiplier per retransmission, in halves
+        uint8_t peer = NO_TRANSMISSION;
+        uint8_t queue_next = NO_TRANSMISSION;
+        unsigned long sent_ms = 0;
+        unsigned long timeout_ms = 0;
+        unsigned long due_ms = 0;
+        uint16_t len = 0;
+        uint8_t buffer[Traits::BUF_MAX_SIZE];
+    };
+    // Up to MAX_TRANSMISSIONS in flight, and with congestion control up to
+    // CONGESTION_QUEUE more waiting for NSTART.
+    static const uint16_t TRANSMISSION_SLOTS = Traits::MAX_TRANSMISSIONS + (Traits::CONGESTION ? Traits::CONGESTION_QUEUE : 0);
+    TransmissionEntry transmissions[TRANSMISSION_SLOTS];
+    // Min-heap of the transmissions[] in flight, ordered by due_ms.
+    uint8_t transmit_heap[Traits::MAX_TRANSMISSIONS];
+    uint8_t transmit_heap_len = 0;
+
+    // What scheduleTransmission() decided for a CON message.
+    enum TransmitAction
+    {
+        TRANSMIT_NOW,
+        TRANSMIT_QUEUED, // sent by congestionRelease() later
+        TRANSMIT_DROPPED // its peer is at NSTART and nothing can be queued
+    };
+
+    // A destination of CON messages. RTTs feed a strong estimator (no
+    // retransmission) and a weak one (ACK after one or two
+    // retransmissions); both blend into rto_ms as in CoCoA.
+    struct CongestionPeer
+    {
+        bool in_use = false;
+        bool strong_valid = false;
+        bool weak_valid = false;
+        IPAddress ip;
+        uint16_t port = 0;
+        uint8_t outstanding = 0;
+        // FIFO of queued transmissions[], linked through queue_next
+        uint8_t queue_head = NO_TRANSMISSION;
+        uint8_t queue_tail = NO_TRANSMISSION;
+        uint32_t strong_srtt_ms = 0;
+        uint32_t strong_rttvar_ms = 0;
+        uint32_t weak_srtt_ms = 0;
+        uint32_t weak_rttvar_ms = 0;
+        uint32_t rto_ms = COAP_ACK_TIMEOUT_MS;
+        unsigned long rto_updated_ms = 0;
+        unsigned long last_used_ms = 0;
+    };
+    struct CongestionState
+    {
+        CongestionPeer peers[Traits::CONGESTION_PEERS];
+        uint8_t queued = 0; // transmissions[] waiting for NSTART
+    };
+    CoapFeature<Traits::CONGESTION, CongestionState> congestion;
+
+    // A response to a group request, sent when its Leisure has passed.
+    struct MulticastResponse
+    {
+        bool in_use = false;
+        IPAddress ip;
+        uint16_t port = 0;
+        unsigned long due_ms = 0;
+        uint16_t len = 0;
+        uint8_t buffer[Traits::BUF_MAX_SIZE];
+    };
+    struct MulticastState
+    {
+        UDP *groups[Traits::MULTICAST_GROUPS] = {NULL};
+        MulticastResponse responses[Traits::MULTICAST_RESPONSES];
+        // the request being dispatched arrived through a group
+        bool dispatching = false;
+        IPAddress ip;
+        uint16_t port = 0;
+    };
+    CoapFeature<Traits::MULTICAST, MulticastState> multicast;
+
+    // Where a message given to handleMessage() came from.
+    enum MessageSource
+    {
+        FROM_UNICAST,
+        FROM_GROUP,
+        FROM_TCP
+    };
+
+    bool receive(UDP *udp, bool group, unsigned long now);
+    void handleMessage(uint8_t *rx, int32_t packetlen, bool truncated, IPAddress ip, int port, MessageSource source, unsigned long now);
+    bool multicastDelay(IPAddress ip, int port, uint16_t packetSize);
+    void multicastDue(unsigned long now);
+
+    static const uint32_t COCOA_MIN_RTO_MS = 100;
+    static const uint32_t COCOA_MAX_RTO_MS = 60000;
+
+    uint8_t congestionPeer(IPAddress ip, int port, unsigned long now);
+    static uint32_t congestionRto(CongestionPeer &peer, unsigned long now);
+    void congestionSample(CongestionPeer &peer, const TransmissionEntry &entry, unsigned long now);
+    static uint32_t congestionEstimate(uint32_t &srtt, uint32_t &rttvar, bool &valid, uint32_t rtt, uint8_t k);
+    void congestionRelease(uint8_t peer, unsigned long now);
+    void transmissionStart(TransmissionEntry &entry, uint32_t rto_ms, unsigned long now);
+    void transmissionRemove(uint8_t slot);
+
+    static const uint8_t NO_CONNECTION = 0xFF;
+    // Max-Message-Size until the peer's CSM tells (RFC 8323 section 5.3.1)
+    static const uint32_t TCP_DEFAULT_MESSAGE_SIZE = 1152;
+    // room left next to a BERT block for the header, token and options
+    static const uint16_t BERT_HEADROOM = 64;
+
+    // A connection attached with attach(). The frame header is read as it
+    // arrives; the rest of a message is read at once when all of it is there.
+    struct TcpConnection
+    {
+        Client *client = NULL; // NULL when the slot is free
+        IPAddress ip;
+        uint16_t port = 0;
+        bool bert = false; // the peer's CSM offered Block-Wise-Transfer
+        uint32_t max_message_size = TCP_DEFAULT_MESSAGE_SIZE;
+        uint32_t skip = 0; // left of a message that does not fit rx_buffer
+        uint8_t head[6];   // Len/TKL, extended length and code
+        uint8_t head_len = 0;
+    };
+    struct TcpState
+    {
+        TcpConnection connections[Traits::TCP_CONNECTIONS];
+    };
+    CoapFeature<Traits::TCP, TcpState> tcp;
+
+    uint8_t tcpFind(IPAddress ip, int port) const;
+    bool tcpBert(IPAddress ip, int port) const;
+    int tcpLimit(IPAddress ip, int port) const;
+    bool tcpWrite(uint8_t c, uint8_t *message, uint16_t len, const uint8_t *tail = NULL, uint16_t taillen = 0);
+    bool tcpSendSignal(uint8_t c, uint8_t code, const uint8_t *token, uint8_t tokenlen);
+    void tcpReceive(uint8_t c, unsigned long now);
+    void tcpSignal(uint8_t c, uint8_t *rx, uint32_t len, uint8_t tokenlen, uint8_t code);
+    void tcpClose(uint8_t c);
+    // frame header size and Length (options and payload) from Len/TKL
+    static uint8_t tcpHeaderSize(uint8_t first) { return (first >> 4) < 13 ? 2 : (first >> 4) == 13 ? 3 : (first >> 4) == 14 ? 4 : 6; }
+    static uint32_t tcpLength(const uint8_t *head);
+
+    static const uint16_t DEDUP_CACHE_SIZE = Traits::DEDUP_RESPONSE_SIZE > 0 && Traits::DEDUP_RESPONSE_SIZE < Traits::BUF_MAX_SIZE
+                                                 ? Traits::DEDUP_RESPONSE_SIZE
+                                                 : Traits::BUF_MAX_SIZE;
+    struct DedupEntry
+    {
+        IPAddress ip;
+        uint16_t port = 0;
+        uint16_t messageid = 0;
+        unsigned long expires_ms = 0;
+        bool overflow = false; // response did not fit, duplicates are handled again
+        uint16_t len = 0;
+        uint8_t buffer[DEDUP_CACHE_SIZE];
+    };
+
+    struct DedupState
+    {
+        static const uint16_t INDEX_SIZE = coapTableSize(Traits::MAX_DEDUP);
+
+        // Entries form a ring in arrival order, which is also expiry order.
+        DedupEntry entries[Traits::MAX_DEDUP];
+        uint8_t head = 0;
+        uint8_t count = 0;
+        // Open-addressing index over the ring: entry number + 1, 0 is empty.
+        uint8_t index[INDEX_SIZE] = {0};
+        // Entry of the request being dispatched, its first reply is cached.
+        int16_t current = -1;
+    };
+    CoapFeature<Traits::DEDUP, DedupState> dedup;
+
+    int16_t dedupFind(IPAddress ip, int port, uint16_t messageid) const;
+    int16_t dedupInsert(IPAddress ip, int port, uint16_t messageid, unsigned long now);
+    void dedupEvictOldest();
+    void dedupExpire(unsigned long now);
+    void dedupCapture(IPAddress ip, int port, const uint8_t *buffer, uint16_t len);
+
+    static const uint8_t NO_TRANSACTION = 0xFF;
+
+    // Client requests waiting for their response. A piggybacked response,
+    // empty ACK or Reset is matched by message ID, a separate response by
+    // token; both go through an open-addressing index.
+    struct Transaction
+    {
+        bool in_use = false;
+        bool acked = false;     // empty ACK seen, a separate response follows
+        bool multicast = false; // to a group, collects responses until it expires
+        uint8_t generation = 0;
+        IPAddress ip;
+        uint16_t port = 0;
+        uint16_t messageid = 0;
+        uint8_t token[4] = {0};
+        unsigned long expires_ms = 0;
+        CoapResponseCallback callback = NULL;
+        void *context = NULL;
+        // expiry order; next free when unused
+        uint8_t older = NO_TRANSACTION;
+        uint8_t newer = NO_TRANSACTION;
+    };
+    static const uint16_t TRANSACTION_INDEX_SIZE = coapTableSize(Traits::MAX_TRANSACTIONS);
+    Transaction transactions[Traits::MAX_TRANSACTIONS];
+    // entry number + 1, 0 is empty
+    uint8_t transaction_mid_index[TRANSACTION_INDEX_SIZE] = {0};
+    uint8_t transaction_token_index[TRANSACTION_INDEX_SIZE] = {0};
+    uint8_t transaction_free = 0;
+    uint8_t transaction_oldest = NO_TRANSACTION;
+    uint8_t transaction_newest = NO_TRANSACTION;
+    // group requests in flight, found by token alone
+    uint8_t transaction_multicast = 0;
+
+    const uint8_t *transactionToken();
+    uint16_t transactionAdd(IPAddress ip, int port, uint16_t messageid, CoapResponseCallback callback, void *context);
+    uint8_t transactionByMessageId(IPAddress ip, int port, uint16_t messageid) const;
+    uint8_t transactionByToken(IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen) const;
+    uint8_t transactionByGroupToken(const uint8_t *token, uint8_t tokenlen) const;
+    void transactionUnindex(uint8_t *index, uint8_t n, uint16_t (*home)(const Transaction &));
+    void transactionComplete(uint8_t n, CoapPacket *response, IPAddress ip, int port);
+    void transactionExpire(unsigned long now);
+    bool handleResponse(CoapPacket &packet, IPAddress ip, int port);
+    static uint16_t transactionMidHome(const Transaction &t);
+    static uint16_t transactionTokenHome(const Transaction &t);
+
+    // Client side block-wise transfer in progress, one at a time.
+    struct BlockTransfer
+    {
+        bool in_use = false;
+        IPAddress ip;
+        uint16_t port = 0;
+        const char *url = NULL;
+        uint8_t method = 0;
+        uint8_t option = 0; // COAP_BLOCK1 (upload) or COAP_BLOCK2 (download)
+        uint32_t num = 0;
+        uint8_t szx = 0;
+        size_t total_len = 0;
+        size_t sent = 0; // payload of the last upload block
+        COAP_CONTENT_TYPE content_type = COAP_NONE;
+        uint16_t messageid = 0;
+        CoapBlockReader reader = NULL;
+        CoapBlockWriter writer = NULL;
+    };
+    CoapFeature<Traits::BLOCKWISE, BlockTransfer> block;
+
+    static const uint8_t NO_PROXY_ENTRY = 0xFF; // also ends waiter lists
+    // Max-Age is capped so that freshness fits signed millis() arithmetic.
+    static const uint32_t PROXY_MAX_AGE_S = 2000000UL;
+
+    // A target of the forward proxy: its cached response, and the clients
+    // waiting while a request for it is outstanding at the origin server.
+    struct ProxyEntry
+    {
+        bool cached = false;   // holds a response that can be served
+        bool fetching = false; // a request to the origin is outstanding
+        bool indexed = false;  // a GET target, found through the index
+        uint32_t hash = 0;
+        IPAddress ip;
+        uint16_t port = 0;
+        int32_t accept = COAP_NONE;
+        int32_t block = COAP_NONE; // the Block2 asked for, without the M bit
+        char url[Traits::PROXY_URL_LEN] = {0};
+        uint8_t code = 0;
+        int32_t format = COAP_NONE;
+        // block-wise options of the response, relayed as they came
+        int32_t block1 = COAP_NONE;
+        int32_t block2 = COAP_NONE;
+        int32_t size1 = COAP_NONE;
+        int32_t size2 = COAP_NONE;
+        uint8_t etag[8] = {0};
+        uint8_t etaglen = 0;
+        unsigned long stored_ms = 0;
+        uint32_t max_age_s = 0;
+        uint16_t len = 0;
+        uint8_t payload[Traits::BUF_MAX_SIZE];
+        uint8_t waiters = NO_PROXY_ENTRY;
+        // least to most recently used; next free when unused
+        uint8_t older = NO_PROXY_ENTRY;
+        uint8_t newer = NO_PROXY_ENTRY;
+        BasicCoap *owner = NULL; // for the response callback
+    };
+
+    struct ProxyWaiter
+    {
+        CoapExchange exchange;
+        uint8_t next = NO_PROXY_ENTRY;
+    };
+
+    struct ProxyState
+    {
+        static const uint16_t INDEX_SIZE = coapTableSize(Traits::PROXY_CACHE_ENTRIES);
+
+        ProxyEntry entries[Traits::PROXY_CACHE_ENTRIES];
+        ProxyWaiter waiters[Traits::PROXY_WAITERS];
+        // Open-addressing index on the target: entry number + 1, 0 is empty.
+        uint8_t index[INDEX_SIZE] = {0};
+        uint8_t free_entry = 0;
+        uint8_t free_waiter = 0;
+        uint8_t oldest = NO_PROXY_ENTRY;
+        uint8_t newest = NO_PROXY_ENTRY;
+    };
+    CoapFeature<Traits::PROXY, ProxyState> proxy;
+
+    void proxyRequest(CoapPacket &request, IPAddress ip, int port);
+    uint8_t proxyFind(IPAddress ip, uint16_t port, int32_t accept, int32_t block, const char *url, uint32_t hash) const;
+    void proxyInvalidate(IPAddress ip, uint16_t port, const char *url);
+    uint8_t proxyAllocate();
+    void proxyRelease(uint8_t n);
+    void proxyLink(uint8_t n);
+    void proxyUnlink(uint8_t n);
+    bool proxyFetch(uint8_t n, CoapPacket &request, IPAddress ip, int port);
+    void proxyWait(uint8_t n, CoapPacket &request, IPAddress ip, int port);
+    void proxyStore(ProxyEntry &entry, const CoapPacket &response, bool body, unsigned long now);
+    void proxyComplete(uint8_t n, CoapPacket *response);
+    uint16_t proxyRespond(const CoapExchange &exchange, bool separate, const ProxyEntry *entry, uint8_t code, unsigned long now);
+    static void proxyResponse(CoapPacket *response, IPAddress ip, int port, void *context);
+    uint16_t proxyHome(const ProxyEntry &entry) const { return entry.hash & (ProxyState::INDEX_SIZE - 1); }
+
+    static CoapExchange exchangeOf(const CoapPacket &request, IPAddress ip, int port);
+
+    bool sendBlockRequest();
+    bool handleBlockResponse(CoapPacket &packet, IPAddress ip, int port);
+    uint8_t blockSzx(int room, uint8_t szx) const;
+    // A BERT block (SZX 7) is as many 1024 byte units as fit and its number
+    // counts those units.
+    static uint32_t blockOffset(uint32_t num, uint8_t szx) { return num << (szx == 7 ? 10 : szx + 4); }
+    static uint32_t blockNum(uint32_t offset, uint8_t szx) { return offset >> (szx == 7 ? 10 : szx + 4); }
+    static uint32_t blockSize(uint8_t szx, int limit) { return szx == 7 ? (limit - BERT_HEADROOM) / 1024 * 1024UL : 16UL << szx; }
+
+    void sendEmpty(COAP_TYPE type, IPAddress ip, int port, uint16_t messageid);
+    TransmitAction scheduleTransmission(IPAddress ip, int port, uint16_t messageid, const uint8_t *buffer, uint16_t len,
+                                        const uint8_t *tail = NULL, uint16_t taillen = 0);
+    bool cancelTransmission(IPAddress ip, int port, uint16_t messageid, bool answered = false);
+    void processTransmissions(unsigned long now);
+    bool transmitBefore(uint8_t a, uint8_t b) const;
+    void transmitHeapSwap(uint8_t i, uint8_t j);
+    void transmitHeapUp(uint8_t pos);
+    void transmitHeapDown(uint8_t pos);
+    void transmitHeapRemove(uint8_t pos);
+
+    CoapFeature<Traits::STATS, CoapStats> stats;
+
+    void count(COAP_STAT stat)
+    {
+        if (Traits::STATS)
+            stats->counters[stat]++;
+    }
+    CoapFeature<Traits::TRACE, CoapTrace> trace;
+
+    void traceRecord(COAP_TRACE_DIRECTION direction, IPAddress ip, int port, const uint8_t *message, size_t len,
+                     const uint8_t *tail = NULL, size_t taillen = 0);
+    // micros() is only read when the timings are kept
+    unsigned long timingStart() const;
+    void timingEnd(COAP_TIMING timing, unsigned long start);
+
+    template <class Reader>
+    uint16_t sendBlocks(IPAddress ip, int port, CoapPacket &request, Reader reader, size_t total_len, COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type);
 
     uint16_t sendPacket(CoapPacket &packet, IPAddress ip);
     uint16_t sendPacket(CoapPacket &packet, IPAddress ip, int port);
-    int parseOption(CoapOption *option, uint16_t *running_delta, uint8_t **buf, size_t buflen);
+    uint16_t encodePacket(CoapPacket &packet) { return packet.encode(tx_buffer, coap_buf_size); }
+    uint16_t encodeOptions(CoapPacket &packet, uint16_t packetSize, uint16_t running_delta)
+    {
+        return packet.encodeOptions(tx_buffer, coap_buf_size, packetSize, running_delta);
+    }
+    uint16_t transmitPacket(CoapPacket &packet, IPAddress ip, int port, uint16_t packetSize)
+    {
+        return transmitPacket(ip, port, packet.type, packet.messageid, packetSize);
+    }
+    uint16_t transmitPacket(IPAddress ip, int port, uint8_t type, uint16_t messageid, uint16_t packetSize);
+    static uint16_t sendWritten(void *owner, CoapResponseWriter &writer);
 
 public:
-    Coap(
+    BasicCoap(
+        UDP &udp,
+        int coap_buf_size = Traits::BUF_MAX_SIZE);
+    /**
+     * @brief Construct a Coap that takes all of its memory from arena.
+     *
+     * Nothing is allocated from the heap, so the footprint is sizeof(Coap)
+     * plus what the arena reports. Size the arena with COAP_ARENA_SIZE().
+     * start() fails if the buffers did not fit.
+     */
+    BasicCoap(
         UDP &udp,
-        int coap_buf_size = COAP_BUF_MAX_SIZE);
-    ~Coap();
+        CoapArena &arena,
+        int coap_buf_size = Traits::BUF_MAX_SIZE);
+    ~BasicCoap();
+    // start() also draws the first message ID, after setup() had the
+    // chance to seed the random source
     bool start();
     bool start(int port);
     void response(CoapCallback c) { resp = c; }
 
-    void server(CoapCallback c, String url) { uri.add(c, url); }
+    void server(CoapCallback c, const char *url) { uri.add(c, url); }
+    void server(CoapCallback c, String url) { uri.add(c, url.c_str()); }
+
+    /**
+     * @brief Dispatches requests through the routes registered on owner.
+     *
+     * Lets several instances, e.g. one per thread, serve one route table
+     * without copying it. owner must outlive this instance and must not
+     * register routes while others are dispatching through it.
+     */
+    void shareRoutes(const BasicCoap &owner) { routes = &owner.uri; }
+
+    /**
+     * @brief Receives the requests sent to a multicast group as well.
+     *
+     * group is a UDP object of its own, started with beginMulticast(); the
+     * unicast one keeps sending all responses. A request that arrives
+     * through a group is answered after a random delay of up to
+     * Traits::MULTICAST_LEISURE_MS, and not at all with an error (4.xx or
+     * 5.xx) or if it is confirmable (RFC 7252 section 8.2). Needs
+     * Traits::MULTICAST; up to MULTICAST_GROUPS groups can be joined.
+     */
+    bool joinGroup(UDP &group, IPAddress address, int port = COAP_DEFAULT_PORT);
+
+    /**
+     * @brief True while a handler runs for a request that arrived through a
+     * group, e.g. to stay silent when there is nothing useful to say.
+     */
+    bool isMulticastRequest() const { return Traits::MULTICAST && multicast->dispatching; }
+
+    /**
+     * @brief Exchanges the messages for ip:port over a TCP connection
+     * (RFC 8323) instead of UDP.
+     *
+     * client is already connected, by connect() or from a server's accept,
+     * and must stay valid until the connection closes. Everything sent to
+     * ip:port, requests, responses and notifications alike, is then framed
+     * by its length and written to client; loop() reads what arrives, any
+     * number of pipelined messages per pass. Responses are matched by token
+     * and nothing is acknowledged, retransmitted or deduplicated. Block-wise
+     * transfers use BERT blocks when the peer offers them in its CSM.
+     *
+     * The connection closes when the peer closes it or sends Release or
+     * Abort. Requests still waiting over it then complete with NULL and its
+     * observers are removed. Needs Traits::TCP; up to TCP_CONNECTIONS can be
+     * attached at once.
+     */
+    bool attach(Client &client, IPAddress ip, int port);
+
+    /**
+     * @brief Closes the connection attached for ip:port as if the peer had.
+     */
+    void detach(IPAddress ip, int port);
+
+    /**
+     * @brief Sends a Ping over the connection to ip:port, e.g. to keep NAT
+     * state alive; the peer answers with a Pong.
+     */
+    bool ping(IPAddress ip, int port);
+
+    /**
+     * @brief Passes routed requests to hook instead of running their callback.
+     *
+     * Lets a pool of threads run the handlers. Datagrams are read into
+     * buffer, of at least bufferSize() bytes, and the request given to hook
+     * points into it. hook keeps that buffer with the request and returns
+     * the one to read the next datagram into, so nothing is copied. When it
+     * returns NULL the request is answered with 5.03 and the buffer reused.
+     * The reply is sent later with sendReply() from the thread that runs
+     * loop(). handOff(NULL, NULL, NULL) goes back to calling handlers inline.
+     */
+    void handOff(CoapHandOff hook, void *context, uint8_t *buffer);
+
+    /**
+     * @brief Sends a reply encoded elsewhere to a request taken by handOff().
+     *
+     * It is cached for duplicates of the request like any other reply, and
+     * retransmitted if it is confirmable. A NON reply is given its message
+     * ID here, in buffer, since IDs can only be taken on this thread.
+     * @return the message ID of the reply, or 0 if it is malformed.
+     */
+    uint16_t sendReply(IPAddress ip, int port, uint16_t request_messageid, uint8_t *buffer, uint16_t len);
+
+    int bufferSize() const { return coap_buf_size; }
+
+    /**
+     * @brief Borrows scratch memory from the arena for the current request.
+     *
+     * It is released when the handler returns. Returns NULL without an arena
+     * or when the arena is exhausted.
+     */
+    void *scratch(size_t n) { return arena != NULL ? arena->allocate(n) : NULL; }
+    /**
+     * @brief Starts a response to request that is encoded in place.
+     *
+     * Header, token, options and payload are written by the returned
+     * writer straight into the transmit buffer, and its send() transmits
+     * them like sendResponse(). Nothing else may be sent through this
+     * instance in between.
+     *
+     *   CoapResponseWriter out = coap.reply(packet, ip, port);
+     *   out.contentFormat(COAP_APPLICATION_CBOR);
+     *   out.cborMap(1).cborText("t").cborFloat(readTemperature());
+     *   out.send();
+     */
+    CoapResponseWriter reply(const CoapPacket &request, IPAddress ip, int port, COAP_RESPONSE_CODE code = COAP_CONTENT);
+
     uint16_t sendResponse(IPAddress ip, int port, uint16_t messageid);
     uint16_t sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload);
     uint16_t sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen);
@@ -281,13 +1599,108 @@ public:
 
     uint16_t sendObserveResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen, COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type, const uint8_t *token, int tokenlen, uint32_t observe_seq);
 
+    /**
+     * @brief Answers a request later with a separate response.
+     *
+     * Call it from a handler that cannot answer right away. A CON request
+     * is acknowledged with an empty ACK at once, so the client stops
+     * retransmitting and loop() moves on to the next datagram. Complete the
+     * exchange with respond() once the result is ready; a CON request gets
+     * a CON response that is retransmitted until the client acknowledges
+     * it. respond() must run on the thread that runs loop().
+     */
+    CoapExchange defer(CoapPacket &request, IPAddress ip, int port);
+    uint16_t respond(const CoapExchange &exchange, const char *payload, size_t payloadlen, COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type);
+
     /**
      * @brief Notify the observer with the given payload.
      *
      * It sends a non-confirmable notification according to the CoAP observe specifications RFC-7641.
      */
     uint16_t notify(Observer *observer, const char *payload, int payload_len, COAP_CONTENT_TYPE type);
+
+    /**
+     * @brief Notifies every observer of url.
+     *
+     * Notifications are NON, with a CON to each observer at least every
+     * COAP_NOTIFY_CON_INTERVAL_MS; an observer that does not acknowledge it,
+     * or rejects any notification with a Reset, is removed.
+     *
+     * With NOTIFY_COALESCE, a value notified less than min_interval_ms after
+     * the previous one is held back and sent from loop() once the interval
+     * has passed; a newer value replaces it. An observer whose CON is still
+     * unacknowledged likewise gets the latest value once it acknowledges.
+     *
+     * @return the number of observers notified now, 0 if the value was held
+     *         back.
+     */
     int notify(const char *url, const char *payload, int payload_len, COAP_CONTENT_TYPE type);
+    int notify(const char *url, const char *payload, int payload_len, COAP_CONTENT_TYPE type, uint32_t min_interval_ms);
+
+    /**
+     * @brief Answers a request with one block of a large resource (Block2).
+     *
+     * The block asked for by the request's Block2 option (block 0 if absent)
+     * is read through reader straight into the transmit buffer. The block
+     * size is reduced when it does not fit the buffer.
+     */
+    uint16_t sendBlockResponse(IPAddress ip, int port, CoapPacket &request, CoapBlockReader reader, size_t total_len, COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type);
+
+    /**
+     * @brief Consumes one block of a request body (Block1).
+     *
+     * The request payload is passed to writer at its offset. When more
+     * blocks follow, a 2.31 Continue is sent and false is returned; once the
+     * last block (or a request without Block1) has been written it returns
+     * true and the handler sends the final response, which must echo the
+     * Block1 option (RFC 7959 section 2.3): with sendBlockComplete(), or
+     * with CoapResponseWriter::block1() on a reply().
+     */
+    bool receiveBlock(IPAddress ip, int port, CoapPacket &request, CoapBlockWriter writer);
+    uint16_t sendBlockComplete(IPAddress ip, int port, CoapPacket &request, COAP_RESPONSE_CODE code,
+                               const char *payload = NULL, size_t payloadlen = 0, COAP_CONTENT_TYPE type = COAP_NONE);
+
+    /**
+     * @brief Counters and timings, or NULL when Traits::STATS is off.
+     *
+     * A GET of /.well-known/stats that no route claims is answered with
+     * them in CBOR. sendStats() serves them from a handler at another path.
+     */
+    const CoapStats *getStats() const { return stats.operator->(); }
+    void resetStats()
+    {
+        if (Traits::STATS)
+            stats->reset();
+    }
+    uint16_t sendStats(IPAddress ip, int port, CoapPacket &request);
+
+    /**
+     * @brief The packet trace, or NULL when Traits::TRACE is off.
+     *
+     * A GET of /.well-known/trace that no route claims is answered with it
+     * as a pcap file, block-wise if it does not fit the buffer. sendTrace()
+     * serves it from a handler at another path, and dumpTrace() writes it to
+     * Serial or any other sink with write(const uint8_t *, size_t).
+     */
+    const CoapTrace *getTrace() const { return trace.operator->(); }
+    void resetTrace()
+    {
+        if (Traits::TRACE)
+            trace->reset();
+    }
+    uint16_t sendTrace(IPAddress ip, int port, CoapPacket &request);
+    template <class Sink>
+    size_t dumpTrace(Sink &out) const
+    {
+        return Traits::TRACE ? trace->dump(out) : 0;
+    }
+
+    /**
+     * @brief The initial retransmission timeout of the next CON message to
+     * ip:port, COAP_ACK_TIMEOUT_MS until RTTs have been measured or when
+     * Traits::CONGESTION is off.
+     */
+    uint32_t retransmitTimeout(IPAddress ip, int port) const;
 
     bool addObserver(const char *url, IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen);
     bool removeObserver(const char *url, IPAddress ip, int port, const uint8_t *token, uint8_t tokenlen);
@@ -299,7 +1712,81 @@ public:
     uint16_t send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type);
     uint16_t send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *token, uint8_t tokenlen, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type, uint16_t messageid);
 
+    /**
+     * @brief Sends a request whose response is delivered to callback.
+     *
+     * The request gets its own token and a slot in the transaction table, so
+     * any number of requests (up to MAX_TRANSACTIONS) can be in flight and
+     * each response, piggybacked or separate, reaches its own callback. The
+     * callback runs once from loop(); with a NULL response if the request
+     * timed out, was reset or was cancelled.
+     *
+     * A request to a multicast address is sent NON. With Traits::MULTICAST
+     * the callback then runs for every response, and once more with NULL
+     * when Traits::MULTICAST_LEISURE_MS plus COAP_ACK_TIMEOUT_MS have passed.
+     *
+     * @return a handle for cancel(), or 0 if the table is full or the
+     *         request could not be encoded.
+     */
+    uint16_t send(IPAddress ip, int port, const char *url, COAP_TYPE type, COAP_METHOD method, const uint8_t *payload, size_t payloadlen, COAP_CONTENT_TYPE content_type, CoapResponseCallback callback, void *context = NULL);
+    uint16_t get(IPAddress ip, int port, const char *url, CoapResponseCallback callback, void *context = NULL);
+
+    /**
+     * @brief Sends a request built by the caller, e.g. with a Proxy-Uri.
+     *
+     * Its token and message ID are set here; the rest of request, options
+     * included, is sent as it is. Otherwise as send() with a url.
+     */
+    uint16_t send(IPAddress ip, int port, CoapPacket &request, CoapResponseCallback callback, void *context = NULL);
+    uint16_t put(IPAddress ip, int port, const char *url, const char *payload, size_t payloadlen, CoapResponseCallback callback, void *context = NULL);
+
+    /**
+     * @brief Drops an outstanding request; its callback gets a NULL response.
+     * @return false if the handle is no longer outstanding.
+     */
+    bool cancel(uint16_t handle);
+
+    /**
+     * @brief Block-wise client requests (RFC 7959).
+     *
+     * getBlockwise() downloads a resource block by block into writer and
+     * sendBlockwise()/putBlockwise() upload total_len bytes pulled from
+     * reader. The next block is requested from loop() as each response
+     * arrives; the response callback only sees the final response. url must
+     * stay valid until then. Only one transfer runs at a time; 0 is returned
+     * while another one is in progress.
+     */
+    uint16_t getBlockwise(IPAddress ip, int port, const char *url, CoapBlockWriter writer);
+    uint16_t putBlockwise(IPAddress ip, int port, const char *url, CoapBlockReader reader, size_t total_len);
+    uint16_t sendBlockwise(IPAddress ip, int port, const char *url, COAP_METHOD method, CoapBlockReader reader, size_t total_len, COAP_CONTENT_TYPE content_type);
+
+    /**
+     * @brief Runs everything that is due: retransmissions, timeouts, lease
+     * expiry and held-back notifications, then the received datagrams.
+     *
+     * It does not block, so it has to be called often. To wait in
+     * poll()/epoll_wait() instead, call processReadable() when the socket is
+     * readable and processTimers() when timeUntilNextEvent() has passed.
+     */
     bool loop();
+    void processTimers();
+    bool processReadable();
+
+    /**
+     * @brief When processTimers() next has work, in millis() time.
+     * @return false if nothing is scheduled.
+     */
+    bool nextDeadline(unsigned long &deadline_ms) const;
+
+    /**
+     * @brief Milliseconds until processTimers() has work, 0 if it has work
+     * now, -1 if nothing is scheduled; usable as a poll() timeout.
+     */
+    long timeUntilNextEvent() const;
 };
 
+typedef BasicCoap<CoapDefaultTraits> Coap;
+
+#include "coap-simple-impl.h"
+
 #endif
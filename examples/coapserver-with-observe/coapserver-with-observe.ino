@@ -80,11 +80,11 @@ void endpoint_subscribe(CoapPacket &packet, IPAddress ip, int port)
     if (!packet.getObserveValue(observeValue))
     {
         // No (or invalid) Observe option: treat as a normal GET on an observable resource.
-        char payload[6]; // Max 5 digits for uint16_t + 1 for null terminator '\0'
-        sprintf(payload, "%u", 42);
-        int payload_len = strlen(payload);
-
-        coap.sendResponse(ip, port, packet.messageid, payload, payload_len, COAP_CONTENT, COAP_TEXT_PLAIN, packet.token, packet.tokenlen);
+        // The reply is written straight into the transmit buffer.
+        CoapResponseWriter out = coap.reply(packet, ip, port);
+        out.contentFormat(COAP_TEXT_PLAIN);
+        out.printf("%u", 42);
+        out.send();
         SERIAL_PRINTLN("Handled non-observe GET on /subscribe");
         return;
     }
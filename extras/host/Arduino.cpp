@@ -0,0 +1,62 @@
+#include "Arduino.h"
+
+#include <time.h>
+
+static struct timespec monotonicNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now;
+}
+
+// initialised once even when several threads call millis() first
+static struct timespec host_start()
+{
+    static const struct timespec start = monotonicNow();
+    return start;
+}
+
+static uint64_t elapsedMicros()
+{
+    struct timespec start = host_start();
+    struct timespec now = monotonicNow();
+    return (uint64_t)(now.tv_sec - start.tv_sec) * 1000000ULL + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+unsigned long millis()
+{
+    return (unsigned long)(elapsedMicros() / 1000);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)elapsedMicros();
+}
+
+void delay(unsigned long ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+long random(long howbig)
+{
+    if (howbig == 0)
+        return 0;
+    return rand() % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+    if (howsmall >= howbig)
+        return howsmall;
+    return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+    if (seed != 0)
+        srand(seed);
+}
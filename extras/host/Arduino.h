@@ -0,0 +1,28 @@
+/*
+ * Minimal Arduino core shim for building coap-simple on a POSIX host.
+ *
+ * Only the parts of the Arduino API that the library and the host tools
+ * use are provided here.
+ */
+#ifndef __COAP_HOST_ARDUINO_H__
+#define __COAP_HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "WString.h"
+#include "IPAddress.h"
+
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+#endif
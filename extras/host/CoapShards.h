@@ -0,0 +1,196 @@
+/*
+ * Multi-core CoAP server for a Linux host.
+ *
+ * Each of N worker threads owns a PosixUDP socket and a BasicCoap instance.
+ * All the sockets are bound to one port with SO_REUSEPORT, and the kernel
+ * picks the socket for a datagram from a hash of its source address and
+ * port. Every message of one client endpoint therefore reaches the same
+ * shard, so its duplicate cache entries and observer registrations live
+ * there, partitioned by endpoint, and the packet path takes no lock.
+ *
+ * Routes are registered once with server() before start(); the shards
+ * dispatch through that one table read-only. A handler answers through
+ * current(), the instance of the thread it runs on:
+ *
+ *   void callback_light(CoapPacket &packet, IPAddress ip, int port)
+ *   {
+ *       CoapShards::current().sendResponse(ip, port, packet.messageid, "1");
+ *   }
+ *
+ *   CoapShards shards(4);
+ *   shards.server(callback_light, "light");
+ *   shards.start(5683);
+ *
+ * Work that must run on a shard, such as notify() for the observers it
+ * holds, goes in the onLoop() hook, which every thread calls after each
+ * loop() pass.
+ *
+ * The shards are servers only. A request a shard sends with get(), put()
+ * or send() leaves from the shared port, and its response is hashed like
+ * any other datagram, so it may reach a shard with no record of the
+ * transaction and be rejected there. Client traffic belongs on a separate
+ * socket and Coap instance.
+ */
+#ifndef __COAP_HOST_COAPSHARDS_H__
+#define __COAP_HOST_COAPSHARDS_H__
+
+#include <coap-simple.h>
+#include "PosixUDP.h"
+
+#include <poll.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifndef COAP_SHARD_POLL_MS
+#define COAP_SHARD_POLL_MS 10
+#endif
+
+template <class Traits = CoapDefaultTraits>
+class BasicCoapShards
+{
+public:
+    typedef BasicCoap<Traits> Instance;
+    typedef void (*LoopHook)(Instance &coap, int shard);
+
+    /**
+     * @param count number of worker threads, 0 for one per core.
+     * @param batch PosixUDP recvmmsg/sendmmsg batch size of every shard.
+     */
+    explicit BasicCoapShards(int count = 0, int batch = 1);
+    ~BasicCoapShards() { stop(); }
+
+    /**
+     * @brief Registers a route for all shards. Call before start().
+     */
+    void server(CoapCallback c, const char *url) { shards[0]->coap.server(c, url); }
+    void response(CoapCallback c);
+    void onLoop(LoopHook hook) { loop_hook = hook; }
+
+    /**
+     * @brief Binds every shard to port and starts the threads.
+     * @return false if a socket cannot be bound; no thread is left running.
+     */
+    bool start(int port);
+    void stop();
+
+    int count() const { return (int)shards.size(); }
+    Instance &shard(int i) { return shards[i]->coap; }
+
+    /**
+     * @brief The instance of the calling shard thread, for use in handlers
+     * and the loop hook.
+     */
+    static Instance &current() { return *current_shard; }
+
+private:
+    struct Shard
+    {
+        PosixUDP udp;
+        Instance coap;
+        std::thread thread;
+        Shard() : coap(udp) {}
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<bool> running;
+    LoopHook loop_hook = NULL;
+    int batch;
+
+    static thread_local Instance *current_shard;
+
+    void run(int i);
+};
+
+template <class Traits>
+thread_local BasicCoap<Traits> *BasicCoapShards<Traits>::current_shard = NULL;
+
+template <class Traits>
+BasicCoapShards<Traits>::BasicCoapShards(int count, int batch) : running(false), batch(batch)
+{
+    if (count <= 0)
+        count = (int)std::thread::hardware_concurrency();
+    if (count <= 0)
+        count = 1;
+    for (int i = 0; i < count; i++)
+    {
+        shards.emplace_back(new Shard());
+        if (i > 0)
+            shards[i]->coap.shareRoutes(shards[0]->coap);
+    }
+}
+
+template <class Traits>
+void BasicCoapShards<Traits>::response(CoapCallback c)
+{
+    for (auto &s : shards)
+        s->coap.response(c);
+}
+
+template <class Traits>
+bool BasicCoapShards<Traits>::start(int port)
+{
+    if (running)
+        return false;
+
+    for (auto &s : shards)
+    {
+        s->udp.setReusePort(true);
+        if (!s->coap.start(port))
+        {
+            for (auto &bound : shards)
+                bound->udp.stop();
+            return false;
+        }
+        s->udp.setBatchSize(batch);
+    }
+
+    running = true;
+    for (int i = 0; i < count(); i++)
+        shards[i]->thread = std::thread(&BasicCoapShards::run, this, i);
+    return true;
+}
+
+template <class Traits>
+void BasicCoapShards<Traits>::stop()
+{
+    running = false;
+    for (auto &s : shards)
+    {
+        if (s->thread.joinable())
+            s->thread.join();
+        s->udp.stop();
+    }
+}
+
+template <class Traits>
+void BasicCoapShards<Traits>::run(int i)
+{
+    Shard &s = *shards[i];
+    current_shard = &s.coap;
+
+    struct pollfd pfd;
+    pfd.fd = s.udp.fd();
+    pfd.events = POLLIN;
+
+    // sleep until a datagram or the next retransmission or expiry; the
+    // cap bounds how long stop() waits
+    while (running.load(std::memory_order_relaxed))
+    {
+        long timeout = s.coap.timeUntilNextEvent();
+        if (timeout < 0 || timeout > COAP_SHARD_POLL_MS)
+            timeout = COAP_SHARD_POLL_MS;
+        pfd.revents = 0;
+        poll(&pfd, 1, (int)timeout);
+        s.coap.loop();
+        if (loop_hook != NULL)
+            loop_hook(s.coap, i);
+    }
+    current_shard = NULL;
+}
+
+typedef BasicCoapShards<CoapDefaultTraits> CoapShards;
+
+#endif
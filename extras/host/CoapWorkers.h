@@ -0,0 +1,541 @@
+/*
+ * CoAP server with a handler thread pool for a Linux host.
+ *
+ * One I/O thread owns the socket and a BasicCoap instance, which keeps
+ * duplicate detection, retransmission and observers single-threaded as
+ * usual. Requests for a route are taken from Coap::loop() through
+ * Coap::handOff() and run on a pool of worker threads, so CPU-heavy
+ * handlers (CBOR encoding, signatures) use more than one core.
+ *
+ * A request travels in a slot. The datagram is read straight into the
+ * slot's buffer and the parsed CoapPacket points into it, so the slot owns
+ * the request until its reply has been sent; the I/O thread gets the spare
+ * buffer of the slot for the next datagram in exchange. Slots are queued
+ * on one bounded lock-free ring per worker, and an idle worker steals from
+ * the rings of the others. The handler encodes its reply into the slot,
+ * which returns to the I/O thread through a completion ring and is sent
+ * with Coap::sendReply(). When every slot is busy new requests get 5.03.
+ *
+ * Handlers must not call the Coap instance; they reply through current():
+ *
+ *   void callback_sign(CoapPacket &packet, IPAddress ip, int port)
+ *   {
+ *       ...
+ *       CoapWorkers::current().sendResponse(ip, port, packet.messageid, sig, siglen,
+ *                                           COAP_CONTENT, COAP_APPLICATION_OCTET_STREAM,
+ *                                           packet.token, packet.tokenlen);
+ *   }
+ *
+ *   CoapWorkers workers(4);
+ *   workers.server(callback_sign, "sign");
+ *   workers.start(5683);
+ */
+#ifndef __COAP_HOST_COAPWORKERS_H__
+#define __COAP_HOST_COAPWORKERS_H__
+
+#include <coap-simple.h>
+#include "PosixUDP.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Requests that can be queued or running at once.
+#ifndef COAP_WORKER_SLOTS
+#define COAP_WORKER_SLOTS 256
+#endif
+#ifndef COAP_WORKER_POLL_MS
+#define COAP_WORKER_POLL_MS 10
+#endif
+// Empty passes over the rings before a worker goes to sleep.
+#ifndef COAP_WORKER_SPIN
+#define COAP_WORKER_SPIN 256
+#endif
+
+/**
+ * @brief Bounded lock-free multi-producer multi-consumer ring.
+ *
+ * Each cell carries a sequence number that tells producers and consumers
+ * whether it is free or full for their lap of the ring, so push() and pop()
+ * only contend on one atomic counter each (D. Vyukov's bounded queue).
+ */
+template <class T, uint16_t Capacity>
+class CoapRing
+{
+private:
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    Cell cells[Capacity];
+    // on separate cache lines, producers and consumers run on other cores
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) std::atomic<size_t> head;
+
+public:
+    CoapRing() : tail(0), head(0)
+    {
+        for (size_t i = 0; i < Capacity; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const T &value)
+    {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells[pos & (Capacity - 1)];
+            intptr_t diff = (intptr_t)cell.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // full
+            else
+                pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool pop(T &value)
+    {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells[pos & (Capacity - 1)];
+            intptr_t diff = (intptr_t)cell.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = cell.value;
+                    cell.seq.store(pos + Capacity, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // empty
+            else
+                pos = head.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+template <class Traits = CoapDefaultTraits>
+class BasicCoapWorkers
+{
+private:
+    static const uint16_t SLOTS = COAP_WORKER_SLOTS;
+    static const uint16_t RING_SIZE = coapTableSize(SLOTS) / 2;
+    static_assert(SLOTS > 0 && SLOTS <= 0x4000, "COAP_WORKER_SLOTS out of range");
+
+public:
+    typedef BasicCoap<Traits> Instance;
+
+    /**
+     * @brief A request on its way through the pool.
+     *
+     * current() returns the slot of the request the calling worker is
+     * handling. Its sendResponse() takes the arguments of
+     * Coap::sendResponse(), and reply() encodes the response in the slot
+     * like Coap::reply(); only the first reply of a handler is sent. Both
+     * piggyback it on the ACK of a CON request and answer a NON request
+     * with a NON response. That is where the slot's sendResponse()
+     * differs from Coap::sendResponse(), which only sees the message ID
+     * and always sends an ACK.
+     */
+    class Slot
+    {
+    public:
+        uint16_t sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload);
+        uint16_t sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen,
+                              COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type, const uint8_t *token, int tokenlen);
+        CoapResponseWriter reply(COAP_RESPONSE_CODE code = COAP_CONTENT);
+
+    private:
+        friend class BasicCoapWorkers;
+
+        static uint16_t queueWritten(void *owner, CoapResponseWriter &writer);
+
+        CoapCallback callback = NULL;
+        CoapPacket request;
+        IPAddress ip;
+        uint16_t port = 0;
+        // the datagram of request while queued, a spare buffer while free
+        uint8_t *rx = NULL;
+        uint16_t txlen = 0;
+        uint8_t tx[Traits::BUF_MAX_SIZE];
+    };
+
+    /**
+     * @param threads number of handler threads, 0 for one per core.
+     * @param batch PosixUDP recvmmsg/sendmmsg batch size of the I/O thread.
+     */
+    explicit BasicCoapWorkers(int threads = 0, int batch = 1);
+    ~BasicCoapWorkers();
+
+    /**
+     * @brief Registers a route. Call before start().
+     */
+    void server(CoapCallback c, const char *url) { coap.server(c, url); }
+
+    /**
+     * @brief Binds port and starts the I/O thread and the workers.
+     */
+    bool start(int port);
+    void stop();
+
+    int count() const { return (int)workers.size(); }
+
+    /**
+     * @brief The slot of the request the calling worker is handling.
+     */
+    static Slot &current() { return *current_slot; }
+
+private:
+    struct Worker
+    {
+        CoapRing<uint16_t, RING_SIZE> queue;
+        std::thread thread;
+    };
+
+    PosixUDP udp;
+    Instance coap;
+    int batch;
+    std::thread io_thread;
+    std::atomic<bool> running;
+
+    // Slots and their buffers are allocated once; free slots are only
+    // touched by the I/O thread, so their list needs no synchronisation.
+    std::unique_ptr<Slot[]> slots;
+    std::unique_ptr<uint8_t[]> buffers;
+    std::vector<uint16_t> free_slots;
+    // buffer the next datagram is read into, owned by the I/O thread
+    uint8_t *io_buffer = NULL;
+    unsigned next_worker = 0;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    CoapRing<uint16_t, RING_SIZE> done;
+
+    // Idle workers sleep on park; the I/O thread sleeps in poll() and is
+    // woken through wake_fd when a reply is ready.
+    std::mutex park_lock;
+    std::condition_variable park;
+    std::atomic<int> parked;
+    std::atomic<bool> io_waiting;
+    int wake_fd = -1;
+
+    static thread_local Slot *current_slot;
+
+    static uint8_t *take(CoapCallback callback, CoapPacket &request, IPAddress ip, int port, void *context);
+    bool steal(unsigned self, uint16_t &n);
+    void flushReplies();
+    void runIO();
+    void runWorker(unsigned i);
+};
+
+template <class Traits>
+thread_local typename BasicCoapWorkers<Traits>::Slot *BasicCoapWorkers<Traits>::current_slot = NULL;
+
+template <class Traits>
+BasicCoapWorkers<Traits>::BasicCoapWorkers(int threads, int batch)
+    : coap(udp), batch(batch), running(false), parked(0), io_waiting(false)
+{
+    if (threads <= 0)
+        threads = (int)std::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 1;
+    for (int i = 0; i < threads; i++)
+        workers.emplace_back(new Worker());
+
+    // one buffer per slot, and one for the I/O thread
+    size_t size = coap.bufferSize();
+    slots.reset(new Slot[SLOTS]);
+    buffers.reset(new uint8_t[(SLOTS + 1) * size]);
+    free_slots.reserve(SLOTS);
+    for (uint16_t n = 0; n < SLOTS; n++)
+    {
+        slots[n].rx = buffers.get() + n * size;
+        free_slots.push_back(SLOTS - 1 - n);
+    }
+    io_buffer = buffers.get() + SLOTS * size;
+}
+
+template <class Traits>
+BasicCoapWorkers<Traits>::~BasicCoapWorkers()
+{
+    stop();
+    coap.handOff(NULL, NULL, NULL);
+}
+
+template <class Traits>
+bool BasicCoapWorkers<Traits>::start(int port)
+{
+    if (running)
+        return false;
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0)
+        return false;
+    if (!coap.start(port) || udp.fd() < 0)
+    {
+        close(wake_fd);
+        wake_fd = -1;
+        return false;
+    }
+    udp.setBatchSize(batch);
+    coap.handOff(take, this, io_buffer);
+
+    running = true;
+    for (unsigned i = 0; i < workers.size(); i++)
+        workers[i]->thread = std::thread(&BasicCoapWorkers::runWorker, this, i);
+    io_thread = std::thread(&BasicCoapWorkers::runIO, this);
+    return true;
+}
+
+template <class Traits>
+void BasicCoapWorkers<Traits>::stop()
+{
+    if (!running)
+        return;
+    running = false;
+    {
+        std::lock_guard<std::mutex> guard(park_lock);
+        park.notify_all();
+    }
+    for (auto &w : workers)
+        w->thread.join();
+    io_thread.join();
+
+    // replies of requests that were still queued are dropped
+    uint16_t n;
+    for (auto &w : workers)
+        while (w->queue.pop(n))
+            free_slots.push_back(n);
+    while (done.pop(n))
+        free_slots.push_back(n);
+    udp.stop();
+    close(wake_fd);
+    wake_fd = -1;
+}
+
+// Coap::handOff() hook, runs on the I/O thread inside Coap::loop().
+template <class Traits>
+uint8_t *BasicCoapWorkers<Traits>::take(CoapCallback callback, CoapPacket &request, IPAddress ip, int port, void *context)
+{
+    BasicCoapWorkers &self = *(BasicCoapWorkers *)context;
+    if (self.free_slots.empty())
+        return NULL;
+
+    uint16_t n = self.free_slots.back();
+    self.free_slots.pop_back();
+    Slot &slot = self.slots[n];
+    slot.callback = callback;
+    slot.request = request;
+    slot.ip = ip;
+    slot.port = (uint16_t)port;
+    slot.txlen = 0;
+
+    // the request stays in the buffer it was read into, the slot's spare
+    // buffer takes its place
+    uint8_t *spare = slot.rx;
+    slot.rx = self.io_buffer;
+    self.io_buffer = spare;
+
+    // a ring holds every slot, so the push cannot fail
+    self.workers[self.next_worker++ % self.workers.size()]->queue.push(n);
+    // pairs with the fence of a parking worker: either it sees this request
+    // or this sees it parked (a store then a load needs a full fence)
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (self.parked.load(std::memory_order_relaxed) > 0)
+    {
+        std::lock_guard<std::mutex> guard(self.park_lock);
+        self.park.notify_one();
+    }
+    return self.io_buffer;
+}
+
+template <class Traits>
+bool BasicCoapWorkers<Traits>::steal(unsigned self, uint16_t &n)
+{
+    for (unsigned i = 0; i < workers.size(); i++)
+        if (workers[(self + i) % workers.size()]->queue.pop(n))
+            return true;
+    return false;
+}
+
+template <class Traits>
+void BasicCoapWorkers<Traits>::runWorker(unsigned i)
+{
+    int idle = 0;
+    while (running.load(std::memory_order_relaxed))
+    {
+        uint16_t n;
+        if (!steal(i, n))
+        {
+            if (++idle < COAP_WORKER_SPIN)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            // re-check after announcing the sleep, a push in between notifies
+            std::unique_lock<std::mutex> guard(park_lock);
+            parked.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!steal(i, n))
+            {
+                park.wait_for(guard, std::chrono::milliseconds(COAP_WORKER_POLL_MS));
+                parked.fetch_sub(1, std::memory_order_acq_rel);
+                continue;
+            }
+            parked.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        idle = 0;
+
+        Slot &slot = slots[n];
+        current_slot = &slot;
+        slot.callback(slot.request, slot.ip, slot.port);
+        current_slot = NULL;
+
+        done.push(n);
+        // pairs with the fence in runIO(): either the I/O thread's flush
+        // finds this reply or this sees io_waiting set and wakes it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (io_waiting.load(std::memory_order_relaxed))
+        {
+            // a failed write means the counter is already set
+            uint64_t one = 1;
+            (void)!write(wake_fd, &one, sizeof(one));
+        }
+    }
+}
+
+template <class Traits>
+void BasicCoapWorkers<Traits>::flushReplies()
+{
+    uint16_t n;
+    while (done.pop(n))
+    {
+        Slot &slot = slots[n];
+        if (slot.txlen > 0)
+            coap.sendReply(slot.ip, slot.port, slot.request.messageid, slot.tx, slot.txlen);
+        free_slots.push_back(n);
+    }
+    udp.flushBatch();
+}
+
+template <class Traits>
+void BasicCoapWorkers<Traits>::runIO()
+{
+    struct pollfd pfd[2];
+    pfd[0].fd = udp.fd();
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wake_fd;
+    pfd[1].events = POLLIN;
+
+    while (running.load(std::memory_order_relaxed))
+    {
+        // workers only write wake_fd while io_waiting is set, and a reply
+        // pushed before it was set is found by the flush below; the store
+        // and the pops are kept in order by the fence
+        io_waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        flushReplies();
+        long timeout = coap.timeUntilNextEvent();
+        if (timeout < 0 || timeout > COAP_WORKER_POLL_MS)
+            timeout = COAP_WORKER_POLL_MS;
+        pfd[0].revents = pfd[1].revents = 0;
+        poll(pfd, 2, (int)timeout);
+        io_waiting.store(false, std::memory_order_relaxed);
+        if (pfd[1].revents & POLLIN)
+        {
+            uint64_t count;
+            (void)!read(wake_fd, &count, sizeof(count));
+        }
+
+        coap.loop();
+        flushReplies();
+    }
+}
+
+template <class Traits>
+uint16_t BasicCoapWorkers<Traits>::Slot::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload)
+{
+    return sendResponse(ip, port, messageid, payload, strlen(payload), COAP_CONTENT, COAP_TEXT_PLAIN, NULL, 0);
+}
+
+template <class Traits>
+uint16_t BasicCoapWorkers<Traits>::Slot::sendResponse(IPAddress ip, int port, uint16_t messageid, const char *payload, size_t payloadlen,
+                                                       COAP_RESPONSE_CODE code, COAP_CONTENT_TYPE type, const uint8_t *token, int tokenlen)
+{
+    // the reply goes to the sender of the request, once
+    if (txlen > 0 || port != this->port || !(ip == this->ip))
+        return 0;
+
+    // a NON request gets a NON reply, its message ID is filled in by
+    // Coap::sendReply() on the I/O thread
+    bool con = request.type == COAP_CON;
+    CoapPacket packet;
+    packet.type = con ? COAP_ACK : COAP_NONCON;
+    packet.code = code;
+    packet.token = token;
+    packet.tokenlen = tokenlen;
+    packet.messageid = con ? messageid : 0;
+
+    uint8_t formatBuf[3];
+    if (payloadlen > 0 && type != COAP_NONE)
+        packet.addOption(COAP_CONTENT_FORMAT, coapEncodeUint(type, formatBuf), formatBuf);
+
+    uint16_t len = packet.encode(tx, sizeof(tx));
+    if (len == 0)
+        return 0;
+    if (payloadlen > 0)
+    {
+        if (len + 1 + payloadlen >= sizeof(tx))
+            return 0;
+        tx[len] = 0xFF;
+        memcpy(tx + len + 1, payload, payloadlen);
+        len += 1 + payloadlen;
+    }
+    txlen = len;
+    return messageid;
+}
+
+template <class Traits>
+CoapResponseWriter BasicCoapWorkers<Traits>::Slot::reply(COAP_RESPONSE_CODE code)
+{
+    // typed like sendResponse(); message IDs belong to the I/O thread
+    bool con = request.type == COAP_CON;
+    return CoapResponseWriter(txlen == 0 ? tx : NULL, sizeof(tx), con ? COAP_ACK : COAP_NONCON, code,
+                              con ? request.messageid : 0, request.token, request.tokenlen, ip, port, queueWritten, this);
+}
+
+template <class Traits>
+uint16_t BasicCoapWorkers<Traits>::Slot::queueWritten(void *owner, CoapResponseWriter &writer)
+{
+    Slot *slot = (Slot *)owner;
+    if (slot->txlen > 0)
+        return 0;
+    slot->txlen = writer.length();
+    return slot->request.messageid;
+}
+
+typedef BasicCoapWorkers<CoapDefaultTraits> CoapWorkers;
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * IPv4 IPAddress shim compatible with the Arduino core class.
+ */
+#ifndef __COAP_HOST_IPADDRESS_H__
+#define __COAP_HOST_IPADDRESS_H__
+
+#include <stdint.h>
+
+class IPAddress
+{
+private:
+    union
+    {
+        uint8_t bytes[4];
+        uint32_t dword;
+    } _address;
+
+public:
+    IPAddress() { _address.dword = 0; }
+    IPAddress(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+    {
+        _address.bytes[0] = b0;
+        _address.bytes[1] = b1;
+        _address.bytes[2] = b2;
+        _address.bytes[3] = b3;
+    }
+    // Network byte order, as in the Arduino core.
+    IPAddress(uint32_t address) { _address.dword = address; }
+    IPAddress(const uint8_t *address)
+    {
+        for (int i = 0; i < 4; i++)
+            _address.bytes[i] = address[i];
+    }
+
+    operator uint32_t() const { return _address.dword; }
+    bool operator==(const IPAddress &addr) const { return _address.dword == addr._address.dword; }
+    bool operator!=(const IPAddress &addr) const { return _address.dword != addr._address.dword; }
+    uint8_t operator[](int index) const { return _address.bytes[index]; }
+    uint8_t &operator[](int index) { return _address.bytes[index]; }
+};
+
+#endif
@@ -0,0 +1,22 @@
+#include "PosixFile.h"
+
+bool PosixFile::open(const char *path)
+{
+    close();
+    _file = fopen(path, "wb");
+    return _file != NULL;
+}
+
+size_t PosixFile::write(const uint8_t *buffer, size_t size)
+{
+    if (_file == NULL)
+        return 0;
+    return fwrite(buffer, 1, size, _file);
+}
+
+void PosixFile::close()
+{
+    if (_file != NULL)
+        fclose(_file);
+    _file = NULL;
+}
@@ -0,0 +1,30 @@
+/*
+ * Write-only file with the write() of an Arduino File or Print, so what a
+ * board sends to Serial or an SD card can go to a file on a Linux host, for
+ * instance Coap::dumpTrace() into a pcap file that Wireshark opens.
+ */
+#ifndef __COAP_HOST_POSIXFILE_H__
+#define __COAP_HOST_POSIXFILE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+class PosixFile
+{
+private:
+    FILE *_file = NULL;
+
+public:
+    PosixFile() {}
+    ~PosixFile() { close(); }
+
+    // creates or truncates path
+    bool open(const char *path);
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    void close();
+    operator bool() const { return _file != NULL; }
+};
+
+#endif
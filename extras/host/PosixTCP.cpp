@@ -0,0 +1,199 @@
+#include "PosixTCP.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void toSockaddr(IPAddress ip, uint16_t port, struct sockaddr_in *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = (uint32_t)ip;
+    addr->sin_port = htons(port);
+}
+
+// Coap::loop() polls, so reads must never block.
+static void setNonBlocking(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+void PosixTCPClient::adopt(int fd, IPAddress ip, uint16_t port)
+{
+    stop();
+    _fd = fd;
+    remote_ip = ip;
+    remote_port = port;
+    setNonBlocking(_fd);
+}
+
+int PosixTCPClient::connect(IPAddress ip, uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return 0;
+
+    struct sockaddr_in addr;
+    toSockaddr(ip, port, &addr);
+    if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+    adopt(fd, ip, port);
+    return 1;
+}
+
+int PosixTCPClient::connect(const char *host, uint16_t port)
+{
+    struct in_addr in;
+    if (inet_pton(AF_INET, host, &in) != 1)
+        return 0;
+    return connect(IPAddress((uint32_t)in.s_addr), port);
+}
+
+size_t PosixTCPClient::write(const uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    while (_fd >= 0 && done < size)
+    {
+        ssize_t n = send(_fd, buf + done, size - done, MSG_NOSIGNAL);
+        if (n > 0)
+            done += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // a peer that has stopped reading gets a short write
+            struct pollfd pfd = {_fd, POLLOUT, 0};
+            if (poll(&pfd, 1, POSIX_TCP_WRITE_TIMEOUT_MS) == 0)
+                break;
+        }
+        else
+            break;
+    }
+    return done;
+}
+
+int PosixTCPClient::available()
+{
+    int n = 0;
+    if (_fd < 0 || ioctl(_fd, FIONREAD, &n) < 0)
+        n = 0;
+    return (int)(rx_len - rx_pos) + n;
+}
+
+int PosixTCPClient::read()
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int PosixTCPClient::read(uint8_t *buf, size_t size)
+{
+    if (_fd < 0)
+        return -1;
+
+    // a small read refills the buffer with whatever has arrived
+    if (rx_pos == rx_len && size < sizeof(rx))
+    {
+        rx_pos = rx_len = 0;
+        ssize_t n = recv(_fd, rx, sizeof(rx), MSG_DONTWAIT);
+        if (n > 0)
+            rx_len = (size_t)n;
+    }
+
+    size_t done = rx_len - rx_pos < size ? rx_len - rx_pos : size;
+    memcpy(buf, rx + rx_pos, done);
+    rx_pos += done;
+    if (done < size)
+    {
+        ssize_t n = recv(_fd, buf + done, size - done, MSG_DONTWAIT);
+        if (n > 0)
+            done += n;
+        else if (done == 0)
+            return -1;
+    }
+    return (int)done;
+}
+
+int PosixTCPClient::peek()
+{
+    uint8_t b;
+    if (rx_pos < rx_len)
+        return rx[rx_pos];
+    if (_fd < 0 || recv(_fd, &b, 1, MSG_DONTWAIT | MSG_PEEK) != 1)
+        return -1;
+    return b;
+}
+
+void PosixTCPClient::stop()
+{
+    if (_fd >= 0)
+        close(_fd);
+    _fd = -1;
+    rx_pos = rx_len = 0;
+}
+
+uint8_t PosixTCPClient::connected()
+{
+    if (_fd < 0)
+        return 0;
+    // like the boards, unread data keeps a closed connection "connected"
+    if (rx_pos < rx_len)
+        return 1;
+    uint8_t b;
+    ssize_t n = recv(_fd, &b, 1, MSG_DONTWAIT | MSG_PEEK);
+    if (n > 0)
+        return 1;
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+bool PosixTCPServer::begin()
+{
+    stop();
+    _fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (_fd < 0)
+        return false;
+
+    int on = 1;
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    toSockaddr(IPAddress((uint32_t)htonl(INADDR_ANY)), _port, &addr);
+    if (bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(_fd, 16) < 0)
+    {
+        stop();
+        return false;
+    }
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+}
+
+void PosixTCPServer::stop()
+{
+    if (_fd >= 0)
+        close(_fd);
+    _fd = -1;
+}
+
+bool PosixTCPServer::accept(PosixTCPClient &client)
+{
+    if (_fd < 0)
+        return false;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd = ::accept(_fd, (struct sockaddr *)&addr, &addrlen);
+    if (fd < 0)
+        return false;
+    client.adopt(fd, IPAddress((uint32_t)addr.sin_addr.s_addr), ntohs(addr.sin_port));
+    return true;
+}
@@ -0,0 +1,91 @@
+/*
+ * TCP client and listening server on top of POSIX sockets, for running
+ * CoAP over TCP on a Linux host the way EthernetClient/WiFiClient and their
+ * servers are used on a board.
+ *
+ * Reads never block and are served from a buffer, so the messages that
+ * arrived together cost one recv(). A write waits while the kernel's send
+ * buffer is full, as on the boards, but gives up after
+ * POSIX_TCP_WRITE_TIMEOUT_MS without progress. The short count it returns
+ * makes Coap fail the send and close the connection, so a peer that stops
+ * reading cannot stall loop(). Nagle is off, so a message goes out when it
+ * is written.
+ */
+#ifndef __COAP_HOST_POSIXTCP_H__
+#define __COAP_HOST_POSIXTCP_H__
+
+#include "Client.h"
+
+#ifndef POSIX_TCP_RX_BUFFER
+#define POSIX_TCP_RX_BUFFER 8192
+#endif
+
+#ifndef POSIX_TCP_WRITE_TIMEOUT_MS
+#define POSIX_TCP_WRITE_TIMEOUT_MS 1000
+#endif
+
+class PosixTCPClient : public Client
+{
+private:
+    int _fd = -1;
+    IPAddress remote_ip;
+    uint16_t remote_port = 0;
+
+    // received and not read yet: rx[rx_pos, rx_len)
+    uint8_t rx[POSIX_TCP_RX_BUFFER];
+    size_t rx_pos = 0;
+    size_t rx_len = 0;
+
+    friend class PosixTCPServer;
+    void adopt(int fd, IPAddress ip, uint16_t port);
+
+public:
+    PosixTCPClient() {}
+    ~PosixTCPClient() { stop(); }
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    size_t write(uint8_t b) override { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buf, size_t size) override;
+    int peek() override;
+    void flush() override {}
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return _fd >= 0; }
+
+    IPAddress remoteIP() const { return remote_ip; }
+    uint16_t remotePort() const { return remote_port; }
+
+    /**
+     * @brief The socket descriptor, or -1 when not connected; wait on it
+     * for readability and call Coap::processReadable().
+     */
+    int fd() const { return _fd; }
+};
+
+class PosixTCPServer
+{
+private:
+    int _fd = -1;
+    uint16_t _port;
+
+public:
+    PosixTCPServer(uint16_t port) : _port(port) {}
+    ~PosixTCPServer() { stop(); }
+
+    bool begin();
+    void stop();
+
+    /**
+     * @brief Takes a pending connection into client, without blocking.
+     * @return false if none is pending.
+     */
+    bool accept(PosixTCPClient &client);
+
+    int fd() const { return _fd; }
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "PosixUDP.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void toSockaddr(IPAddress ip, uint16_t port, struct sockaddr_in *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = (uint32_t)ip;
+    addr->sin_port = htons(port);
+}
+
+// After a failed send: true if it is worth trying again, because it was
+// interrupted or the send buffer has made room in time.
+static bool retrySend(int fd)
+{
+    if (errno == EINTR)
+        return true;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    return poll(&pfd, 1, POSIX_UDP_SEND_TIMEOUT_MS) > 0;
+}
+
+uint8_t PosixUDP::begin(uint16_t port)
+{
+    return open(IPAddress((uint32_t)htonl(INADDR_ANY)), port);
+}
+
+uint8_t PosixUDP::beginMulticast(IPAddress group, uint16_t port)
+{
+    // bound to the group, so only datagrams sent to it arrive here
+    if (!open(group, port))
+        return 0;
+
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = (uint32_t)group;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+        stop();
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t PosixUDP::open(IPAddress address, uint16_t port)
+{
+    stop();
+
+    _fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (_fd < 0)
+        return 0;
+
+    int on = 1;
+    setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuse_port && setsockopt(_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        stop();
+        return 0;
+    }
+#ifdef IP_MULTICAST_ALL
+    // Linux hands group datagrams to every socket on the port, not only to
+    // members; a unicast socket must not see them as unicast requests.
+    int off = 0;
+    setsockopt(_fd, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off));
+#endif
+
+    struct sockaddr_in addr;
+    toSockaddr(address, port, &addr);
+    if (bind(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        stop();
+        return 0;
+    }
+
+    // Coap::loop() polls, so the socket must never block.
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) | O_NONBLOCK);
+    return 1;
+}
+
+void PosixUDP::stop()
+{
+    if (_fd >= 0)
+    {
+        flushBatch();
+        close(_fd);
+    }
+    _fd = -1;
+    rx_count = rx_next = 0;
+    rx_pos = 0;
+    tx_count = 0;
+    tx[0].len = 0;
+}
+
+void PosixUDP::setBatchSize(int n)
+{
+    flushBatch();
+    if (n < 1)
+        n = 1;
+    if (n > POSIX_UDP_MAX_BATCH)
+        n = POSIX_UDP_MAX_BATCH;
+    batch_size = n;
+}
+
+int PosixUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+    tx[tx_count].ip = ip;
+    tx[tx_count].port = port;
+    tx[tx_count].len = 0;
+    return 1;
+}
+
+int PosixUDP::beginPacket(const char *host, uint16_t port)
+{
+    struct in_addr in;
+    if (inet_pton(AF_INET, host, &in) != 1)
+        return 0;
+    return beginPacket(IPAddress((uint32_t)in.s_addr), port);
+}
+
+int PosixUDP::endPacket()
+{
+    if (_fd < 0)
+        return 0;
+
+    if (batch_size > 1)
+    {
+        // replies wait for the rest of the received batch, anything else
+        // goes out now
+        if (++tx_count < batch_size && rx_next < rx_count)
+            return 1;
+        int queued = tx_count;
+        return flushBatch() == queued ? 1 : 0;
+    }
+
+    Datagram &d = tx[0];
+    struct sockaddr_in addr;
+    toSockaddr(d.ip, d.port, &addr);
+    ssize_t n;
+    do
+        n = sendto(_fd, d.data, d.len, 0, (struct sockaddr *)&addr, sizeof(addr));
+    while (n < 0 && retrySend(_fd));
+    d.len = 0;
+    return n < 0 ? 0 : 1;
+}
+
+int PosixUDP::flushBatch()
+{
+    if (_fd < 0 || tx_count == 0)
+        return 0;
+
+    struct sockaddr_in addrs[POSIX_UDP_MAX_BATCH];
+    struct iovec iovs[POSIX_UDP_MAX_BATCH];
+    struct mmsghdr msgs[POSIX_UDP_MAX_BATCH];
+    memset(msgs, 0, sizeof(msgs[0]) * tx_count);
+
+    for (int i = 0; i < tx_count; i++)
+    {
+        toSockaddr(tx[i].ip, tx[i].port, &addrs[i]);
+        iovs[i].iov_base = tx[i].data;
+        iovs[i].iov_len = tx[i].len;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // sendmmsg() stops at the first datagram that fails; one that cannot
+    // be sent is skipped, the rest of the batch still goes out unless the
+    // send buffer stays full
+    int sent = 0;
+    int next = 0;
+    while (next < tx_count)
+    {
+        int n = sendmmsg(_fd, msgs + next, tx_count - next, 0);
+        if (n > 0)
+        {
+            sent += n;
+            next += n;
+            continue;
+        }
+        if (n < 0 && retrySend(_fd))
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        next++;
+    }
+
+    tx_count = 0;
+    tx[0].len = 0;
+    return sent;
+}
+
+size_t PosixUDP::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+size_t PosixUDP::write(const uint8_t *buffer, size_t size)
+{
+    Datagram &d = tx[tx_count];
+    if (size > sizeof(d.data) - d.len)
+        size = sizeof(d.data) - d.len;
+    memcpy(d.data + d.len, buffer, size);
+    d.len += size;
+    return size;
+}
+
+int PosixUDP::receiveBatch()
+{
+    struct sockaddr_in addrs[POSIX_UDP_MAX_BATCH];
+    struct iovec iovs[POSIX_UDP_MAX_BATCH];
+    struct mmsghdr msgs[POSIX_UDP_MAX_BATCH];
+    memset(msgs, 0, sizeof(msgs[0]) * batch_size);
+
+    for (int i = 0; i < batch_size; i++)
+    {
+        iovs[i].iov_base = rx[i].data;
+        iovs[i].iov_len = sizeof(rx[i].data);
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(_fd, msgs, batch_size, MSG_DONTWAIT, NULL);
+    if (n <= 0)
+        return 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        rx[i].len = msgs[i].msg_len;
+        rx[i].ip = IPAddress((uint32_t)addrs[i].sin_addr.s_addr);
+        rx[i].port = ntohs(addrs[i].sin_port);
+    }
+    return n;
+}
+
+int PosixUDP::parsePacket()
+{
+    rx_pos = 0;
+    if (_fd < 0)
+        return 0;
+
+    if (rx_next < rx_count)
+        return (int)rx[rx_next++].len;
+
+    rx_count = rx_next = 0;
+
+    if (batch_size > 1)
+    {
+        // everything produced while handling the previous batch goes out now
+        flushBatch();
+        rx_count = receiveBatch();
+        if (rx_count == 0)
+            return 0;
+        return (int)rx[rx_next++].len;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    ssize_t n = recvfrom(_fd, rx[0].data, sizeof(rx[0].data), 0, (struct sockaddr *)&addr, &addrlen);
+    if (n <= 0)
+        return 0;
+
+    rx[0].len = (size_t)n;
+    rx[0].ip = IPAddress((uint32_t)addr.sin_addr.s_addr);
+    rx[0].port = ntohs(addr.sin_port);
+    rx_count = rx_next = 1;
+    return (int)n;
+}
+
+int PosixUDP::available()
+{
+    Datagram *d = current();
+    return d ? (int)(d->len - rx_pos) : 0;
+}
+
+int PosixUDP::read()
+{
+    Datagram *d = current();
+    if (d == NULL || rx_pos >= d->len)
+        return -1;
+    return d->data[rx_pos++];
+}
+
+int PosixUDP::read(unsigned char *buffer, size_t len)
+{
+    Datagram *d = current();
+    if (d == NULL)
+        return 0;
+    size_t left = d->len - rx_pos;
+    if (len > left)
+        len = left;
+    memcpy(buffer, d->data + rx_pos, len);
+    rx_pos += len;
+    return (int)len;
+}
+
+int PosixUDP::peek()
+{
+    Datagram *d = current();
+    if (d == NULL || rx_pos >= d->len)
+        return -1;
+    return d->data[rx_pos];
+}
+
+IPAddress PosixUDP::remoteIP()
+{
+    Datagram *d = current();
+    return d ? d->ip : IPAddress();
+}
+
+uint16_t PosixUDP::remotePort()
+{
+    Datagram *d = current();
+    return d ? d->port : 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * UDP implementation on top of POSIX sockets, for running coap-simple on a
+ * Linux host in the same way EthernetUDP/WiFiUDP are used on a board.
+ *
+ * With setBatchSize(n > 1) datagrams are received n at a time with
+ * recvmmsg(), and the replies written while a batch is handed out are
+ * queued and sent together with sendmmsg() once its last datagram is read,
+ * or when the queue is full. Datagrams written outside of that, such as
+ * retransmissions, notify() or client requests, are sent at once, so the
+ * batching never holds anything back until the next datagram arrives.
+ * When the socket's send buffer is full, a send waits up to
+ * POSIX_UDP_SEND_TIMEOUT_MS for room before it gives up.
+ *
+ * With setReusePort(true) several sockets can be bound to one port. The
+ * kernel then hands each of them the datagrams of a fixed subset of remote
+ * endpoints, which is what CoapShards builds on.
+ */
+#ifndef __COAP_HOST_POSIXUDP_H__
+#define __COAP_HOST_POSIXUDP_H__
+
+#include "Udp.h"
+
+#ifndef POSIX_UDP_MAX_DATAGRAM
+#define POSIX_UDP_MAX_DATAGRAM 1500
+#endif
+#ifndef POSIX_UDP_MAX_BATCH
+#define POSIX_UDP_MAX_BATCH 32
+#endif
+#ifndef POSIX_UDP_SEND_TIMEOUT_MS
+#define POSIX_UDP_SEND_TIMEOUT_MS 100
+#endif
+
+class PosixUDP : public UDP
+{
+private:
+    struct Datagram
+    {
+        uint8_t data[POSIX_UDP_MAX_DATAGRAM];
+        size_t len = 0;
+        IPAddress ip;
+        uint16_t port = 0;
+    };
+
+    int _fd = -1;
+    int batch_size = 1;
+    bool reuse_port = false;
+
+    // received datagrams, rx[rx_next - 1] is the one being read
+    Datagram rx[POSIX_UDP_MAX_BATCH];
+    int rx_count = 0;
+    int rx_next = 0;
+    size_t rx_pos = 0;
+
+    // queued datagrams, tx[tx_count] is the one being built
+    Datagram tx[POSIX_UDP_MAX_BATCH];
+    int tx_count = 0;
+
+    Datagram *current() { return rx_next > 0 ? &rx[rx_next - 1] : NULL; }
+    int receiveBatch();
+    uint8_t open(IPAddress address, uint16_t port);
+
+public:
+    PosixUDP() {}
+    ~PosixUDP() { stop(); }
+
+    uint8_t begin(uint16_t port) override;
+    // joins group on the default interface, for Coap::joinGroup()
+    uint8_t beginMulticast(IPAddress group, uint16_t port) override;
+    void stop() override;
+
+    int beginPacket(IPAddress ip, uint16_t port) override;
+    int beginPacket(const char *host, uint16_t port) override;
+    int endPacket() override;
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+
+    int parsePacket() override;
+    int available() override;
+    int read() override;
+    int read(unsigned char *buffer, size_t len) override;
+    int read(char *buffer, size_t len) override { return read((unsigned char *)buffer, len); }
+    int peek() override;
+    void flush() override {}
+
+    IPAddress remoteIP() override;
+    uint16_t remotePort() override;
+
+    /**
+     * @brief Sets how many datagrams are moved per recvmmsg/sendmmsg call.
+     * @param n 1 (the default) sends and receives one datagram per syscall.
+     */
+    void setBatchSize(int n);
+
+    /**
+     * @brief Binds with SO_REUSEPORT, so other sockets can share the port.
+     * Takes effect on the next begin().
+     */
+    void setReusePort(bool on) { reuse_port = on; }
+
+    /**
+     * @brief Sends all queued datagrams.
+     * @return number of datagrams handed to the kernel; the others could
+     * not be sent and are dropped.
+     */
+    int flushBatch();
+
+    /**
+     * @brief The underlying socket descriptor, or -1 before begin().
+     *
+     * Wait on it for readability in poll()/epoll and call
+     * Coap::processReadable().
+     */
+    int fd() const { return _fd; }
+};
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Heap-backed String shim with the subset of the Arduino String API used by
+ * coap-simple. Storage comes from operator new[] so allocation accounting in
+ * the host tools sees it.
+ */
+#ifndef __COAP_HOST_WSTRING_H__
+#define __COAP_HOST_WSTRING_H__
+
+#include <stddef.h>
+#include <string.h>
+
+class String
+{
+private:
+    char *buffer = NULL;
+    unsigned int len = 0;
+
+    void copy(const char *cstr, unsigned int length)
+    {
+        char *next = new char[length + 1];
+        memcpy(next, cstr, length);
+        next[length] = 0;
+        delete[] buffer;
+        buffer = next;
+        len = length;
+    }
+
+public:
+    String(const char *cstr = "") { copy(cstr ? cstr : "", cstr ? strlen(cstr) : 0); }
+    String(const String &str) { copy(str.c_str(), str.len); }
+    ~String() { delete[] buffer; }
+
+    String &operator=(const String &rhs)
+    {
+        if (this != &rhs)
+            copy(rhs.c_str(), rhs.len);
+        return *this;
+    }
+    String &operator=(const char *cstr)
+    {
+        copy(cstr ? cstr : "", cstr ? strlen(cstr) : 0);
+        return *this;
+    }
+
+    String &operator+=(const char *cstr)
+    {
+        if (cstr == NULL)
+            return *this;
+        unsigned int add = strlen(cstr);
+        char *next = new char[len + add + 1];
+        memcpy(next, buffer, len);
+        memcpy(next + len, cstr, add + 1);
+        delete[] buffer;
+        buffer = next;
+        len += add;
+        return *this;
+    }
+    String &operator+=(const String &str) { return *this += str.c_str(); }
+
+    unsigned int length() const { return len; }
+    const char *c_str() const { return buffer; }
+    bool equals(const String &s) const { return len == s.len && memcmp(buffer, s.buffer, len) == 0; }
+    bool equals(const char *cstr) const { return cstr != NULL && strcmp(buffer, cstr) == 0; }
+    bool operator==(const String &rhs) const { return equals(rhs); }
+    bool operator==(const char *cstr) const { return equals(cstr); }
+};
+
+#endif
@@ -0,0 +1,784 @@
+/*
+ * Loopback benchmark for coap-simple on a POSIX host.
+ *
+ * A server and a client Coap instance talk to each other over 127.0.0.1 in
+ * one thread. Each scenario issues a window of requests, waits for all the
+ * responses and repeats. It reports requests/sec, p50/p99 window round-trip
+ * latency and heap bytes allocated per request (counted through the global
+ * operator new). The server takes its memory from a CoapArena whose
+ * high-water mark is printed at the end. -b sets the PosixUDP
+ * recvmmsg/sendmmsg batch size. Built with -DCOAP_STATS=1 it also prints
+ * the server counters and timings. Built with -DCOAP_TRACE=1, -o FILE writes
+ * the last messages of the server to FILE as pcap, for Wireshark.
+ *
+ * The tcp scenarios run a second server and client pair over a loopback
+ * TCP connection (RFC 8323), with buffers large enough for 4 KiB BERT
+ * blocks, so they compare with their UDP counterparts.
+ *
+ * -t N runs the sharded server instead: CoapShards with 1, 2, 4 ... N
+ * threads, loaded by as many client threads, each keeping
+ * COAP_MAX_TRANSACTIONS callback GETs in flight.
+ *
+ * -W N runs the pipeline server instead: CoapWorkers with 1, 2, 4 ... N
+ * handler threads behind one I/O thread, loaded by N client threads. -c
+ * adds that many microseconds of CPU work to every sharded or pipelined
+ * request, standing in for an expensive handler.
+ *
+ * usage: coap-bench [-n requests] [-s payload_size] [-p port] [-b batch] [-t threads] [-W workers] [-c work_us] [-o trace.pcap] [scenario...]
+ */
+#include <Arduino.h>
+#include <coap-simple.h>
+#include <coap-simple-coro.h>
+#include "CoapShards.h"
+#include "CoapWorkers.h"
+#include "PosixFile.h"
+#include "PosixTCP.h"
+#include "PosixUDP.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+// atomic, as the sharded run allocates from several threads
+static std::atomic<size_t> alloc_bytes(0);
+static std::atomic<size_t> alloc_count(0);
+
+static void *countedAlloc(size_t size)
+{
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static uint64_t nowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct BenchConfig
+{
+    int requests = 20000;
+    int warmup = 1000;
+    size_t payload_size = 16;
+    uint16_t port = 15683;
+    int batch = 1;
+    int threads = 0;
+    int workers = 0;
+    int work_us = 0;
+    const char *trace_file = NULL;
+};
+
+static BenchConfig config;
+static IPAddress loopback(127, 0, 0, 1);
+
+static PosixUDP server_udp;
+static PosixUDP client_udp;
+// the server runs out of a caller-supplied arena, the client off the heap
+static uint8_t server_memory[COAP_ARENA_SIZE(COAP_BUF_MAX_SIZE, 128)];
+static CoapArena server_arena(server_memory, sizeof(server_memory));
+static Coap server(server_udp, server_arena);
+static Coap client(client_udp);
+
+// a caching forward proxy in front of the server
+struct ProxyTraits : CoapDefaultTraits
+{
+    static const bool PROXY = true;
+};
+static PosixUDP proxy_udp;
+static BasicCoap<ProxyTraits> proxy(proxy_udp);
+static char proxy_uri[48];
+
+// a client that keeps NSTART CON requests outstanding and queues the rest
+struct CongestionTraits : CoapDefaultTraits
+{
+    static const bool CONGESTION = true;
+};
+static PosixUDP congested_udp;
+static BasicCoap<CongestionTraits> congested(congested_udp);
+
+// a server and client connected over TCP, whose buffers take a 4 KiB block
+struct TcpTraits : CoapDefaultTraits
+{
+    static const bool TCP = true;
+    static const uint16_t BUF_MAX_SIZE = 4200;
+    static const uint8_t MAX_DEDUP = 1;
+};
+static PosixUDP tcp_server_udp;
+static PosixUDP tcp_client_udp;
+static BasicCoap<TcpTraits> tcp_server(tcp_server_udp);
+static BasicCoap<TcpTraits> tcp_client(tcp_client_udp);
+static PosixTCPClient tcp_accepted;
+static PosixTCPClient tcp_connected;
+
+static char response_payload[POSIX_UDP_MAX_DATAGRAM];
+static int responses_received = 0;
+static int requests_refused = 0;
+// the TCP pair is only polled by its own scenarios, its idle syscalls
+// would slow the others down
+static bool pump_tcp = false;
+static unsigned long handler_calls = 0;
+
+static void handler_bench(CoapPacket &packet, IPAddress ip, int port)
+{
+    handler_calls++;
+    server.sendResponse(ip, port, packet.messageid, response_payload, config.payload_size,
+                        COAP_CONTENT, COAP_TEXT_PLAIN, packet.token, packet.tokenlen);
+}
+
+// The same response encoded in place, without the copy through CoapPacket.
+static void handler_reply(CoapPacket &packet, IPAddress ip, int port)
+{
+    handler_calls++;
+    CoapResponseWriter out = server.reply(packet, ip, port);
+    out.contentFormat(COAP_TEXT_PLAIN);
+    out.write((const uint8_t *)response_payload, config.payload_size);
+    out.send();
+}
+
+static const size_t BLOB_SIZE = 4096;
+
+// 4 KiB resource served block by block.
+static size_t blob_reader(uint32_t offset, uint8_t *buffer, size_t len)
+{
+    memset(buffer, 'b', len);
+    return len;
+}
+
+static void blob_writer(uint32_t offset, const uint8_t *data, size_t len)
+{
+}
+
+static void handler_blob(CoapPacket &packet, IPAddress ip, int port)
+{
+    handler_calls++;
+    server.sendBlockResponse(ip, port, packet, blob_reader, BLOB_SIZE, COAP_CONTENT, COAP_APPLICATION_OCTET_STREAM);
+}
+
+static void handler_tcp_bench(CoapPacket &packet, IPAddress ip, int port)
+{
+    handler_calls++;
+    tcp_server.sendResponse(ip, port, packet.messageid, response_payload, config.payload_size,
+                            COAP_CONTENT, COAP_TEXT_PLAIN, packet.token, packet.tokenlen);
+}
+
+static void handler_tcp_blob(CoapPacket &packet, IPAddress ip, int port)
+{
+    handler_calls++;
+    tcp_server.sendBlockResponse(ip, port, packet, blob_reader, BLOB_SIZE, COAP_CONTENT, COAP_APPLICATION_OCTET_STREAM);
+}
+
+// Deferred requests are acknowledged at once and answered after the server
+// loop, as a slow resource would from a later pass.
+static CoapExchange deferred[64];
+static int deferred_count = 0;
+
+static void handler_deferred(CoapPacket &packet, IPAddress ip, int port)
+{
+    handler_calls++;
+    CoapExchange exchange = server.defer(packet, ip, port);
+    if (deferred_count < (int)(sizeof(deferred) / sizeof(deferred[0])))
+        deferred[deferred_count++] = exchange;
+}
+
+static void respondDeferred()
+{
+    for (int i = 0; i < deferred_count; i++)
+        server.respond(deferred[i], response_payload, config.payload_size, COAP_CONTENT, COAP_TEXT_PLAIN);
+    deferred_count = 0;
+}
+
+static void callback_response(CoapPacket &packet, IPAddress ip, int port)
+{
+    responses_received++;
+}
+
+// Runs both loops until the client has seen the expected responses, or gives
+// up after a second so a dropped datagram does not hang the benchmark.
+static bool pump(int expected)
+{
+    uint64_t deadline = nowNanos() + 1000000000ULL;
+    while (responses_received < expected)
+    {
+        server.loop();
+        respondDeferred();
+        proxy.loop();
+        client.loop();
+        congested.loop();
+        if (pump_tcp)
+        {
+            tcp_server.loop();
+            tcp_client.loop();
+        }
+        if (nowNanos() > deadline)
+            return false;
+    }
+    return true;
+}
+
+// Issues one request and returns how many responses it should produce.
+typedef int (*BenchRequest)(int i);
+
+// A request the library refused produces no response; it is not waited
+// for, but it is reported as lost.
+static int accepted(uint16_t handle)
+{
+    if (handle != 0)
+        return 1;
+    requests_refused++;
+    return 0;
+}
+
+static int request_get(int i)
+{
+    return accepted(client.get(loopback, config.port, "bench"));
+}
+
+static int request_reply(int i)
+{
+    return accepted(client.get(loopback, config.port, "reply"));
+}
+
+static int request_put(int i)
+{
+    return accepted(client.put(loopback, config.port, "bench", response_payload, config.payload_size));
+}
+
+// Every request reuses one message ID, as a client retransmission would, so
+// all but the first are answered from the server's duplicate cache.
+static int request_dup(int i)
+{
+    client.send(loopback, config.port, "bench", COAP_CON, COAP_GET, NULL, 0, NULL, 0, COAP_NONE, 0x4242);
+    return 1;
+}
+
+static void request_done(CoapPacket *response, IPAddress ip, int port, void *context)
+{
+    if (response != NULL)
+        responses_received++;
+}
+
+static int request_callback(int i)
+{
+    return accepted(client.get(loopback, config.port, "bench", request_done));
+}
+
+static int request_deferred(int i)
+{
+    return accepted(client.get(loopback, config.port, "slow", request_done));
+}
+
+// A GET chained to a PUT of its payload, awaited in one coroutine. Its
+// frame is the only allocation.
+static CoapTask chain()
+{
+    CoapPacket *read = co_await coapGet(client, loopback, config.port, "bench");
+    if (read == NULL)
+        co_return;
+    CoapPacket *written = co_await coapPut(client, loopback, config.port, "bench", (const char *)read->payload, read->payloadlen);
+    if (written != NULL)
+        responses_received++;
+}
+
+static int request_await(int i)
+{
+    chain();
+    return 1;
+}
+
+// Through the proxy: a GET is served from its cache after the first one,
+// a PUT is always forwarded to the server.
+static int request_proxied(COAP_METHOD method)
+{
+    CoapPacket request;
+    request.type = COAP_CON;
+    request.code = method;
+    request.addOption(COAP_PROXY_URI, strlen(proxy_uri), (uint8_t *)proxy_uri);
+    if (method == COAP_PUT)
+    {
+        request.payload = (const uint8_t *)response_payload;
+        request.payloadlen = config.payload_size;
+    }
+    return accepted(client.send(loopback, config.port + 2, request, request_done));
+}
+
+static int request_proxy_get(int i)
+{
+    return request_proxied(COAP_GET);
+}
+
+static int request_proxy_put(int i)
+{
+    return request_proxied(COAP_PUT);
+}
+
+static int request_nstart(int i)
+{
+    return accepted(congested.get(loopback, config.port, "bench", request_done));
+}
+
+static int request_tcp(int i)
+{
+    return accepted(tcp_client.get(loopback, config.port, "bench", request_done));
+}
+
+static int request_bert(int i)
+{
+    return accepted(tcp_client.getBlockwise(loopback, config.port, "blob", blob_writer));
+}
+
+static int request_block(int i)
+{
+    return accepted(client.getBlockwise(loopback, config.port, "blob", blob_writer));
+}
+
+static int request_stats(int i)
+{
+    return accepted(client.getBlockwise(loopback, config.port, ".well-known/stats", blob_writer));
+}
+
+static int request_trace(int i)
+{
+    return accepted(client.getBlockwise(loopback, config.port, ".well-known/trace", blob_writer));
+}
+
+// One notification to every observer of "obs", all registered by the client.
+static int request_notify(int i)
+{
+    return server.notify("obs", response_payload, config.payload_size, COAP_TEXT_PLAIN);
+}
+
+struct Scenario
+{
+    const char *name;
+    const char *description;
+    BenchRequest request;
+    int window;       // requests in flight at once
+    bool tcp = false; // runs on the TCP pair
+    // false when the feature it measures is compiled out; the server would
+    // answer 4.04 and the scenario would pass without measuring anything
+    bool available = true;
+};
+
+static const Scenario scenarios[] = {
+    {"get", "CON GET, piggybacked 2.05 response", request_get, 1},
+    {"reply", "CON GET, response encoded in place with Coap::reply()", request_reply, 1},
+    {"put", "CON PUT with payload, piggybacked response", request_put, 1},
+    {"dup", "duplicate CON GET, replayed from the dedup cache", request_dup, 1},
+    {"block", "4 KiB GET with Block2, one request per transfer", request_block, 1},
+    {"burst", "CON GET in windows of 32 outstanding requests", request_get, 32},
+    {"pipeline", "CON GET with a completion callback, COAP_MAX_TRANSACTIONS in flight", request_callback, COAP_MAX_TRANSACTIONS},
+    {"await", "GET then PUT of its payload, chained with co_await", request_await, 1},
+    {"separate", "CON GET answered with an empty ACK and a separate CON response", request_deferred, 1},
+    {"tcp", "GET with a completion callback over TCP", request_tcp, 1, true},
+    {"tcp-pipe", "GET over TCP, COAP_MAX_TRANSACTIONS pipelined on the connection", request_tcp, COAP_MAX_TRANSACTIONS, true},
+    {"bert", "4 KiB GET over TCP, one BERT block per transfer", request_bert, 1, true},
+    {"nstart", "CON GET in windows of 8, sent one at a time by a client with NSTART 1", request_nstart, 8},
+    {"proxy", "CON GET with Proxy-Uri, answered from the proxy cache", request_proxy_get, 1},
+    {"forward", "CON PUT with Proxy-Uri, forwarded by the proxy to the server", request_proxy_put, 1},
+    {"notify", "NON notification fan-out to COAP_MAX_OBSERVERS observers", request_notify, 1},
+    {"stats", "GET /.well-known/stats in CBOR with Block2 (build with -DCOAP_STATS=1)", request_stats, 1, false, COAP_STATS != 0},
+    {"trace", "GET /.well-known/trace as pcap with Block2 (build with -DCOAP_TRACE=1)", request_trace, 1, false, COAP_TRACE != 0},
+};
+
+static void runScenario(const Scenario &s)
+{
+    if (!s.available)
+    {
+        printf("%-10s skipped  (%s)\n", s.name, s.description);
+        return;
+    }
+
+    std::vector<uint64_t> latencies;
+    latencies.reserve(config.requests);
+    int lost = 0;
+    pump_tcp = s.tcp;
+
+    for (int i = 0; i < config.warmup; i += s.window)
+    {
+        responses_received = 0;
+        requests_refused = 0;
+        int expected = 0;
+        for (int w = 0; w < s.window; w++)
+            expected += s.request(i + w);
+        pump(expected);
+    }
+
+    size_t bytes_before = alloc_bytes;
+    size_t count_before = alloc_count;
+    unsigned long calls_before = handler_calls;
+    uint64_t start = nowNanos();
+
+    int done = 0;
+    for (int i = 0; i < config.requests; i += s.window)
+    {
+        responses_received = 0;
+        requests_refused = 0;
+        int expected = 0;
+        uint64_t t0 = nowNanos();
+        for (int w = 0; w < s.window; w++)
+            expected += s.request(i + w);
+        bool complete = expected > 0 && pump(expected);
+        done += responses_received;
+        if (expected > 0 || requests_refused > 0)
+            lost += expected - responses_received + requests_refused;
+        else
+            lost += s.window;
+        if (complete)
+            latencies.push_back(nowNanos() - t0);
+    }
+
+    uint64_t elapsed = nowNanos() - start;
+    size_t bytes = alloc_bytes - bytes_before;
+    size_t count = alloc_count - count_before;
+    unsigned long calls = handler_calls - calls_before;
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t windows = latencies.size();
+    double p50 = windows ? latencies[windows / 2] / 1000.0 : 0;
+    double p99 = windows ? latencies[std::min(windows - 1, windows * 99 / 100)] / 1000.0 : 0;
+
+    printf("%-10s %10.0f req/s  p50 %8.2f us  p99 %8.2f us  %8.1f B/req  %6.2f allocs/req  %7lu handler calls  lost %d  (%s)\n",
+           s.name,
+           done / (elapsed / 1e9),
+           p50, p99,
+           (double)bytes / config.requests,
+           (double)count / config.requests,
+           calls,
+           lost,
+           s.description);
+}
+
+// Spins for config.work_us, as a handler that encodes or signs would.
+static void busyWork()
+{
+    if (config.work_us <= 0)
+        return;
+    uint64_t until = nowNanos() + (uint64_t)config.work_us * 1000;
+    while (nowNanos() < until)
+    {
+    }
+}
+
+static void handler_shard(CoapPacket &packet, IPAddress ip, int port)
+{
+    busyWork();
+    CoapShards::current().sendResponse(ip, port, packet.messageid, response_payload, config.payload_size,
+                                       COAP_CONTENT, COAP_TEXT_PLAIN, packet.token, packet.tokenlen);
+}
+
+static void handler_worker(CoapPacket &packet, IPAddress ip, int port)
+{
+    busyWork();
+    CoapWorkers::current().sendResponse(ip, port, packet.messageid, response_payload, config.payload_size,
+                                        COAP_CONTENT, COAP_TEXT_PLAIN, packet.token, packet.tokenlen);
+}
+
+static void shard_request_done(CoapPacket *response, IPAddress ip, int port, void *context)
+{
+    if (response != NULL)
+        (*(int *)context)++;
+}
+
+struct ShardClient
+{
+    PosixUDP udp;
+    Coap coap;
+    int received = 0;
+    int done = 0;
+    int lost = 0;
+    ShardClient() : coap(udp) {}
+};
+
+// Keeps a window of callback GETs in flight; waits in poll() so that the
+// server threads get the core when there are fewer cores than threads.
+static void runShardClient(ShardClient *c, int requests)
+{
+    struct pollfd pfd;
+    pfd.fd = c->udp.fd();
+    pfd.events = POLLIN;
+
+    for (int i = 0; i < requests; i += COAP_MAX_TRANSACTIONS)
+    {
+        c->received = 0;
+        int expected = 0;
+        int refused = 0;
+        for (int w = 0; w < COAP_MAX_TRANSACTIONS; w++)
+        {
+            if (c->coap.get(loopback, config.port, "bench", shard_request_done, &c->received) != 0)
+                expected++;
+            else
+                refused++;
+        }
+        uint64_t deadline = nowNanos() + 1000000000ULL;
+        while (c->received < expected && nowNanos() < deadline)
+        {
+            poll(&pfd, 1, 1);
+            c->coap.loop();
+        }
+        c->done += c->received;
+        c->lost += expected - c->received + refused;
+        // drop what is still pending so the next window starts empty
+        for (int w = 0; w < COAP_MAX_TRANSACTIONS; w++)
+            c->coap.loop();
+    }
+}
+
+// Loads the server on config.port from clients_count client threads. Returns
+// false if a client port cannot be bound.
+static bool runClients(int clients_count, uint64_t &elapsed, size_t &bytes, int &done, int &lost)
+{
+    std::vector<std::unique_ptr<ShardClient>> clients;
+    for (int i = 0; i < clients_count; i++)
+    {
+        clients.emplace_back(new ShardClient());
+        if (!clients[i]->coap.start(config.port + 1 + i))
+        {
+            fprintf(stderr, "cannot bind 127.0.0.1:%u\n", config.port + 1 + i);
+            return false;
+        }
+        clients[i]->udp.setBatchSize(config.batch);
+    }
+
+    std::vector<std::thread> workers;
+    for (auto &c : clients)
+        workers.emplace_back(runShardClient, c.get(), config.warmup / clients_count);
+    for (auto &w : workers)
+        w.join();
+    workers.clear();
+    for (auto &c : clients)
+        c->done = c->lost = 0;
+
+    size_t bytes_before = alloc_bytes;
+    uint64_t start = nowNanos();
+    for (auto &c : clients)
+        workers.emplace_back(runShardClient, c.get(), config.requests / clients_count);
+    for (auto &w : workers)
+        w.join();
+    elapsed = nowNanos() - start;
+    bytes = alloc_bytes - bytes_before;
+
+    done = lost = 0;
+    for (auto &c : clients)
+    {
+        done += c->done;
+        lost += c->lost;
+    }
+    return true;
+}
+
+static bool runShards(int threads)
+{
+    CoapShards shards(threads, config.batch);
+    shards.server(handler_shard, "bench");
+    if (!shards.start(config.port))
+    {
+        fprintf(stderr, "cannot bind 127.0.0.1:%u with SO_REUSEPORT\n", config.port);
+        return false;
+    }
+
+    uint64_t elapsed = 0;
+    size_t bytes = 0;
+    int done = 0, lost = 0;
+    if (!runClients(threads, elapsed, bytes, done, lost))
+        return false;
+    shards.stop();
+
+    printf("shards %-3d %10.0f req/s  %8.1f B/req  lost %d  (%d server + %d client threads)\n",
+           threads, done / (elapsed / 1e9), (double)bytes / (done ? done : 1), lost, threads, threads);
+    return true;
+}
+
+static bool runWorkers(int threads)
+{
+    CoapWorkers workers(threads, config.batch);
+    workers.server(handler_worker, "bench");
+    if (!workers.start(config.port))
+    {
+        fprintf(stderr, "cannot bind 127.0.0.1:%u\n", config.port);
+        return false;
+    }
+
+    uint64_t elapsed = 0;
+    size_t bytes = 0;
+    int done = 0, lost = 0;
+    if (!runClients(config.workers, elapsed, bytes, done, lost))
+        return false;
+    workers.stop();
+
+    printf("workers %-3d %9.0f req/s  %8.1f B/req  lost %d  (1 I/O + %d handler threads, %d client threads)\n",
+           threads, done / (elapsed / 1e9), (double)bytes / (done ? done : 1), lost, threads, config.workers);
+    return true;
+}
+
+// Counters and the median of each histogram, from the 2^i us bucket bounds.
+static void printStats(const CoapStats &stats)
+{
+    static const char *const timings[COAP_TIMING_COUNT] = {"parse", "dispatch", "handler", "send"};
+    printf("server stats: rx %lu, tx %lu, requests %lu, duplicates %lu, not found %lu, tx failed %lu\n",
+           (unsigned long)stats.counters[COAP_STAT_RX], (unsigned long)stats.counters[COAP_STAT_TX],
+           (unsigned long)stats.counters[COAP_STAT_REQUESTS], (unsigned long)stats.counters[COAP_STAT_DUPLICATES],
+           (unsigned long)stats.counters[COAP_STAT_NOT_FOUND], (unsigned long)stats.counters[COAP_STAT_TX_FAILED]);
+    for (int t = 0; t < COAP_TIMING_COUNT; t++)
+    {
+        const CoapHistogram &h = stats.timings[t];
+        uint64_t total = 0, seen = 0;
+        for (int b = 0; b < COAP_STATS_BUCKETS; b++)
+            total += h.buckets[b];
+        int median = 0;
+        for (; median < COAP_STATS_BUCKETS - 1; median++)
+            if ((seen += h.buckets[median]) * 2 >= total)
+                break;
+        printf("  %-9s %10lu samples, median < %lu us\n", timings[t], (unsigned long)total, 1UL << median);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n requests] [-w warmup] [-s payload_size] [-p port] [-b batch] [-t threads] [-W workers] [-c work_us] [-o trace.pcap] [scenario...]\n", prog);
+    fprintf(stderr, "scenarios:\n");
+    for (const Scenario &s : scenarios)
+        fprintf(stderr, "  %-10s %s\n", s.name, s.description);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<const Scenario *> selected;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            config.requests = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            config.warmup = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            config.payload_size = (size_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            config.port = (uint16_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            config.batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            config.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc)
+            config.workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            config.work_us = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            config.trace_file = argv[++i];
+        else if (argv[i][0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            const Scenario *found = NULL;
+            for (const Scenario &s : scenarios)
+                if (strcmp(s.name, argv[i]) == 0)
+                    found = &s;
+            if (found == NULL)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            selected.push_back(found);
+        }
+    }
+    if (selected.empty())
+        for (const Scenario &s : scenarios)
+            selected.push_back(&s);
+
+    if (config.payload_size > sizeof(response_payload))
+        config.payload_size = sizeof(response_payload);
+    memset(response_payload, 'x', sizeof(response_payload));
+
+    if (config.workers > 0)
+    {
+        printf("coap-simple pipeline loopback benchmark: %d requests, %zu byte payload, %d us work, batch %d, %u cores\n",
+               config.requests, config.payload_size, config.work_us, config.batch, std::thread::hardware_concurrency());
+        for (int t = 1; t < config.workers; t *= 2)
+            if (!runWorkers(t))
+                return 1;
+        return runWorkers(config.workers) ? 0 : 1;
+    }
+
+    if (config.threads > 0)
+    {
+        printf("coap-simple sharded loopback benchmark: %d requests, %zu byte payload, %d us work, batch %d, %u cores\n",
+               config.requests, config.payload_size, config.work_us, config.batch, std::thread::hardware_concurrency());
+        for (int t = 1; t < config.threads; t *= 2)
+            if (!runShards(t))
+                return 1;
+        return runShards(config.threads) ? 0 : 1;
+    }
+
+    if (!server_udp.begin(config.port) || !client_udp.begin(config.port + 1) || !proxy_udp.begin(config.port + 2) ||
+        !congested_udp.begin(config.port + 3))
+    {
+        fprintf(stderr, "cannot bind 127.0.0.1:%u\n", config.port);
+        return 1;
+    }
+    PosixTCPServer tcp_listener(config.port);
+    if (!tcp_server_udp.begin(config.port + 4) || !tcp_client_udp.begin(config.port + 5) || !tcp_listener.begin() ||
+        !tcp_connected.connect(loopback, config.port) || !tcp_listener.accept(tcp_accepted) ||
+        !tcp_client.attach(tcp_connected, loopback, config.port) ||
+        !tcp_server.attach(tcp_accepted, tcp_accepted.remoteIP(), tcp_accepted.remotePort()))
+    {
+        fprintf(stderr, "cannot connect over TCP to 127.0.0.1:%u\n", config.port);
+        return 1;
+    }
+    server_udp.setBatchSize(config.batch);
+    client_udp.setBatchSize(config.batch);
+    server.server(handler_bench, "bench");
+    server.server(handler_reply, "reply");
+    server.server(handler_blob, "blob");
+    server.server(handler_deferred, "slow");
+    tcp_server.server(handler_tcp_bench, "bench");
+    tcp_server.server(handler_tcp_blob, "blob");
+    tcp_client.response(callback_response);
+    for (int i = 0; i < COAP_MAX_OBSERVERS; i++)
+    {
+        uint8_t token[2] = {(uint8_t)(i >> 8), (uint8_t)i};
+        server.addObserver("obs", loopback, config.port + 1, token, sizeof(token));
+    }
+    client.response(callback_response);
+    snprintf(proxy_uri, sizeof(proxy_uri), "coap://127.0.0.1:%u/bench", config.port);
+
+    printf("coap-simple loopback benchmark: %d requests, %zu byte payload, COAP_BUF_MAX_SIZE %d, batch %d\n",
+           config.requests, config.payload_size, COAP_BUF_MAX_SIZE, config.batch);
+    for (const Scenario *s : selected)
+        runScenario(*s);
+    printf("server arena: %zu of %zu bytes, high-water %zu\n",
+           server_arena.bytesUsed(), server_arena.capacity(), server_arena.highWater());
+    if (server.getStats() != NULL)
+        printStats(*server.getStats());
+    if (config.trace_file != NULL)
+    {
+        PosixFile file;
+        if (server.getTrace() == NULL || !file.open(config.trace_file))
+        {
+            fprintf(stderr, "cannot write the trace to %s (build with -DCOAP_TRACE=1)\n", config.trace_file);
+            return 1;
+        }
+        size_t size = server.dumpTrace(file);
+        printf("server trace: %lu messages, last %d in %s (%zu bytes)\n", (unsigned long)server.getTrace()->recorded,
+               COAP_TRACE_ENTRIES, config.trace_file, size);
+    }
+
+    return 0;
+}